@@ -44,9 +44,12 @@ main (int argc, char **argv)
 
   const gchar *config = NULL;
   const gchar *dbus_type = NULL;
+  gint worker_fd = -1;
   GOptionEntry entries[] = {
     {"config", 'c', 0, G_OPTION_ARG_FILENAME, &config, NULL, NULL},
     {"dbus-type", 0, 0, G_OPTION_ARG_STRING, &dbus_type, NULL, NULL},
+    {"worker-fd", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_INT, &worker_fd, NULL,
+        NULL},
     {NULL}
   };
 
@@ -61,10 +64,14 @@ main (int argc, char **argv)
   }
 
   g_debug ("dbus-type: %s", dbus_type);
+  /* Workers are spawned by the agent and must not take over its
+   * application id. */
   app = G_APPLICATION (g_object_new (GAEUL_TYPE_MJPEG_APPLICATION,
           "application-id", GAEUL_MJPEG_APPLICATION_SCHEMA_ID,
-          "config-path", config, "dbus-type",
-          gaeul_application_dbus_type_get_by_name (dbus_type), NULL));
+          "flags", worker_fd >= 0 ? G_APPLICATION_NON_UNIQUE :
+          G_APPLICATION_FLAGS_NONE, "config-path", config, "dbus-type",
+          gaeul_application_dbus_type_get_by_name (dbus_type), "worker-fd",
+          worker_fd, NULL));
 
   g_unix_signal_add (SIGINT, (GSourceFunc) intr_handler, app);
 
@@ -19,19 +19,39 @@
 #include "config.h"
 
 #include "gaeul.h"
+#include "tuple.h"
+#include "types.h"
 
 #include "mjpeg/mjpeg-application.h"
+#include "mjpeg/mjpeg-lease.h"
+#include "mjpeg/mjpeg-mosaic.h"
 #include "mjpeg/mjpeg-request.h"
+#include "mjpeg/mjpeg-transcoder.h"
+#include "mjpeg/mjpeg-worker.h"
 
 #include "mjpeg/mjpeg-generated.h"
+#include "mjpeg/mjpeg-worker-generated.h"
 
 #include <glib/gi18n.h>
 #include <gmodule.h>
+#include <gio/gunixfdlist.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
 #include <gst/gst.h>
 #include <libsoup/soup.h>
 #include <libsoup/soup-server.h>
 
+/* in seconds */
+#define MJPEG_RATE_ADAPTATION_INTERVAL  1
+#define MJPEG_SOURCE_WATCH_INTERVAL     1
+#define MJPEG_LOAD_CONTROL_INTERVAL     2
+
+/* Degraded pipelines are restored once the processor load falls below
+ * this share in percent of cpu-budget, so that they don't flap around
+ * it. */
+#define MJPEG_LOAD_RESTORE_SHARE        75
+
 typedef enum
 {
   PROP_EXTERNAL_URL = 1,
@@ -39,6 +59,8 @@ typedef enum
   PROP_LIMIT_SRT_CONNECTIONS,
   PROP_LIMIT_USER_SESSIONS,
   PROP_LIMIT_SESSIONS_PER_USER,
+  PROP_LIMIT_HTTP_CLIENTS,
+  PROP_WORKER_FD,
 
   /*< private > */
   PROP_LAST
@@ -46,27 +68,80 @@ typedef enum
 
 static GParamSpec *properties[PROP_LAST] = { NULL };
 
-/* *INDENT-OFF* */
-#define GST_SRTSRC_PIPELINE_DESC \
-    "srtsrc name=src uri=\"%s\" latency=%d ! queue ! tsdemux latency=%d ! h264parse ! decodebin ! " \
-    "videoconvert ! videoscale ! videorate ! " \
-    "video/x-raw, framerate=%d/1, width=%d, height=%d ! " \
-    "videoflip name=flip video-direction=%u ! " \
-    "videoflip name=orientation video-direction=%u ! " \
-    "jpegenc ! " \
-    "multipartmux boundary=endofsection ! multisocketsink name=msocksink sync=false"
-/* *INDENT-ON* */
-
 struct _GaeulMjpegApplication
 {
   GaeulApplication parent;
 
   SoupServer *soup_server;
 
+  /* The HTTP server is served by its own thread, so that accepting and
+   * answering clients never waits for the pipeline control done in the
+   * main context. */
+  GMainContext *http_context;
+  GMainLoop *http_loop;
+  GThread *http_thread;
+
+  /* request ids the HTTP thread may serve with their leases, guarded by
+   * http_lock */
+  GMutex http_lock;
+  GHashTable *http_request_ids;
+
+  /* the timer wheel of the leases, guarded by http_lock */
+  GaeulMjpegLeaseWheel lease_wheel;
+  gint64 lease_time;
+  guint lease_timeout_id;
+  guint n_reaped_sessions;
+
+  /* sockets handed over from the HTTP thread to the pipelines */
+  GAsyncQueue *pending_clients;
+  gint pending_clients_scheduled;
+
+  /* transcoders being built, keyed by (uid, rid), with the Start calls
+   * waiting for them */
+  GHashTable *transcoder_builds;
+
+  /* stopping a pipeline waits for its streaming threads, so the last
+   * reference of a transcoder is dropped here */
+  GThreadPool *teardown_pool;
+
+  /* worker mode: the connection to the agent that spawned this process */
+  gint worker_fd;
+  GDBusConnection *worker_connection;
+  Gaeul2DBusMJPEGWorker *worker_service;
+
+  /* supervisor mode: the worker processes, the worker of each request id
+   * (guarded by http_lock) and the worker of each uid and rid */
+  GPtrArray *workers;
+  GHashTable *worker_requests;
+  GaeulTuple *worker_placements;
+  guint n_worker_placements;
+  guint respawn_timeout_id;
+
   Gaeul2DBusMJPEGService *service;
 
   GHashTable *request_ids;
   GHashTable *pipelines;
+  GaeulTuple *transcoders;
+  guint n_transcoders;
+
+  /* request ids of each uid, keyed by the interned uid of the requests */
+  GHashTable *uid_request_ids;
+
+  /* mosaics keyed by their request id, and the SRT connections of their
+   * tiles */
+  GHashTable *mosaics;
+  guint n_mosaic_tiles;
+
+  /* admission control */
+  gint n_http_clients;
+
+  /* idle pipelines kept warm after their last Stop, least recently used
+   * first */
+  GQueue lingering;
+  guint linger_timeout_id;
+#if GLIB_CHECK_VERSION(2,64,0)
+  GMemoryMonitor *memory_monitor;
+#endif
 
   GSettings *settings;
 
@@ -76,47 +151,325 @@ struct _GaeulMjpegApplication
   guint limit_user_sessions;
   guint limit_sessions_per_user;
 
+  /* read by the HTTP thread, 0 doesn't limit the HTTP clients */
+  gint limit_http_clients;
+
   gchar *local_ip;
 
+  /* moves clients between the frame rates of their branch */
+  guint rate_adaptation_timeout_id;
+
+  /* holds the last frames and reconnects the sources that stalled */
+  guint source_watch_timeout_id;
+
+  /* Degrades the pipelines of the lowest priority while the process takes
+   * more of the processors than cpu-budget, and restores them once it
+   * takes less. The load is in percent of the processor time of every
+   * core the process may run on. */
+  guint load_control_timeout_id;
+  gint64 last_load_time;
+  gint64 last_cpu_time;
+  guint cpu_load;
+
   /* statistics */
   guint stats_timeout_id;
-  GList *client_sockets;
 
+  guint n_srtconnections;
+  guint n_httpconnections;
   guint64 srt_bytes_received;
   guint64 http_bytes_sent;
+
+  /* bytes of the transcoders that were already stopped */
+  guint64 srt_bytes_received_stopped;
+  guint64 http_bytes_sent_stopped;
+
+  guint linger_hits;
+  guint linger_misses;
+  guint linger_evictions;
+  gint64 linger_latency_saved;
+  gint64 cold_start_total;
+  guint cold_start_count;
+
+  /* time from the first HTTP client to the first frame sent */
+  guint n_lazy_first_frames;
+  guint64 lazy_first_frame_time;
+  guint n_eager_first_frames;
+  guint64 eager_first_frame_time;
 };
 
+/* A transcoding branch for one distinct request, shared by all the
+ * sessions (request ids) that asked for the same output. */
+typedef struct
+{
+  GaeulMjpegRequest *request;
+  GaeulMjpegTranscoder *transcoder;
+  guint n_sessions;
+
+  /* time spent on building the branch and its transcoder */
+  gint64 build_time;
+  gboolean cold_start_sampled;
+
+  /* set when the pipeline was started ahead of its first client */
+  gboolean eager;
+  gboolean first_frame_sampled;
+
+  /* set while the pipeline is idle in the linger pool */
+  GList *linger_link;
+  gint64 linger_deadline;
+
+  /* the highest priority its sessions were started with, how far it is
+   * degraded under load, and the processor time its encoder took per
+   * second at the last load control */
+  guint priority;
+  guint degradation;
+  guint64 cost;
+} GaeulMjpegPipeline;
+
 /* *INDENT-OFF* */
 G_DEFINE_TYPE (GaeulMjpegApplication, gaeul_mjpeg_application, GAEUL_TYPE_APPLICATION)
 /* *INDENT-ON* */
 
-static gchar *
-_build_srtsrc_pipeline_desc (const gchar * relay_uri,
-    GaeulMjpegRequest * request)
+static void _publish_admission_usage (GaeulMjpegApplication * self);
+static void _publish_http_client_usage (GaeulMjpegApplication * self);
+
+typedef struct
+{
+  GaeulMjpegApplication *app;
+  gchar *request_id;
+  GSocket *socket;
+
+  /* the client of the socket, only valid on the HTTP thread until the
+   * headers are sent */
+  SoupClientContext *context;
+
+  /* the connection taken from libsoup, for the pipeline or the worker
+   * streaming to it */
+  GIOStream *connection;
+} GaeulMjpegHttpClient;
+
+/* The connection of a client attached locally is kept with its socket
+ * until the client is removed for good. */
+#define MJPEG_CONNECTION_KEY            "gaeul-mjpeg-connection"
+
+static GaeulMjpegHttpClient *
+_http_client_new (GaeulMjpegApplication * app, const gchar * request_id,
+    GSocket * socket)
+{
+  GaeulMjpegHttpClient *client = g_new0 (GaeulMjpegHttpClient, 1);
+
+  client->app = app;
+  client->request_id = g_strdup (request_id);
+  client->socket = g_object_ref (socket);
+
+  return client;
+}
+
+static void
+_http_client_free (GaeulMjpegHttpClient * client)
+{
+  g_free (client->request_id);
+  g_object_unref (client->socket);
+  g_clear_object (&client->connection);
+  g_free (client);
+}
+
+static void
+_http_client_closure_free (gpointer data, GClosure * closure)
+{
+  _http_client_free (data);
+}
+
+/* A request is reaped once it saw neither HTTP activity nor KeepAlive
+ * for session-lease-time. Must be called with http_lock. */
+static void
+_lease_renew (GaeulMjpegApplication * self, GaeulMjpegLease * lease)
+{
+  if (self->lease_time == 0) {
+    return;
+  }
+
+  gaeul_mjpeg_lease_wheel_renew (&self->lease_wheel, lease,
+      g_get_monotonic_time () + self->lease_time);
+}
+
+/* Publishes @request_id to the HTTP thread, with a fresh lease. */
+static void
+_http_add_request_id (GaeulMjpegApplication * self, const gchar * request_id)
+{
+  GaeulMjpegLease *lease = gaeul_mjpeg_lease_new (request_id);
+
+  g_mutex_lock (&self->http_lock);
+  _lease_renew (self, lease);
+  g_hash_table_insert (self->http_request_ids, g_strdup (request_id), lease);
+  g_mutex_unlock (&self->http_lock);
+}
+
+static gboolean
+_http_has_request_id (GaeulMjpegApplication * self, const gchar * request_id)
+{
+  gboolean found = FALSE;
+
+  g_mutex_lock (&self->http_lock);
+  found = g_hash_table_contains (self->http_request_ids, request_id);
+  g_mutex_unlock (&self->http_lock);
+
+  return found;
+}
+
+static gboolean
+_attach_client (GaeulMjpegApplication * self, const gchar * request_id,
+    GSocket * socket)
+{
+  GaeulMjpegPipeline *pipeline = NULL;
+  GaeulMjpegRequest *r = NULL;
+  GaeulMjpegMosaic *mosaic = NULL;
+
+  if ((mosaic = g_hash_table_lookup (self->mosaics, request_id)) != NULL) {
+    return gaeul_mjpeg_mosaic_add_client (mosaic, socket);
+  }
+
+  /* The request may have been stopped while the headers were being sent. */
+  if ((r = g_hash_table_lookup (self->request_ids, request_id)) == NULL ||
+      (pipeline = g_hash_table_lookup (self->pipelines, r)) == NULL) {
+    g_info ("request is gone before streaming (id: %s)", request_id);
+    return FALSE;
+  }
+
+  if (!gaeul_mjpeg_transcoder_add_client (pipeline->transcoder, r, socket)) {
+    return FALSE;
+  }
+
+  gaeul_mjpeg_transcoder_play (pipeline->transcoder);
+
+  return TRUE;
+}
+
+/* The connection of the client is closed when its worker can't take it,
+ * as nothing else streams to it. */
+static void
+_supervisor_attach_client (GaeulMjpegApplication * self,
+    GaeulMjpegHttpClient * client)
+{
+  GaeulMjpegWorker *worker = NULL;
+
+  g_mutex_lock (&self->http_lock);
+  worker = g_hash_table_lookup (self->worker_requests, client->request_id);
+  g_mutex_unlock (&self->http_lock);
+
+  if (worker == NULL || !gaeul_mjpeg_worker_add_client (worker,
+          client->request_id, client->socket, client->connection)) {
+    g_info ("request is gone before streaming (id: %s)", client->request_id);
+    g_io_stream_close (client->connection, NULL, NULL);
+  }
+}
+
+static gboolean
+_close_connection (gpointer user_data)
+{
+  g_autoptr (GIOStream) connection = user_data;
+
+  g_io_stream_close (connection, NULL, NULL);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Closes the connection of a client of a local pipeline, once it is removed
+ * for good. The sink may still hold the socket while it emits the removal
+ * from its streaming thread, so it is closed from the main context. */
+static void
+_release_connection (GSocket * socket)
 {
-  g_autofree gchar *pipeline_desc = NULL;
+  GIOStream *connection =
+      g_object_steal_data (G_OBJECT (socket), MJPEG_CONNECTION_KEY);
 
-  pipeline_desc = g_strdup_printf (GST_SRTSRC_PIPELINE_DESC,
-      relay_uri, request->protocol_latency, request->demux_latency,
-      request->fps, request->width, request->height, request->flip,
-      request->orientation);
+  if (connection != NULL) {
+    g_main_context_invoke (NULL, _close_connection, connection);
+  }
+}
+
+static void
+_local_attach_client (GaeulMjpegApplication * self,
+    GaeulMjpegHttpClient * client)
+{
+  if (client->connection != NULL) {
+    g_object_set_data (G_OBJECT (client->socket), MJPEG_CONNECTION_KEY,
+        g_object_ref (client->connection));
+  }
+
+  if (!_attach_client (self, client->request_id, client->socket)) {
+    _release_connection (client->socket);
+  }
+}
+
+/* Runs in the main context, where the pipelines live. Mosaics are composed
+ * by the agent itself, also when the transcoders run on workers. */
+static gboolean
+_attach_pending_clients (gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+  GaeulMjpegHttpClient *client = NULL;
+
+  g_atomic_int_set (&self->pending_clients_scheduled, 0);
+
+  while ((client = g_async_queue_try_pop (self->pending_clients)) != NULL) {
+    if (self->workers != NULL && client->connection != NULL &&
+        !g_hash_table_contains (self->mosaics, client->request_id)) {
+      _supervisor_attach_client (self, client);
+    } else {
+      _local_attach_client (self, client);
+    }
+    _http_client_free (client);
+  }
 
-  return g_steal_pointer (&pipeline_desc);
+  return G_SOURCE_REMOVE;
 }
 
 static void
 gaeul_mjpeg_http_message_wrote_headers_cb (SoupMessage * msg,
     gpointer user_data)
 {
-  GstElement *pipeline = user_data;
+  GaeulMjpegHttpClient *client = user_data;
+  GaeulMjpegApplication *self = client->app;
+  GaeulMjpegHttpClient *pending = NULL;
+  GaeulMjpegLease *lease = NULL;
 
   g_debug ("wrote_headers");
 
-  if (GST_STATE (pipeline) != GST_STATE_PLAYING) {
-    gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  g_mutex_lock (&self->http_lock);
+  if ((lease = g_hash_table_lookup (self->http_request_ids,
+              client->request_id)) != NULL) {
+    lease->arrival_deadline = 0;
+    _lease_renew (self, lease);
+  }
+  g_mutex_unlock (&self->http_lock);
+
+  pending = _http_client_new (self, client->request_id, client->socket);
+
+  /* The stream never ends for libsoup, which would keep the connection
+   * open along with its message for as long as the agent runs. So the
+   * connection is taken from it, and closed once the client is removed.
+   * This may finalize the message, and @client along with it. */
+  pending->connection = soup_client_context_steal_connection (client->context);
+
+  /* The socket is handed to the sink only once the HTTP headers are out,
+   * as the sink starts the client with the most recent frame right away.
+   * Clients arriving together are attached by a single dispatch. */
+  g_async_queue_push (self->pending_clients, pending);
+
+  if (g_atomic_int_compare_and_exchange (&self->pending_clients_scheduled, 0,
+          1)) {
+    g_main_context_invoke (NULL, _attach_pending_clients, self);
   }
 }
 
+static gboolean
+_http_admit_client (GaeulMjpegApplication * self)
+{
+  gint limit = g_atomic_int_get (&self->limit_http_clients);
+
+  return limit == 0 || g_atomic_int_get (&self->n_http_clients) < limit;
+}
+
 static void
 gaeul_mjpeg_http_request_cb (SoupServer * server, SoupMessage * msg,
     const char *path, GHashTable * query, SoupClientContext * client_ctx,
@@ -124,16 +477,9 @@ gaeul_mjpeg_http_request_cb (SoupServer * server, SoupMessage * msg,
 {
   GaeulMjpegApplication *self = user_data;
 
-  GstElement *pipeline = NULL;
-  g_autoptr (GstElement) sink = NULL;
-  g_autoptr (GstElement) src = NULL;
-  g_autofree gchar *uid = NULL;
-  g_autofree gchar *rid = NULL;
-  g_autoptr (GError) error = NULL;
-  g_autoptr (GVariant) lookup_data = NULL;
+  GaeulMjpegHttpClient *client = NULL;
 
   g_autofree gchar *request_id = NULL;
-  GaeulMjpegRequest *r = NULL;
 
   if (!g_str_has_prefix (path, "/mjpeg/")) {
     soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
@@ -145,17 +491,17 @@ gaeul_mjpeg_http_request_cb (SoupServer * server, SoupMessage * msg,
 
   g_debug ("requested transcoding stream (id: %s)", request_id);
 
-  if ((r = g_hash_table_lookup (self->request_ids, request_id)) == NULL) {
+  /* Every started request has its pipeline, so the published ids are
+   * all this thread needs to know. */
+  if (!_http_has_request_id (self, request_id)) {
     g_info ("invalid request (id: %s)", request_id);
     soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
     return;
   }
 
-  pipeline = g_hash_table_lookup (self->pipelines, r);
-
-  if (pipeline == NULL) {
-    g_info ("no proper pipeline is found (id: %s)", request_id);
-    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+  if (!_http_admit_client (self)) {
+    g_info ("too many http clients, rejecting (id: %s)", request_id);
+    soup_message_set_status (msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
     return;
   }
 
@@ -171,13 +517,13 @@ gaeul_mjpeg_http_request_cb (SoupServer * server, SoupMessage * msg,
       "Access-Control-Allow-Origin", "*");
   soup_message_set_status (msg, SOUP_STATUS_OK);
 
-  sink = gst_bin_get_by_name (GST_BIN (pipeline), "msocksink");
-
-  g_signal_emit_by_name (sink, "add",
+  client = _http_client_new (self, request_id,
       soup_client_context_get_gsocket (client_ctx));
+  client->context = client_ctx;
 
-  g_signal_connect (G_OBJECT (msg), "wrote-headers",
-      G_CALLBACK (gaeul_mjpeg_http_message_wrote_headers_cb), pipeline);
+  g_signal_connect_data (G_OBJECT (msg), "wrote-headers",
+      G_CALLBACK (gaeul_mjpeg_http_message_wrote_headers_cb), client,
+      _http_client_closure_free, 0);
 }
 
 static void
@@ -186,157 +532,756 @@ gaeul_mjpeg_application_dispose (GObject * object)
   GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (object);
 
   g_clear_object (&self->settings);
+#if GLIB_CHECK_VERSION(2,64,0)
+  if (self->memory_monitor != NULL) {
+    g_signal_handlers_disconnect_by_data (self->memory_monitor, self);
+    g_clear_object (&self->memory_monitor);
+  }
+#endif
+  g_queue_clear (&self->lingering);
+  if (self->teardown_pool != NULL) {
+    g_thread_pool_free (self->teardown_pool, FALSE, TRUE);
+    self->teardown_pool = NULL;
+  }
+  g_clear_pointer (&self->transcoder_builds, g_hash_table_unref);
+  g_clear_pointer (&self->worker_requests, g_hash_table_unref);
+  g_clear_object (&self->worker_service);
+  g_clear_object (&self->worker_placements);
   g_clear_pointer (&self->pipelines, g_hash_table_unref);
   g_clear_pointer (&self->request_ids, g_hash_table_unref);
+  g_clear_pointer (&self->uid_request_ids, g_hash_table_unref);
+  g_clear_object (&self->transcoders);
+  g_clear_pointer (&self->mosaics, g_hash_table_unref);
 
   soup_server_disconnect (self->soup_server);
   g_clear_object (&self->soup_server);
+  g_clear_pointer (&self->http_loop, g_main_loop_unref);
+  g_clear_pointer (&self->http_context, g_main_context_unref);
+
+  if (self->pending_clients != NULL) {
+    GaeulMjpegHttpClient *client = NULL;
+
+    while ((client = g_async_queue_try_pop (self->pending_clients)) != NULL) {
+      _http_client_free (client);
+    }
+    g_clear_pointer (&self->pending_clients, g_async_queue_unref);
+  }
+
+  g_clear_pointer (&self->http_request_ids, g_hash_table_unref);
 
   G_OBJECT_CLASS (gaeul_mjpeg_application_parent_class)->dispose (object);
 }
 
 static void
-_collect_stats (gpointer key, gpointer value, gpointer user_data)
+_collect_stats (const gchar * uid, const gchar * rid, GObject * object,
+    gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+  GaeulMjpegTranscoder *transcoder = GAEUL_MJPEG_TRANSCODER (object);
+
+  self->srt_bytes_received +=
+      gaeul_mjpeg_transcoder_get_bytes_received (transcoder);
+  self->http_bytes_sent += gaeul_mjpeg_transcoder_get_bytes_sent (transcoder);
+  self->n_httpconnections += gaeul_mjpeg_transcoder_get_n_clients (transcoder);
+  self->n_srtconnections++;
+}
+
+static void
+_collect_mosaic_stats (gpointer key, GaeulMjpegMosaic * mosaic,
+    GaeulMjpegApplication * self)
+{
+  self->srt_bytes_received += gaeul_mjpeg_mosaic_get_bytes_received (mosaic);
+  self->http_bytes_sent += gaeul_mjpeg_mosaic_get_bytes_sent (mosaic);
+  self->n_httpconnections += gaeul_mjpeg_mosaic_get_n_clients (mosaic);
+  self->n_srtconnections += gaeul_mjpeg_mosaic_get_n_tiles (mosaic);
+}
+
+static void
+_adapt_client_rates (const gchar * uid, const gchar * rid, GObject * object,
+    gpointer user_data)
+{
+  gaeul_mjpeg_transcoder_adapt_client_rates (GAEUL_MJPEG_TRANSCODER (object));
+}
+
+static void
+_watch_source (const gchar * uid, const gchar * rid, GObject * object,
+    gpointer user_data)
+{
+  gaeul_mjpeg_transcoder_watch_source (GAEUL_MJPEG_TRANSCODER (object));
+}
+
+static gboolean
+_source_watch_timeout (gpointer user_data)
 {
   GaeulMjpegApplication *self = user_data;
-  GstElement *pipeline = value;
 
-  g_autoptr (GstElement) src = NULL;
-  g_autoptr (GstElement) sink = NULL;
-  g_autoptr (GstStructure) s1 = NULL;
-  g_autoptr (GstStructure) s2 = NULL;
-  g_autofree gchar *str = NULL;
-  GList *l = NULL;
-  guint64 srt_received = 0;
-  guint64 http_sent = 0;
+  gaeul_tuple_foreach (self->transcoders, _watch_source, NULL);
 
-  src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
-  sink = gst_bin_get_by_name (GST_BIN (pipeline), "msocksink");
+  return G_SOURCE_CONTINUE;
+}
 
-  g_object_get (src, "stats", &s1, NULL);
+static gint64
+_get_process_cpu_time (void)
+{
+  struct rusage usage;
 
-  if (gst_structure_get_uint64 (s1, "bytes-received-total", &srt_received)) {
-    self->srt_bytes_received += srt_received;
+  if (getrusage (RUSAGE_SELF, &usage) < 0) {
+    return 0;
   }
 
-  for (l = self->client_sockets; l != NULL; l = l->next) {
-    g_signal_emit_by_name (sink, "get-stats", l->data, &s2, NULL);
+  return (gint64) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+      G_USEC_PER_SEC + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
 
-    if (gst_structure_get_uint64 (s2, "bytes-sent", &http_sent)) {
-      self->http_bytes_sent += http_sent;
-    }
+/* Pipelines of a lower priority are degraded first, and the ones whose
+ * encoder takes the most time first among those of the same priority. */
+static gboolean
+_pipeline_degrades_before (GaeulMjpegPipeline * pipeline,
+    GaeulMjpegPipeline * other)
+{
+  if (other == NULL) {
+    return TRUE;
   }
 
-  {
-    gint n_srtconnections = g_hash_table_size (self->pipelines);
-    gint n_httpconnections = g_list_length (self->client_sockets);
-    g_autoptr (GVariant) overall_stats = NULL;
+  if (pipeline->priority != other->priority) {
+    return pipeline->priority < other->priority;
+  }
+
+  return pipeline->cost > other->cost;
+}
+
+static void
+_pipeline_set_degradation (GaeulMjpegApplication * self,
+    GaeulMjpegPipeline * pipeline, guint level)
+{
+  if (!gaeul_mjpeg_transcoder_set_degradation (pipeline->transcoder,
+          pipeline->request, level)) {
+    return;
+  }
 
-    gaeul2_dbus_mjpegservice_set_number_of_httpconnections (self->service,
-        n_httpconnections);
-    gaeul2_dbus_mjpegservice_set_number_of_srtconnections (self->service,
-        n_srtconnections);
-    gaeul2_dbus_mjpegservice_set_total_bytes_received (self->service,
-        self->srt_bytes_received);
-    gaeul2_dbus_mjpegservice_set_total_bytes_sent (self->service,
-        self->http_bytes_sent);
+  g_info ("%s pipeline %p (uid: %s, rid: %s) to level %u (cpu load: %u%%)",
+      level > pipeline->degradation ? "degrading" : "restoring",
+      pipeline->transcoder, pipeline->request->uid, pipeline->request->rid,
+      level, self->cpu_load);
 
-    overall_stats =
-        g_variant_new ("(iitt)", n_srtconnections, n_httpconnections,
-        self->srt_bytes_received, self->http_bytes_sent);
-    gaeul2_dbus_mjpegservice_set_overall_stats (self->service,
-        g_variant_ref_sink (overall_stats));
+  pipeline->degradation = level;
+}
+
+static void
+_publish_load_control (GaeulMjpegApplication * self, guint budget)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{su}"));
+  g_hash_table_iter_init (&iter, self->request_ids);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    GaeulMjpegPipeline *pipeline = g_hash_table_lookup (self->pipelines, value);
+
+    if (pipeline != NULL && pipeline->degradation > 0) {
+      g_variant_builder_add (&builder, "{su}", key, pipeline->degradation);
+    }
   }
+
+  gaeul2_dbus_mjpegservice_set_load_control (self->service,
+      g_variant_new ("(uua{su})", self->cpu_load, budget, &builder));
 }
 
+/* Takes one step at a time, so that the load settles before the next. */
 static gboolean
-_stats_collection_timeout (gpointer user_data)
+_load_control_timeout (gpointer user_data)
 {
   GaeulMjpegApplication *self = user_data;
+  guint budget = g_settings_get_uint (self->settings, "cpu-budget");
+  gint64 now = g_get_monotonic_time ();
+  gint64 cpu_time = _get_process_cpu_time ();
+  gboolean overloaded = FALSE;
+  gboolean underloaded = FALSE;
+  GaeulMjpegPipeline *target = NULL;
+  GHashTableIter iter;
+  gpointer value;
+
+  if (now > self->last_load_time) {
+    self->cpu_load = (cpu_time - self->last_cpu_time) * 100 /
+        ((now - self->last_load_time) * g_get_num_processors ());
+  }
+  self->last_load_time = now;
+  self->last_cpu_time = cpu_time;
+
+  overloaded = budget > 0 && self->cpu_load > budget;
+  underloaded = budget == 0 ||
+      self->cpu_load < budget * MJPEG_LOAD_RESTORE_SHARE / 100;
 
-  self->srt_bytes_received = 0;
-  self->http_bytes_sent = 0;
-  g_hash_table_foreach (self->pipelines, _collect_stats, self);
+  g_hash_table_iter_init (&iter, self->pipelines);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    GaeulMjpegPipeline *pipeline = value;
+    GaeulMjpegBranchStats stats = { 0, };
+    gint fps = pipeline->request->fps;
+
+    /* Keyframes come too seldom to be worth degrading. */
+    if (pipeline->request->flags & GAEUL_MJPEG_REQUEST_FLAG_KEYFRAME_ONLY ||
+        !gaeul_mjpeg_transcoder_get_branch_stats (pipeline->transcoder,
+            pipeline->request, &stats)) {
+      continue;
+    }
+
+    /* Pipelines nobody watches take nothing, and are restored at once. */
+    if (stats.n_clients == 0) {
+      if (pipeline->degradation > 0) {
+        _pipeline_set_degradation (self, pipeline, 0);
+      }
+      continue;
+    }
+
+    if (pipeline->degradation > 0) {
+      fps = MAX (fps >> ((pipeline->degradation + 1) / 2), 1);
+    }
+    pipeline->cost = stats.encode_time * fps;
+
+    if (overloaded && pipeline->degradation < GAEUL_MJPEG_MAX_DEGRADATION) {
+      if (_pipeline_degrades_before (pipeline, target)) {
+        target = pipeline;
+      }
+    } else if (underloaded && pipeline->degradation > 0) {
+      /* The last to be degraded is the first to be restored. */
+      if (target == NULL || _pipeline_degrades_before (target, pipeline)) {
+        target = pipeline;
+      }
+    }
+  }
+
+  if (target != NULL) {
+    _pipeline_set_degradation (self, target,
+        overloaded ? target->degradation + 1 : target->degradation - 1);
+  }
+
+  _publish_load_control (self, budget);
 
   return G_SOURCE_CONTINUE;
 }
 
-static void
-gaeul_mjpeg_application_startup (GApplication * app)
-{
-  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (app);
-  g_autoptr (GError) error = NULL;
+static gboolean _lease_wheel_timeout (gpointer user_data);
 
-  guint port = 0;
+static gboolean
+_rate_adaptation_timeout (gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
 
-  g_clear_object (&self->settings);
-  self->settings = gaeul_gsettings_new (GAEUL_MJPEG_APPLICATION_SCHEMA_ID,
-      gaeul_application_get_config_path (GAEUL_APPLICATION (self)));
+  gaeul_tuple_foreach (self->transcoders, _adapt_client_rates, NULL);
 
-  g_settings_bind (self->settings, "uid", self, "uid", G_SETTINGS_BIND_DEFAULT);
-  g_settings_bind (self->settings, "external-url", self, "external-url",
-      G_SETTINGS_BIND_GET);
-  g_settings_bind (self->settings, "relay-url", self, "relay-url",
-      G_SETTINGS_BIND_GET);
-  g_settings_bind (self->settings, "limit-srt-connections", self,
-      "limit-srt-connections", G_SETTINGS_BIND_GET);
-  g_settings_bind (self->settings, "limit-user-sessions", self,
-      "limit-user-sessions", G_SETTINGS_BIND_GET);
-  g_settings_bind (self->settings, "limit-sessions-per-user", self,
-      "limit-sessions-per-user", G_SETTINGS_BIND_GET);
+  return G_SOURCE_CONTINUE;
+}
 
-  port = g_settings_get_uint (self->settings, "bind-port");
-  g_free (self->local_ip);
-  self->local_ip = gaeul_get_local_ip ();
+static void
+_sample_first_frame (GaeulMjpegApplication * self,
+    GaeulMjpegPipeline * pipeline)
+{
+  gint64 startup_latency = 0;
 
-  g_debug ("starting up transcoding server (port: %" G_GUINT32_FORMAT ")",
-      port);
+  if (pipeline->first_frame_sampled) {
+    return;
+  }
 
-  soup_server_add_handler (self->soup_server, "/mjpeg",
-      gaeul_mjpeg_http_request_cb, self, NULL);
+  startup_latency =
+      gaeul_mjpeg_transcoder_get_startup_latency (pipeline->transcoder,
+      pipeline->request);
 
-  if (!soup_server_listen_all (self->soup_server, port, 0, &error)) {
-    g_error ("failed to start http server (reason: %s)", error->message);
+  if (startup_latency < 0) {
+    return;
   }
 
-  if (g_settings_get_boolean (self->settings, "statistics")) {
-    self->stats_timeout_id =
-        g_timeout_add (g_settings_get_uint (self->settings,
-            "statistics-interval"), _stats_collection_timeout, self);
+  if (pipeline->eager) {
+    self->eager_first_frame_time += startup_latency;
+    self->n_eager_first_frames++;
+  } else {
+    self->lazy_first_frame_time += startup_latency;
+    self->n_lazy_first_frames++;
   }
-
-  G_APPLICATION_CLASS (gaeul_mjpeg_application_parent_class)->startup (app);
+  pipeline->first_frame_sampled = TRUE;
 }
 
 static void
-gaeul_mjpeg_application_activate (GApplication * app)
+_sample_first_frame_foreach (gpointer key, GaeulMjpegPipeline * pipeline,
+    GaeulMjpegApplication * self)
 {
-  g_debug ("activate");
-  G_APPLICATION_CLASS (gaeul_mjpeg_application_parent_class)->activate (app);
+  _sample_first_frame (self, pipeline);
 }
 
-static void
-gaeul_mjpeg_application_shutdown (GApplication * app)
+static gboolean
+_stats_collection_timeout (gpointer user_data)
 {
-  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (app);
+  GaeulMjpegApplication *self = user_data;
+  g_autoptr (GVariant) overall_stats = NULL;
+  guint n_lazy_first_frames = 0;
+  guint64 lazy_first_frame_time = 0;
+  guint n_eager_first_frames = 0;
+  guint64 eager_first_frame_time = 0;
+  guint n_leases = 0;
+
+  g_hash_table_foreach (self->pipelines, (GHFunc) _sample_first_frame_foreach,
+      self);
+  n_lazy_first_frames = self->n_lazy_first_frames;
+  lazy_first_frame_time = self->lazy_first_frame_time;
+  n_eager_first_frames = self->n_eager_first_frames;
+  eager_first_frame_time = self->eager_first_frame_time;
+
+  self->srt_bytes_received = self->srt_bytes_received_stopped;
+  self->http_bytes_sent = self->http_bytes_sent_stopped;
+  self->n_srtconnections = 0;
+  self->n_httpconnections = 0;
+  gaeul_tuple_foreach (self->transcoders, _collect_stats, self);
+  g_hash_table_foreach (self->mosaics, (GHFunc) _collect_mosaic_stats, self);
+
+  if (self->workers != NULL) {
+    guint i;
+
+    for (i = 0; i < self->workers->len; i++) {
+      GaeulMjpegWorker *worker = g_ptr_array_index (self->workers, i);
+      GaeulMjpegWorkerStats stats = { 0, };
+
+      /* The statistics of the workers are a collection behind. */
+      gaeul_mjpeg_worker_get_stats (worker, &stats);
+      gaeul_mjpeg_worker_update_stats (worker);
+
+      self->srt_bytes_received += stats.bytes_received;
+      self->http_bytes_sent += stats.bytes_sent;
+      self->n_httpconnections += stats.n_httpconnections;
+      self->n_srtconnections += stats.n_srtconnections;
+
+      n_lazy_first_frames += stats.n_lazy_first_frames;
+      lazy_first_frame_time += stats.lazy_first_frame_time;
+      n_eager_first_frames += stats.n_eager_first_frames;
+      eager_first_frame_time += stats.eager_first_frame_time;
+    }
+  }
 
-  g_clear_handle_id (&self->stats_timeout_id, g_source_remove);
-  soup_server_remove_handler (self->soup_server, "/mjpeg");
+  gaeul2_dbus_mjpegservice_set_number_of_httpconnections (self->service,
+      self->n_httpconnections);
+  _publish_http_client_usage (self);
+  gaeul2_dbus_mjpegservice_set_number_of_srtconnections (self->service,
+      self->n_srtconnections);
+  gaeul2_dbus_mjpegservice_set_total_bytes_received (self->service,
+      self->srt_bytes_received);
+  gaeul2_dbus_mjpegservice_set_total_bytes_sent (self->service,
+      self->http_bytes_sent);
+
+  overall_stats =
+      g_variant_new ("(iitt)", self->n_srtconnections, self->n_httpconnections,
+      self->srt_bytes_received, self->http_bytes_sent);
+  gaeul2_dbus_mjpegservice_set_overall_stats (self->service,
+      g_variant_ref_sink (overall_stats));
 
-  g_debug ("shutdown");
+  {
+    guint lookups = self->linger_hits + self->linger_misses;
+
+    gaeul2_dbus_mjpegservice_set_linger_pool_stats (self->service,
+        g_variant_new ("(uuuudt)", self->lingering.length, self->linger_hits,
+            self->linger_misses, self->linger_evictions,
+            lookups > 0 ? (gdouble) self->linger_hits / lookups : 0.0,
+            (guint64) (self->linger_latency_saved /
+                G_TIME_SPAN_MILLISECOND)));
+  }
 
-  g_clear_pointer (&self->local_ip, g_free);
+  g_mutex_lock (&self->http_lock);
+  n_leases = g_hash_table_size (self->http_request_ids);
+  g_mutex_unlock (&self->http_lock);
 
-  G_APPLICATION_CLASS (gaeul_mjpeg_application_parent_class)->shutdown (app);
+  gaeul2_dbus_mjpegservice_set_session_lease_stats (self->service,
+      g_variant_new ("(uu)", n_leases, self->n_reaped_sessions));
+
+  gaeul2_dbus_mjpegservice_set_time_to_first_frame (self->service,
+      g_variant_new ("(utut)", n_lazy_first_frames,
+          n_lazy_first_frames > 0 ? lazy_first_frame_time /
+          n_lazy_first_frames / G_TIME_SPAN_MILLISECOND : 0,
+          n_eager_first_frames, n_eager_first_frames > 0 ?
+          eager_first_frame_time / n_eager_first_frames /
+          G_TIME_SPAN_MILLISECOND : 0));
+
+  return G_SOURCE_CONTINUE;
 }
 
 static void
-gaeul_mjpeg_application_get_property (GObject * object,
-    guint prop_id, GValue * value, GParamSpec * pspec)
+_worker_connection_closed_cb (GDBusConnection * connection,
+    gboolean remote_peer_vanished, GError * error, gpointer user_data)
 {
-  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (object);
+  GApplication *app = user_data;
 
-  switch (prop_id) {
+  g_info ("the connection to the agent is closed, quitting");
+  g_application_quit (app);
+}
+
+/* In worker mode, the service is exported to the agent that spawned the
+ * process, which forwards the calls and the HTTP clients of the requests
+ * it places here. */
+static void
+_worker_connect (GaeulMjpegApplication * self)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GSocket) socket = NULL;
+  g_autoptr (GSocketConnection) stream = NULL;
+
+  socket = g_socket_new_from_fd (self->worker_fd, &error);
+  if (socket == NULL) {
+    g_error ("failed to use the agent connection (reason: %s)",
+        error->message);
+  }
+
+  stream = g_socket_connection_factory_create_connection (socket);
+  self->worker_connection = g_dbus_connection_new_sync (G_IO_STREAM (stream),
+      NULL, G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT, NULL, NULL, &error);
+
+  if (self->worker_connection == NULL) {
+    g_error ("failed to connect to the agent (reason: %s)", error->message);
+  }
+
+  g_signal_connect (self->worker_connection, "closed",
+      G_CALLBACK (_worker_connection_closed_cb), self);
+
+  if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON
+          (self->service), self->worker_connection,
+          "/org/hwangsaeul/Gaeul2/MJPEG/Service", &error) ||
+      !g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON
+          (self->worker_service), self->worker_connection,
+          "/org/hwangsaeul/Gaeul2/MJPEG/Service", &error)) {
+    g_error ("failed to export the worker interfaces (reason: %s)",
+        error->message);
+  }
+}
+
+static void _worker_closed_cb (GaeulMjpegWorker * worker, gpointer user_data);
+
+static void
+_worker_client_added_cb (GaeulMjpegWorker * worker, gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+
+  g_atomic_int_inc (&self->n_http_clients);
+}
+
+static void
+_worker_client_removed_cb (GaeulMjpegWorker * worker, gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+
+  g_atomic_int_add (&self->n_http_clients, -1);
+}
+
+static gboolean
+_spawn_worker (GaeulMjpegApplication * self, guint index, guint n_workers,
+    GError ** error)
+{
+  GaeulMjpegWorker *worker = NULL;
+
+  worker = gaeul_mjpeg_worker_new (index, n_workers,
+      gaeul_application_get_config_path (GAEUL_APPLICATION (self)), error);
+
+  if (worker == NULL) {
+    return FALSE;
+  }
+
+  g_signal_connect (worker, "closed", G_CALLBACK (_worker_closed_cb), self);
+  g_signal_connect (worker, "client-added",
+      G_CALLBACK (_worker_client_added_cb), self);
+  g_signal_connect (worker, "client-removed",
+      G_CALLBACK (_worker_client_removed_cb), self);
+
+  if (index < self->workers->len) {
+    GaeulMjpegWorker *old = g_ptr_array_index (self->workers, index);
+
+    g_signal_handlers_disconnect_by_data (old, self);
+    g_ptr_array_index (self->workers, index) = worker;
+    g_object_unref (old);
+  } else {
+    g_ptr_array_add (self->workers, worker);
+  }
+
+  return TRUE;
+}
+
+static gboolean
+_respawn_workers_timeout (gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+  guint i;
+
+  self->respawn_timeout_id = 0;
+
+  for (i = 0; i < self->workers->len; i++) {
+    g_autoptr (GError) error = NULL;
+
+    if (!gaeul_mjpeg_worker_is_closed (g_ptr_array_index (self->workers, i))) {
+      continue;
+    }
+
+    g_debug ("respawning mjpeg worker %u", i);
+
+    if (!_spawn_worker (self, i, self->workers->len, &error)) {
+      g_warning ("failed to respawn mjpeg worker %u (reason: %s)", i,
+          error->message);
+    }
+  }
+
+  return G_SOURCE_REMOVE;
+}
+
+static gpointer
+_http_thread_func (gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+
+  g_main_context_push_thread_default (self->http_context);
+  g_main_loop_run (self->http_loop);
+  g_main_context_pop_thread_default (self->http_context);
+
+  return NULL;
+}
+
+static void
+_apply_slow_client_policy (const gchar * uid, const gchar * rid,
+    GObject * object, gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+
+  gaeul_mjpeg_transcoder_set_slow_client_policy (GAEUL_MJPEG_TRANSCODER
+      (object), g_settings_get_enum (self->settings, "slow-client-policy"),
+      g_settings_get_uint (self->settings, "slow-client-max-queued-bytes"),
+      g_settings_get_uint (self->settings, "slow-client-max-queued-frames"));
+}
+
+static void
+_apply_queue_max_time (const gchar * uid, const gchar * rid,
+    GObject * object, gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+
+  gaeul_mjpeg_transcoder_set_queue_max_time (GAEUL_MJPEG_TRANSCODER (object),
+      g_settings_get_uint (self->settings, "queue-max-time"));
+}
+
+static void
+_apply_encoder_threads (const gchar * uid, const gchar * rid,
+    GObject * object, gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+
+  gaeul_mjpeg_transcoder_set_encoder_threads (GAEUL_MJPEG_TRANSCODER (object),
+      g_settings_get_uint (self->settings, "encoder-threads"));
+}
+
+static void
+_apply_decoder_options (const gchar * uid, const gchar * rid,
+    GObject * object, gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+
+  gaeul_mjpeg_transcoder_set_decoder_options (GAEUL_MJPEG_TRANSCODER
+      (object), g_settings_get_uint (self->settings, "decoder-threads"),
+      g_settings_get_boolean (self->settings, "decoder-low-latency"));
+}
+
+static void
+_apply_static_scene_threshold (const gchar * uid, const gchar * rid,
+    GObject * object, gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+
+  gaeul_mjpeg_transcoder_set_static_scene_threshold (GAEUL_MJPEG_TRANSCODER
+      (object), g_settings_get_uint (self->settings,
+          "static-scene-threshold"));
+}
+
+static void
+_settings_changed_cb (GSettings * settings, const gchar * key,
+    gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+
+  if (g_str_has_prefix (key, "slow-client-")) {
+    gaeul_tuple_foreach (self->transcoders, _apply_slow_client_policy, self);
+  } else if (g_strcmp0 (key, "queue-max-time") == 0) {
+    gaeul_tuple_foreach (self->transcoders, _apply_queue_max_time, self);
+  } else if (g_strcmp0 (key, "encoder-threads") == 0) {
+    gaeul_tuple_foreach (self->transcoders, _apply_encoder_threads, self);
+  } else if (g_str_has_prefix (key, "decoder-")) {
+    gaeul_tuple_foreach (self->transcoders, _apply_decoder_options, self);
+  } else if (g_strcmp0 (key, "static-scene-threshold") == 0) {
+    gaeul_tuple_foreach (self->transcoders, _apply_static_scene_threshold,
+        self);
+  }
+}
+
+static void
+_start_server (GaeulMjpegApplication * self, guint port)
+{
+  g_autoptr (GError) error = NULL;
+  guint n_workers = g_settings_get_uint (self->settings, "workers");
+
+  if (n_workers > 0) {
+    guint i;
+
+    self->workers = g_ptr_array_new_with_free_func (g_object_unref);
+
+    for (i = 0; i < n_workers; i++) {
+      if (!_spawn_worker (self, i, n_workers, &error)) {
+        g_error ("failed to spawn mjpeg worker %u (reason: %s)", i,
+            error->message);
+      }
+    }
+  }
+
+  g_debug ("starting up transcoding server (port: %" G_GUINT32_FORMAT
+      ", workers: %u)", port, n_workers);
+
+  soup_server_add_handler (self->soup_server, "/mjpeg",
+      gaeul_mjpeg_http_request_cb, self, NULL);
+
+  /* The listening sockets attach to the thread-default context. */
+  g_main_context_push_thread_default (self->http_context);
+  if (!soup_server_listen_all (self->soup_server, port, 0, &error)) {
+    g_error ("failed to start http server (reason: %s)", error->message);
+  }
+  g_main_context_pop_thread_default (self->http_context);
+
+  self->http_thread = g_thread_new ("mjpeg-http", _http_thread_func, self);
+}
+
+static void
+gaeul_mjpeg_application_startup (GApplication * app)
+{
+  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (app);
+  guint port = 0;
+
+  g_clear_object (&self->settings);
+  self->settings = gaeul_gsettings_new (GAEUL_MJPEG_APPLICATION_SCHEMA_ID,
+      gaeul_application_get_config_path (GAEUL_APPLICATION (self)));
+
+  g_settings_bind (self->settings, "uid", self, "uid", G_SETTINGS_BIND_DEFAULT);
+  g_settings_bind (self->settings, "external-url", self, "external-url",
+      G_SETTINGS_BIND_GET);
+  g_settings_bind (self->settings, "relay-url", self, "relay-url",
+      G_SETTINGS_BIND_GET);
+  g_settings_bind (self->settings, "limit-srt-connections", self,
+      "limit-srt-connections", G_SETTINGS_BIND_GET);
+  g_settings_bind (self->settings, "limit-user-sessions", self,
+      "limit-user-sessions", G_SETTINGS_BIND_GET);
+  g_settings_bind (self->settings, "limit-sessions-per-user", self,
+      "limit-sessions-per-user", G_SETTINGS_BIND_GET);
+  g_settings_bind (self->settings, "limit-http-clients", self,
+      "limit-http-clients", G_SETTINGS_BIND_GET);
+
+  g_signal_connect (self->settings, "changed",
+      G_CALLBACK (_settings_changed_cb), self);
+
+  port = g_settings_get_uint (self->settings, "bind-port");
+  g_free (self->local_ip);
+  self->local_ip = gaeul_get_local_ip ();
+
+  /* Workers leave the leases, and the eager starts waiting for their
+   * first client, to the agent. */
+  if (self->worker_fd < 0) {
+    self->lease_time = g_settings_get_uint (self->settings,
+        "session-lease-time") * G_TIME_SPAN_SECOND;
+    self->lease_timeout_id =
+        g_timeout_add (GAEUL_MJPEG_LEASE_TICK / G_TIME_SPAN_MILLISECOND,
+        _lease_wheel_timeout, self);
+  }
+
+  if (self->worker_fd >= 0) {
+    g_debug ("starting up transcoding worker");
+    _worker_connect (self);
+  } else {
+    _start_server (self, port);
+  }
+
+  if (self->workers == NULL &&
+      g_settings_get_boolean (self->settings, "adaptive-frame-rate")) {
+    self->rate_adaptation_timeout_id =
+        g_timeout_add_seconds (MJPEG_RATE_ADAPTATION_INTERVAL,
+        _rate_adaptation_timeout, self);
+  }
+
+  if (self->workers == NULL) {
+    self->source_watch_timeout_id =
+        g_timeout_add_seconds (MJPEG_SOURCE_WATCH_INTERVAL,
+        _source_watch_timeout, self);
+
+    self->last_load_time = g_get_monotonic_time ();
+    self->last_cpu_time = _get_process_cpu_time ();
+    self->load_control_timeout_id =
+        g_timeout_add_seconds (MJPEG_LOAD_CONTROL_INTERVAL,
+        _load_control_timeout, self);
+  }
+
+  if (g_settings_get_boolean (self->settings, "statistics")) {
+    self->stats_timeout_id =
+        g_timeout_add (g_settings_get_uint (self->settings,
+            "statistics-interval"), _stats_collection_timeout, self);
+  }
+
+  G_APPLICATION_CLASS (gaeul_mjpeg_application_parent_class)->startup (app);
+}
+
+static void
+gaeul_mjpeg_application_activate (GApplication * app)
+{
+  g_debug ("activate");
+  G_APPLICATION_CLASS (gaeul_mjpeg_application_parent_class)->activate (app);
+}
+
+static void
+gaeul_mjpeg_application_shutdown (GApplication * app)
+{
+  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (app);
+
+  g_clear_handle_id (&self->stats_timeout_id, g_source_remove);
+  g_clear_handle_id (&self->rate_adaptation_timeout_id, g_source_remove);
+  g_clear_handle_id (&self->source_watch_timeout_id, g_source_remove);
+  g_clear_handle_id (&self->load_control_timeout_id, g_source_remove);
+  g_clear_handle_id (&self->lease_timeout_id, g_source_remove);
+  g_clear_handle_id (&self->linger_timeout_id, g_source_remove);
+
+  if (self->http_thread != NULL) {
+    g_main_loop_quit (self->http_loop);
+    g_thread_join (g_steal_pointer (&self->http_thread));
+  }
+  soup_server_remove_handler (self->soup_server, "/mjpeg");
+
+  g_clear_handle_id (&self->respawn_timeout_id, g_source_remove);
+  if (self->workers != NULL) {
+    guint i;
+
+    for (i = 0; i < self->workers->len; i++) {
+      g_signal_handlers_disconnect_by_data (g_ptr_array_index (self->workers,
+              i), self);
+    }
+    g_clear_pointer (&self->workers, g_ptr_array_unref);
+  }
+
+  if (self->worker_connection != NULL) {
+    g_signal_handlers_disconnect_by_data (self->worker_connection, self);
+    g_dbus_interface_skeleton_unexport_from_connection
+        (G_DBUS_INTERFACE_SKELETON (self->worker_service),
+        self->worker_connection);
+    g_dbus_interface_skeleton_unexport_from_connection
+        (G_DBUS_INTERFACE_SKELETON (self->service), self->worker_connection);
+    g_clear_object (&self->worker_connection);
+  }
+
+  g_debug ("shutdown");
+
+  g_clear_pointer (&self->local_ip, g_free);
+
+  G_APPLICATION_CLASS (gaeul_mjpeg_application_parent_class)->shutdown (app);
+}
+
+static void
+gaeul_mjpeg_application_get_property (GObject * object,
+    guint prop_id, GValue * value, GParamSpec * pspec)
+{
+  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (object);
+
+  switch (prop_id) {
     case PROP_EXTERNAL_URL:
       g_value_set_string (value, self->external_url);
       break;
@@ -352,6 +1297,12 @@ gaeul_mjpeg_application_get_property (GObject * object,
     case PROP_LIMIT_SESSIONS_PER_USER:
       g_value_set_uint (value, self->limit_sessions_per_user);
       break;
+    case PROP_LIMIT_HTTP_CLIENTS:
+      g_value_set_uint (value, g_atomic_int_get (&self->limit_http_clients));
+      break;
+    case PROP_WORKER_FD:
+      g_value_set_int (value, self->worker_fd);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -375,12 +1326,23 @@ gaeul_mjpeg_application_set_property (GObject * object,
       break;
     case PROP_LIMIT_SRT_CONNECTIONS:
       self->limit_srt_connections = g_value_get_uint (value);
+      _publish_admission_usage (self);
       break;
     case PROP_LIMIT_USER_SESSIONS:
       self->limit_user_sessions = g_value_get_uint (value);
+      _publish_admission_usage (self);
       break;
     case PROP_LIMIT_SESSIONS_PER_USER:
       self->limit_sessions_per_user = g_value_get_uint (value);
+      _publish_admission_usage (self);
+      break;
+    case PROP_LIMIT_HTTP_CLIENTS:
+      g_atomic_int_set (&self->limit_http_clients,
+          MIN (g_value_get_uint (value), G_MAXINT));
+      _publish_http_client_usage (self);
+      break;
+    case PROP_WORKER_FD:
+      self->worker_fd = g_value_get_int (value);
       break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
@@ -460,6 +1422,15 @@ gaeul_mjpeg_application_class_init (GaeulMjpegApplicationClass * klass)
       "limit-sessions-per-user", 0, G_MAXUINT32, 4,
       G_PARAM_WRITABLE | G_PARAM_STATIC_STRINGS);
 
+  properties[PROP_LIMIT_HTTP_CLIENTS] =
+      g_param_spec_uint ("limit-http-clients", "limit-http-clients",
+      "limit-http-clients", 0, G_MAXUINT32, 0,
+      G_PARAM_WRITABLE | G_PARAM_STATIC_STRINGS);
+
+  properties[PROP_WORKER_FD] =
+      g_param_spec_int ("worker-fd", "worker-fd", "worker-fd", -1, G_MAXINT,
+      -1, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
   g_object_class_install_properties (object_class, G_N_ELEMENTS (properties),
       properties);
 
@@ -486,120 +1457,1240 @@ _build_return_url (const gchar * external_url, const gchar * local_ip,
   return g_steal_pointer (&url);
 }
 
-static void
-_pipeline_sink_client_added_cb (GstElement * sink, GSocket * socket,
-    gpointer user_data)
+/* Transcoders being built count, as they connect to the relay already. */
+static guint
+_get_n_srt_connections (GaeulMjpegApplication * self)
 {
-  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (user_data);
+  return self->n_transcoders + g_hash_table_size (self->transcoder_builds) +
+      self->n_worker_placements + self->n_mosaic_tiles;
+}
 
-  g_debug ("client added %p", socket);
-  self->client_sockets = g_list_prepend (self->client_sockets, socket);
+static guint
+_get_n_user_sessions (GaeulMjpegApplication * self)
+{
+  return g_hash_table_size (self->request_ids) +
+      g_hash_table_size (self->mosaics);
 }
 
+/* The HTTP clients come and go on the streaming threads, so their usage is
+ * also published along with the statistics. */
 static void
-_pipeline_sink_client_socket_removed_cb (GstElement * sink, GSocket * socket,
-    gpointer user_data)
+_publish_http_client_usage (GaeulMjpegApplication * self)
 {
-  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (user_data);
-
-  g_debug ("client removed %p", socket);
-  self->client_sockets = g_list_remove (self->client_sockets, socket);
+  gaeul2_dbus_mjpegservice_set_httpclient_usage (self->service,
+      g_variant_new ("(uu)", g_atomic_int_get (&self->n_http_clients),
+          g_atomic_int_get (&self->limit_http_clients)));
 }
 
-static gboolean
-gaeul_mjpeg_application_handle_start (Gaeul2DBusMJPEGService * object,
-    GDBusMethodInvocation * invocation,
-    const gchar * uid, const gchar * rid,
-    guint width, guint height, guint fps, guint latency, guint flip,
-    guint orientation, gpointer user_data)
+static void
+_publish_admission_usage (GaeulMjpegApplication * self)
 {
-  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (user_data);
-
-  g_autofree gchar *return_url = NULL;
-  g_autofree gchar *path = NULL;
-  g_autofree gchar *request_id = NULL;
-  g_autoptr (GaeulMjpegRequest) request = NULL;
-
+  GVariantBuilder builder;
   GHashTableIter iter;
   gpointer key, value;
-  gboolean found = FALSE;
-
-  /* FIXME: The latency of tsdemux needs to be large enough to have 
-   * 2-3 PCRs in the mpeg-ts stream. Since the default value of
-   * pcr-interval is 3600 in 90kHz(=40ms), it should be 80-120 ms.
-   * However, the exact result of how much latency varies is unsure.
-   */
-  request =
-      gaeul_mjpeg_request_new (uid, rid, latency, 65, width, height, fps, flip,
-      orientation);
 
-  /* Every start request will have unique id. */
-  request_id = g_uuid_string_random ();
-
-  g_debug ("start transcoder (id: %s) uid: %s rid: %s "
-      "  resolution: %" G_GUINT32_FORMAT "x%" G_GUINT32_FORMAT
-      "  fps: %" G_GUINT32_FORMAT " latency: %" G_GUINT32_FORMAT " ms.",
-      request_id, uid, rid, width, height, fps, latency);
-
-  return_url =
-      _build_return_url (self->external_url, self->local_ip,
-      g_settings_get_uint (self->settings, "bind-port"), request_id);
+  gaeul2_dbus_mjpegservice_set_srtconnection_usage (self->service,
+      g_variant_new ("(uu)", _get_n_srt_connections (self),
+          self->limit_srt_connections));
+  gaeul2_dbus_mjpegservice_set_user_session_usage (self->service,
+      g_variant_new ("(uu)", _get_n_user_sessions (self),
+          self->limit_user_sessions));
 
-  /* Check if transcoding pipeline is running */
-  g_hash_table_iter_init (&iter, self->pipelines);
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{su}"));
+  g_hash_table_iter_init (&iter, self->uid_request_ids);
   while (g_hash_table_iter_next (&iter, &key, &value)) {
-    GaeulMjpegRequest *r = key;
-
-    if (gaeul_mjpeg_request_equal (r, request)) {
-      g_clear_pointer (&request, gaeul_mjpeg_request_unref);
-      request = gaeul_mjpeg_request_ref (r);
-      found = TRUE;
-      g_debug ("found existing mjpeg transcoder pipeline (id: %s)", request_id);
-      break;
-    }
+    g_variant_builder_add (&builder, "{su}", key, g_hash_table_size (value));
   }
 
-  if (!found) {
+  gaeul2_dbus_mjpegservice_set_sessions_per_user_usage (self->service,
+      g_variant_new ("(a{su}u)", &builder, self->limit_sessions_per_user));
 
-    /* Transcoding pipeline must be created */
+  _publish_http_client_usage (self);
+}
 
-    g_autoptr (GstElement) pipeline = NULL;
-    g_autoptr (GstElement) src = NULL;
-    g_autoptr (GstElement) sink = NULL;
-    g_autoptr (GError) error = NULL;
-    g_autofree gchar *streamid = NULL;
-    g_autofree gchar *pipeline_desc =
-        _build_srtsrc_pipeline_desc (self->relay_url, request);
-    pipeline = gst_parse_launch (pipeline_desc, &error);
+static guint
+_get_uid_sessions (GaeulMjpegApplication * self, const gchar * uid)
+{
+  GHashTable *request_ids = g_hash_table_lookup (self->uid_request_ids,
+      g_intern_string (uid));
 
-    if (error != NULL) {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return TRUE;
-    }
+  return request_ids != NULL ? g_hash_table_size (request_ids) : 0;
+}
 
-    src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
-    streamid = g_strdup_printf ("#!::u=%s,r=%s", uid, rid);
-    g_object_set (src, "streamid", streamid, NULL);
+/* @request_id must be the key of the request in self->request_ids, which
+ * the index borrows. */
+static void
+_index_request (GaeulMjpegApplication * self, const gchar * request_id,
+    GaeulMjpegRequest * r)
+{
+  GHashTable *request_ids = g_hash_table_lookup (self->uid_request_ids,
+      r->uid);
 
-    g_debug ("Created transcoding pipeline for (id: %s, %s)", request_id,
-        streamid);
+  if (request_ids == NULL) {
+    request_ids = g_hash_table_new (g_str_hash, g_str_equal);
+    g_hash_table_insert (self->uid_request_ids, (gpointer) r->uid,
+        request_ids);
+  }
 
-    sink = gst_bin_get_by_name (GST_BIN (pipeline), "msocksink");
-    g_signal_connect (sink, "client-added",
-        G_CALLBACK (_pipeline_sink_client_added_cb), self);
-    g_signal_connect (sink, "client-socket-removed",
-        G_CALLBACK (_pipeline_sink_client_socket_removed_cb), self);
+  g_hash_table_insert (request_ids, (gpointer) request_id, r);
+}
 
-    gst_element_set_state (pipeline, GST_STATE_READY);
+static void
+_unindex_request (GaeulMjpegApplication * self, const gchar * request_id,
+    GaeulMjpegRequest * r)
+{
+  GHashTable *request_ids = g_hash_table_lookup (self->uid_request_ids,
+      r->uid);
 
-    g_hash_table_insert (self->pipelines, request, g_steal_pointer (&pipeline));
+  if (request_ids == NULL) {
+    return;
+  }
+
+  g_hash_table_remove (request_ids, request_id);
+
+  if (g_hash_table_size (request_ids) == 0) {
+    g_hash_table_remove (self->uid_request_ids, r->uid);
+  }
+}
+
+static void
+_transcoder_client_added_cb (GaeulMjpegTranscoder * transcoder,
+    GaeulMjpegRequest * request, GSocket * socket, gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+
+  g_atomic_int_inc (&self->n_http_clients);
+}
+
+static void
+_transcoder_client_removed_cb (GaeulMjpegTranscoder * transcoder,
+    GaeulMjpegRequest * request, GSocket * socket, gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+
+  g_atomic_int_add (&self->n_http_clients, -1);
+  _release_connection (socket);
+
+  /* Every client of a worker came from the agent, which counts them too. */
+  if (self->worker_connection != NULL) {
+    gaeul2_dbus_mjpegworker_emit_client_removed (self->worker_service);
+  }
+}
+
+static void
+_pipeline_free (GaeulMjpegPipeline * pipeline)
+{
+  g_clear_object (&pipeline->transcoder);
+  g_free (pipeline);
+}
+
+static void
+_teardown_transcoder (gpointer data, gpointer user_data)
+{
+  g_object_unref (data);
+}
+
+/* Removes the transcoder of @uid and @rid, whose last reference is then
+ * dropped by the teardown thread. */
+static void
+_remove_transcoder (GaeulMjpegApplication * self, const gchar * uid,
+    const gchar * rid)
+{
+  GaeulMjpegTranscoder *transcoder =
+      GAEUL_MJPEG_TRANSCODER (gaeul_tuple_lookup (self->transcoders, uid,
+          rid));
+
+  g_debug ("stopping pipeline %p", transcoder);
+
+  self->srt_bytes_received_stopped +=
+      gaeul_mjpeg_transcoder_get_bytes_received (transcoder);
+  self->http_bytes_sent_stopped +=
+      gaeul_mjpeg_transcoder_get_bytes_sent (transcoder);
+
+  g_object_ref (transcoder);
+  gaeul_tuple_remove (self->transcoders, uid, rid);
+  self->n_transcoders--;
+
+  g_thread_pool_push (self->teardown_pool, transcoder, NULL);
+}
+
+static void
+_pipeline_destroy (GaeulMjpegApplication * self, GaeulMjpegPipeline * pipeline)
+{
+  GaeulMjpegTranscoder *transcoder = pipeline->transcoder;
+  GaeulMjpegRequest *r = pipeline->request;
+  const gchar *uid = r->uid;
+  const gchar *rid = r->rid;
+  gboolean last = gaeul_mjpeg_transcoder_get_n_branches (transcoder) <= 1;
+
+  /* The last branch goes away along with the whole pipeline. */
+  if (!last) {
+    gaeul_mjpeg_transcoder_remove_branch (transcoder, r);
+  }
+
+  g_hash_table_remove (self->pipelines, r);
+
+  if (last) {
+    _remove_transcoder (self, uid, rid);
+  }
+}
+
+static gboolean _linger_pool_timeout (gpointer user_data);
+
+static void
+_linger_pool_schedule (GaeulMjpegApplication * self)
+{
+  GaeulMjpegPipeline *head = g_queue_peek_head (&self->lingering);
+  gint64 remaining = 0;
+
+  g_clear_handle_id (&self->linger_timeout_id, g_source_remove);
+
+  if (head == NULL) {
+    return;
+  }
+
+  /* Every pipeline lingers for the same period, so the least recently
+   * used one is also the first one to expire. */
+  remaining = head->linger_deadline - g_get_monotonic_time ();
+  self->linger_timeout_id =
+      g_timeout_add (MAX (remaining, 0) / G_TIME_SPAN_MILLISECOND + 1,
+      _linger_pool_timeout, self);
+}
+
+static void
+_linger_pool_remove (GaeulMjpegApplication * self,
+    GaeulMjpegPipeline * pipeline)
+{
+  g_queue_delete_link (&self->lingering, pipeline->linger_link);
+  pipeline->linger_link = NULL;
+}
+
+static void
+_linger_pool_evict (GaeulMjpegApplication * self)
+{
+  GaeulMjpegPipeline *pipeline = g_queue_peek_head (&self->lingering);
+
+  if (pipeline == NULL) {
+    return;
+  }
+
+  g_debug ("evicting lingering pipeline %p", pipeline->transcoder);
+
+  _linger_pool_remove (self, pipeline);
+  _pipeline_destroy (self, pipeline);
+  self->linger_evictions++;
+}
+
+static gboolean
+_linger_pool_timeout (gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+  GaeulMjpegPipeline *pipeline = NULL;
+  gint64 now = g_get_monotonic_time ();
+
+  self->linger_timeout_id = 0;
+
+  while ((pipeline = g_queue_peek_head (&self->lingering)) != NULL &&
+      pipeline->linger_deadline <= now) {
+    g_debug ("lingering pipeline %p expired", pipeline->transcoder);
+    _linger_pool_remove (self, pipeline);
+    _pipeline_destroy (self, pipeline);
+  }
+
+  _linger_pool_schedule (self);
+  _publish_admission_usage (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+#if GLIB_CHECK_VERSION(2,64,0)
+static void
+_low_memory_warning_cb (GMemoryMonitor * monitor,
+    GMemoryMonitorWarningLevel level, gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+
+  g_info ("low memory warning (level: %d), flushing %u lingering pipelines",
+      level, self->lingering.length);
+
+  while (!g_queue_is_empty (&self->lingering)) {
+    _linger_pool_evict (self);
+  }
+
+  _linger_pool_schedule (self);
+  _publish_admission_usage (self);
+}
+#endif
+
+static void
+_sample_cold_start (GaeulMjpegApplication * self,
+    GaeulMjpegPipeline * pipeline)
+{
+  gint64 startup_latency = 0;
+
+  if (pipeline->cold_start_sampled) {
+    return;
+  }
+
+  startup_latency =
+      gaeul_mjpeg_transcoder_get_startup_latency (pipeline->transcoder,
+      pipeline->request);
+
+  if (startup_latency < 0) {
+    return;
+  }
+
+  self->cold_start_total += pipeline->build_time + startup_latency;
+  self->cold_start_count++;
+  pipeline->cold_start_sampled = TRUE;
+}
+
+static void
+_pipeline_release (GaeulMjpegApplication * self, GaeulMjpegPipeline * pipeline)
+{
+  guint linger_period = g_settings_get_uint (self->settings, "linger-period");
+  guint pool_size = g_settings_get_uint (self->settings, "linger-pool-size");
+
+  _sample_cold_start (self, pipeline);
+  _sample_first_frame (self, pipeline);
+
+  /* Nobody is going to arrive for an eager start any more. */
+  gaeul_mjpeg_transcoder_stop_preroll (pipeline->transcoder);
+
+  if (linger_period == 0 || pool_size == 0) {
+    _pipeline_destroy (self, pipeline);
+    return;
+  }
+
+  while (self->lingering.length >= pool_size) {
+    _linger_pool_evict (self);
+  }
+
+  g_debug ("pipeline %p lingers for %u ms", pipeline->transcoder,
+      linger_period);
+
+  pipeline->linger_deadline =
+      g_get_monotonic_time () + linger_period * G_TIME_SPAN_MILLISECOND;
+  g_queue_push_tail (&self->lingering, pipeline);
+  pipeline->linger_link = g_queue_peek_tail_link (&self->lingering);
+
+  _linger_pool_schedule (self);
+}
+
+/* A transcoder being built off the main thread, and the Start calls of
+ * its uid and rid that wait for it. */
+typedef struct
+{
+  GaeulMjpegApplication *app;
+  GVariant *key;
+  GQueue invocations;
+} GaeulMjpegTranscoderBuild;
+
+static void _start_request (GaeulMjpegApplication * self,
+    GDBusMethodInvocation * invocation);
+
+static void
+_transcoder_built_cb (GObject * source, GAsyncResult * result,
+    gpointer user_data)
+{
+  GaeulMjpegTranscoderBuild *build = user_data;
+  GaeulMjpegApplication *self = build->app;
+  g_autoptr (GaeulMjpegTranscoder) transcoder = NULL;
+  g_autoptr (GError) error = NULL;
+  GDBusMethodInvocation *invocation = NULL;
+  const gchar *uid = NULL;
+  const gchar *rid = NULL;
+
+  g_hash_table_remove (self->transcoder_builds, build->key);
+  g_variant_get (build->key, "(&s&s)", &uid, &rid);
+
+  transcoder = gaeul_mjpeg_transcoder_new_finish (result, &error);
+
+  if (transcoder != NULL) {
+    g_signal_connect (transcoder, "client-added",
+        G_CALLBACK (_transcoder_client_added_cb), self);
+    g_signal_connect (transcoder, "client-removed",
+        G_CALLBACK (_transcoder_client_removed_cb), self);
+    _apply_slow_client_policy (uid, rid, G_OBJECT (transcoder), self);
+    _apply_queue_max_time (uid, rid, G_OBJECT (transcoder), self);
+    _apply_encoder_threads (uid, rid, G_OBJECT (transcoder), self);
+    _apply_decoder_options (uid, rid, G_OBJECT (transcoder), self);
+    _apply_static_scene_threshold (uid, rid, G_OBJECT (transcoder), self);
+
+    gaeul_tuple_insert (self->transcoders, uid, rid, G_OBJECT (transcoder));
+    self->n_transcoders++;
+  }
+
+  /* Every waiting call is admitted again, now that the transcoder
+   * exists. */
+  while ((invocation = g_queue_pop_head (&build->invocations)) != NULL) {
+    if (transcoder == NULL) {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+    } else {
+      _start_request (self, invocation);
+    }
+  }
+
+  if (transcoder != NULL &&
+      gaeul_mjpeg_transcoder_get_n_branches (transcoder) == 0) {
+    g_clear_object (&transcoder);
+    _remove_transcoder (self, uid, rid);
+  }
+
+  _publish_admission_usage (self);
+
+  g_variant_unref (build->key);
+  g_object_unref (build->app);
+  g_free (build);
+}
+
+/* Builds the transcoder of @uid and @rid off the main thread. @invocation
+ * is started again once it is ready. */
+static void
+_build_transcoder (GaeulMjpegApplication * self,
+    GDBusMethodInvocation * invocation, GaeulMjpegRequest * request)
+{
+  g_autoptr (GVariant) key =
+      g_variant_ref_sink (g_variant_new ("(ss)", request->uid, request->rid));
+  GaeulMjpegTranscoderBuild *build =
+      g_hash_table_lookup (self->transcoder_builds, key);
+
+  if (build != NULL) {
+    g_queue_push_tail (&build->invocations, invocation);
+    return;
+  }
+
+  build = g_new0 (GaeulMjpegTranscoderBuild, 1);
+  build->app = g_object_ref (self);
+  build->key = g_variant_ref (key);
+  g_queue_init (&build->invocations);
+  g_queue_push_tail (&build->invocations, invocation);
+
+  g_hash_table_insert (self->transcoder_builds, g_steal_pointer (&key), build);
+
+  gaeul_mjpeg_transcoder_new_async (self->relay_url, request->uid,
+      request->rid, request->protocol_latency, request->demux_latency, NULL,
+      _transcoder_built_cb, build);
+}
+
+static gboolean
+_is_start_with_options (GDBusMethodInvocation * invocation)
+{
+  return g_strcmp0 (g_dbus_method_invocation_get_method_name (invocation),
+      "StartWithOptions") == 0;
+}
+
+/* Creates the request asked by a Start or StartWithOptions call. */
+static GaeulMjpegRequest *
+_parse_start_request (GaeulMjpegApplication * self,
+    GDBusMethodInvocation * invocation)
+{
+  GVariant *parameters = g_dbus_method_invocation_get_parameters (invocation);
+  const gchar *uid = NULL;
+  const gchar *rid = NULL;
+  guint width, height, fps, latency, flip, orientation;
+  g_autoptr (GVariant) options = NULL;
+  GaeulMjpegRequestFlags flags = GAEUL_MJPEG_REQUEST_FLAG_NONE;
+  gboolean thumbnail = FALSE;
+
+  if (_is_start_with_options (invocation)) {
+    g_variant_get (parameters, "(&s&suuuuuu@a{sv})", &uid, &rid, &width,
+        &height, &fps, &latency, &flip, &orientation, &options);
+  } else {
+    g_variant_get (parameters, "(&s&suuuuuu)", &uid, &rid, &width, &height,
+        &fps, &latency, &flip, &orientation);
+  }
+
+  /* Thumbnails don't need more than the keyframes of the stream. */
+  if (options == NULL ||
+      !g_variant_lookup (options, "thumbnail", "b", &thumbnail)) {
+    thumbnail = fps < g_settings_get_uint (self->settings,
+        "thumbnail-fps-threshold");
+  }
+
+  if (thumbnail) {
+    flags |= GAEUL_MJPEG_REQUEST_FLAG_KEYFRAME_ONLY;
+  }
+
+  /* The latency of tsdemux is left to the transcoder, which sets it from
+   * the PCR interval of the stream. */
+  return gaeul_mjpeg_request_new (uid, rid, latency, 0, width, height, fps,
+      flip, orientation, flags);
+}
+
+/* Returns FALSE when an error has already been returned through
+ * @invocation. */
+static gboolean
+_admit_session (GaeulMjpegApplication * self,
+    GDBusMethodInvocation * invocation, const gchar * uid)
+{
+  if (_get_uid_sessions (self, uid) >= self->limit_sessions_per_user) {
+    g_info ("rejecting start for uid %s, %u sessions already", uid,
+        self->limit_sessions_per_user);
+    g_dbus_method_invocation_return_error (invocation, GAEUL_MJPEG_ERROR,
+        GAEUL_MJPEG_ERROR_TOO_MANY_SESSIONS_PER_USER,
+        "Too many sessions for uid %s (limit: %u)", uid,
+        self->limit_sessions_per_user);
+    return FALSE;
+  }
+
+  if (_get_n_user_sessions (self) >= self->limit_user_sessions) {
+    g_info ("rejecting start for uid %s, %u user sessions already", uid,
+        self->limit_user_sessions);
+    g_dbus_method_invocation_return_error (invocation, GAEUL_MJPEG_ERROR,
+        GAEUL_MJPEG_ERROR_TOO_MANY_USER_SESSIONS,
+        "Too many user sessions (limit: %u)", self->limit_user_sessions);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+_complete_start (GaeulMjpegApplication * self,
+    GDBusMethodInvocation * invocation, const gchar * return_url,
+    const gchar * request_id)
+{
+  if (_is_start_with_options (invocation)) {
+    gaeul2_dbus_mjpegservice_complete_start_with_options (self->service,
+        invocation, return_url, request_id);
+  } else {
+    gaeul2_dbus_mjpegservice_complete_start (self->service, invocation,
+        return_url, request_id);
+  }
+}
+
+/* Eager requests start streaming as soon as they are started, instead of
+ * when their first HTTP client arrives. */
+static gboolean
+_is_eager_start (GaeulMjpegApplication * self,
+    GDBusMethodInvocation * invocation)
+{
+  GVariant *parameters = g_dbus_method_invocation_get_parameters (invocation);
+  g_autoptr (GVariant) options = NULL;
+  gboolean eager = FALSE;
+
+  if (_is_start_with_options (invocation)) {
+    options = g_variant_get_child_value (parameters, 8);
+    if (g_variant_lookup (options, "eager", "b", &eager)) {
+      return eager;
+    }
+  }
+
+  return g_settings_get_boolean (self->settings, "eager-start");
+}
+
+/* Sessions of a lower priority are degraded first under load. */
+static guint
+_get_start_priority (GDBusMethodInvocation * invocation)
+{
+  GVariant *parameters = g_dbus_method_invocation_get_parameters (invocation);
+  g_autoptr (GVariant) options = NULL;
+  guint priority = 0;
+
+  if (_is_start_with_options (invocation)) {
+    options = g_variant_get_child_value (parameters, 8);
+    g_variant_lookup (options, "priority", "u", &priority);
+  }
+
+  return priority;
+}
+
+/* Stops an eager request, unless its first HTTP client arrives within
+ * eager-start-timeout. The deadline is kept by the lease of the request,
+ * and goes with it when the request is stopped. */
+static void
+_watch_client_arrival (GaeulMjpegApplication * self, const gchar * request_id)
+{
+  guint timeout = g_settings_get_uint (self->settings, "eager-start-timeout");
+  GaeulMjpegLease *lease = NULL;
+
+  if (timeout == 0) {
+    return;
+  }
+
+  g_mutex_lock (&self->http_lock);
+  if ((lease = g_hash_table_lookup (self->http_request_ids,
+              request_id)) != NULL) {
+    lease->arrival_deadline =
+        g_get_monotonic_time () + timeout * G_TIME_SPAN_MILLISECOND;
+    gaeul_mjpeg_lease_wheel_schedule (&self->lease_wheel, lease);
+  }
+  g_mutex_unlock (&self->http_lock);
+}
+
+static void
+_start_eagerly (GaeulMjpegApplication * self, GaeulMjpegPipeline * pipeline,
+    const gchar * request_id)
+{
+  /* Streaming pipelines have nothing left to start. */
+  if (gaeul_mjpeg_transcoder_get_n_clients (pipeline->transcoder) == 0) {
+    g_debug ("prerolling pipeline %p (id: %s)", pipeline->transcoder,
+        request_id);
+
+    if (!pipeline->first_frame_sampled) {
+      pipeline->eager = TRUE;
+    }
+    gaeul_mjpeg_transcoder_preroll (pipeline->transcoder);
+  }
+
+  /* A worker leaves it to the agent, which serves the HTTP clients. */
+  if (self->worker_fd < 0) {
+    _watch_client_arrival (self, request_id);
+  }
+}
+
+/* Completes @invocation, either with the url and id of a new request or
+ * with an error. Calls waiting for their transcoder to be built are
+ * completed later on. */
+static void
+_start_request (GaeulMjpegApplication * self,
+    GDBusMethodInvocation * invocation)
+{
+  g_autofree gchar *return_url = NULL;
+  g_autofree gchar *request_id = NULL;
+  g_autoptr (GaeulMjpegRequest) request = NULL;
+  GaeulMjpegPipeline *pipeline = NULL;
+  const gchar *uid = NULL;
+  const gchar *rid = NULL;
+  gchar *request_id_key = NULL;
+
+  request = _parse_start_request (self, invocation);
+  uid = request->uid;
+  rid = request->rid;
+
+  /* Every start request will have unique id. */
+  request_id = g_uuid_string_random ();
+
+  if (!_admit_session (self, invocation, uid)) {
+    return;
+  }
+
+  g_debug ("start transcoder (id: %s) uid: %s rid: %s "
+      "  resolution: %dx%d  fps: %d latency: %" G_GUINT32_FORMAT " ms.",
+      request_id, uid, rid, request->width, request->height, request->fps,
+      request->protocol_latency);
+
+  return_url =
+      _build_return_url (self->external_url, self->local_ip,
+      g_settings_get_uint (self->settings, "bind-port"), request_id);
+
+  /* Check if transcoding pipeline is running. The request is kept as it
+   * is, since its frame rate may differ from the one of the pipeline. */
+  if ((pipeline = g_hash_table_lookup (self->pipelines, request)) != NULL) {
+    g_debug ("found existing mjpeg transcoder pipeline (id: %s)", request_id);
+    gaeul_mjpeg_transcoder_add_branch (pipeline->transcoder, request, NULL);
+  }
+
+  if (pipeline != NULL && pipeline->linger_link != NULL) {
+    g_debug ("reusing lingering pipeline %p", pipeline->transcoder);
+
+    _linger_pool_remove (self, pipeline);
+    _linger_pool_schedule (self);
+
+    self->linger_hits++;
+    if (self->cold_start_count > 0) {
+      self->linger_latency_saved +=
+          self->cold_start_total / self->cold_start_count;
+    }
+  }
+
+  if (pipeline == NULL) {
+
+    /* Transcoding branch must be created. The SRT connection and the
+     * decoder are shared by every branch of the same uid and rid. */
+
+    g_autoptr (GError) error = NULL;
+    GaeulMjpegTranscoder *transcoder = NULL;
+    gint64 build_start = g_get_monotonic_time ();
+
+    transcoder = GAEUL_MJPEG_TRANSCODER (gaeul_tuple_lookup (self->transcoders,
+            uid, rid));
+
+    if (transcoder == NULL) {
+      g_autoptr (GVariant) build_key =
+          g_variant_ref_sink (g_variant_new ("(ss)", uid, rid));
+      gboolean building =
+          g_hash_table_contains (self->transcoder_builds, build_key);
+
+      /* Idle pipelines are the first to go when SRT connections run out. */
+      while (!building && _get_n_srt_connections (self) >=
+          self->limit_srt_connections && !g_queue_is_empty (&self->lingering)) {
+        _linger_pool_evict (self);
+      }
+      _linger_pool_schedule (self);
+
+      if (!building &&
+          _get_n_srt_connections (self) >= self->limit_srt_connections) {
+        g_info ("rejecting start for uid %s, %u SRT connections already", uid,
+            self->limit_srt_connections);
+        g_dbus_method_invocation_return_error (invocation, GAEUL_MJPEG_ERROR,
+            GAEUL_MJPEG_ERROR_TOO_MANY_SRT_CONNECTIONS,
+            "Too many SRT connections (limit: %u)",
+            self->limit_srt_connections);
+        _publish_admission_usage (self);
+        return;
+      }
+
+      /* Connecting to the relay and prerolling may take a while, which
+       * must not hold back other D-Bus calls and pipelines. */
+      _build_transcoder (self, invocation, request);
+      _publish_admission_usage (self);
+      return;
+    } else {
+      g_debug ("found existing mjpeg transcoder pipeline for (uid: %s, rid: %s)",
+          uid, rid);
+    }
+
+    if (!gaeul_mjpeg_transcoder_add_branch (transcoder, request, &error)) {
+      if (gaeul_mjpeg_transcoder_get_n_branches (transcoder) == 0) {
+        _remove_transcoder (self, uid, rid);
+      }
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return;
+    }
+
+    pipeline = g_new0 (GaeulMjpegPipeline, 1);
+    pipeline->request = request;
+    pipeline->transcoder = g_object_ref (transcoder);
+    pipeline->build_time = g_get_monotonic_time () - build_start;
+
+    self->linger_misses++;
+
+    g_hash_table_insert (self->pipelines, gaeul_mjpeg_request_ref (request),
+        pipeline);
+  }
+
+  pipeline->n_sessions++;
+  pipeline->priority = MAX (pipeline->priority,
+      _get_start_priority (invocation));
+
+  request_id_key = g_strdup (request_id);
+  _index_request (self, request_id_key, request);
+
+  _http_add_request_id (self, request_id);
+
+  g_hash_table_insert (self->request_ids, request_id_key,
+      g_steal_pointer (&request));
+
+  if (_is_eager_start (self, invocation)) {
+    _start_eagerly (self, pipeline, request_id);
+  }
+
+  _publish_admission_usage (self);
+
+  _complete_start (self, invocation, return_url, request_id);
+}
+
+/* Drops the uid and rid of a stopped request from the worker it was
+ * placed on, unless another request still streams it. */
+static void
+_unplace_request (GaeulMjpegApplication * self, const gchar * uid,
+    const gchar * rid)
+{
+  GHashTable *request_ids = g_hash_table_lookup (self->uid_request_ids, uid);
+
+  if (request_ids != NULL) {
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init (&iter, request_ids);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+      if (((GaeulMjpegRequest *) value)->rid == rid) {
+        return;
+      }
+    }
+  }
+
+  if (gaeul_tuple_remove (self->worker_placements, uid, rid)) {
+    self->n_worker_placements--;
+  }
+}
+
+/* Forgets a request placed on a worker, and returns the worker. */
+static GaeulMjpegWorker *
+_supervisor_remove_request (GaeulMjpegApplication * self,
+    const gchar * request_id)
+{
+  GaeulMjpegRequest *r = g_hash_table_lookup (self->request_ids, request_id);
+  GaeulMjpegWorker *worker = NULL;
+  const gchar *uid = NULL;
+  const gchar *rid = NULL;
+
+  if (r == NULL) {
+    return NULL;
+  }
+
+  uid = r->uid;
+  rid = r->rid;
+
+  g_mutex_lock (&self->http_lock);
+  worker = g_hash_table_lookup (self->worker_requests, request_id);
+  if (worker != NULL) {
+    g_object_ref (worker);
+    g_hash_table_remove (self->worker_requests, request_id);
+  }
+  g_hash_table_remove (self->http_request_ids, request_id);
+  g_mutex_unlock (&self->http_lock);
+
+  if (worker != NULL) {
+    gaeul_mjpeg_worker_release_session (worker);
+  }
+
+  _unindex_request (self, request_id, r);
+  g_hash_table_remove (self->request_ids, request_id);
+  _unplace_request (self, uid, rid);
+
+  return worker;
+}
+
+static void
+_worker_closed_cb (GaeulMjpegWorker * worker, gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+  g_autoptr (GPtrArray) request_ids = g_ptr_array_new_with_free_func (g_free);
+  GaeulMjpegWorkerStats stats = { 0, };
+  GHashTableIter iter;
+  gpointer key, value;
+  guint i;
+
+  g_mutex_lock (&self->http_lock);
+  g_hash_table_iter_init (&iter, self->worker_requests);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    if (value == worker) {
+      g_ptr_array_add (request_ids, g_strdup (key));
+    }
+  }
+  g_mutex_unlock (&self->http_lock);
+
+  g_warning ("mjpeg worker %u is gone, dropping %u sessions",
+      gaeul_mjpeg_worker_get_index (worker), request_ids->len);
+
+  for (i = 0; i < request_ids->len; i++) {
+    GaeulMjpegWorker *removed =
+        _supervisor_remove_request (self, g_ptr_array_index (request_ids, i));
+
+    g_clear_object (&removed);
+  }
+
+  gaeul_mjpeg_worker_get_stats (worker, &stats);
+  self->srt_bytes_received_stopped += stats.bytes_received;
+  self->http_bytes_sent_stopped += stats.bytes_sent;
+
+  /* A worker crashing right away is not respawned in a busy loop. */
+  if (self->respawn_timeout_id == 0) {
+    self->respawn_timeout_id =
+        g_timeout_add_seconds (1, _respawn_workers_timeout, self);
+  }
+
+  _publish_admission_usage (self);
+}
+
+static GaeulMjpegWorker *
+_least_loaded_worker (GaeulMjpegApplication * self)
+{
+  GaeulMjpegWorker *least_loaded = NULL;
+  guint i;
+
+  for (i = 0; i < self->workers->len; i++) {
+    GaeulMjpegWorker *worker = g_ptr_array_index (self->workers, i);
+
+    if (!gaeul_mjpeg_worker_is_ready (worker)) {
+      continue;
+    }
+
+    if (least_loaded == NULL ||
+        gaeul_mjpeg_worker_get_n_sessions (worker) <
+        gaeul_mjpeg_worker_get_n_sessions (least_loaded)) {
+      least_loaded = worker;
+    }
+  }
+
+  return least_loaded;
+}
+
+typedef struct
+{
+  GaeulMjpegApplication *app;
+  GDBusMethodInvocation *invocation;
+  GaeulMjpegWorker *worker;
+  GaeulMjpegRequest *request;
+} GaeulMjpegWorkerCall;
+
+static void
+_worker_call_free (GaeulMjpegWorkerCall * call)
+{
+  g_object_unref (call->app);
+  g_object_unref (call->worker);
+  gaeul_mjpeg_request_unref (call->request);
+  g_free (call);
+}
+
+static void
+_supervisor_start_cb (GObject * source, GAsyncResult * result,
+    gpointer user_data)
+{
+  GaeulMjpegWorkerCall *call = user_data;
+  GaeulMjpegApplication *self = call->app;
+  g_autoptr (GVariant) reply = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autofree gchar *return_url = NULL;
+  const gchar *request_id = NULL;
+  gchar *request_id_key = NULL;
+
+  reply = g_dbus_proxy_call_finish (G_DBUS_PROXY (source), result, &error);
+
+  if (reply != NULL && !gaeul_mjpeg_worker_is_ready (call->worker)) {
+    g_clear_pointer (&reply, g_variant_unref);
+    g_set_error (&error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+        "The worker of the request is gone");
+  }
+
+  if (reply == NULL) {
+    g_dbus_error_strip_remote_error (error);
+    g_dbus_method_invocation_return_gerror (call->invocation, error);
+
+    gaeul_mjpeg_worker_release_session (call->worker);
+    _unplace_request (self, call->request->uid, call->request->rid);
+    _publish_admission_usage (self);
+    _worker_call_free (call);
+    return;
+  }
+
+  /* The url of the worker is replaced by the one of the agent, which
+   * serves the HTTP clients. */
+  g_variant_get (reply, "(&s&s)", NULL, &request_id);
+  return_url =
+      _build_return_url (self->external_url, self->local_ip,
+      g_settings_get_uint (self->settings, "bind-port"), request_id);
+
+  request_id_key = g_strdup (request_id);
+  _index_request (self, request_id_key, call->request);
+  g_hash_table_insert (self->request_ids, request_id_key,
+      gaeul_mjpeg_request_ref (call->request));
+
+  _http_add_request_id (self, request_id);
+
+  g_mutex_lock (&self->http_lock);
+  g_hash_table_insert (self->worker_requests, g_strdup (request_id),
+      g_object_ref (call->worker));
+  g_mutex_unlock (&self->http_lock);
+
+  if (_is_eager_start (self, call->invocation)) {
+    _watch_client_arrival (self, request_id);
+  }
+
+  _publish_admission_usage (self);
+
+  _complete_start (self, call->invocation, return_url, request_id);
+  _worker_call_free (call);
+}
+
+/* Places the request on a worker. Requests for the same uid and rid go to
+ * the same worker, so that they share its SRT connection and decoder. */
+static void
+_supervisor_start (GaeulMjpegApplication * self,
+    GDBusMethodInvocation * invocation)
+{
+  g_autoptr (GaeulMjpegRequest) request = NULL;
+  GaeulMjpegWorker *worker = NULL;
+  GaeulMjpegWorkerCall *call = NULL;
+
+  request = _parse_start_request (self, invocation);
+
+  if (!_admit_session (self, invocation, request->uid)) {
+    return;
+  }
+
+  worker = GAEUL_MJPEG_WORKER (gaeul_tuple_lookup (self->worker_placements,
+          request->uid, request->rid));
+
+  if (worker == NULL) {
+    if (_get_n_srt_connections (self) >= self->limit_srt_connections) {
+      g_info ("rejecting start for uid %s, %u SRT connections already",
+          request->uid, self->limit_srt_connections);
+      g_dbus_method_invocation_return_error (invocation, GAEUL_MJPEG_ERROR,
+          GAEUL_MJPEG_ERROR_TOO_MANY_SRT_CONNECTIONS,
+          "Too many SRT connections (limit: %u)",
+          self->limit_srt_connections);
+      return;
+    }
+
+    if ((worker = _least_loaded_worker (self)) == NULL) {
+      g_dbus_method_invocation_return_error (invocation, G_IO_ERROR,
+          G_IO_ERROR_NOT_CONNECTED, "No transcoding worker is available");
+      return;
+    }
+
+    gaeul_tuple_insert (self->worker_placements, request->uid, request->rid,
+        G_OBJECT (worker));
+    self->n_worker_placements++;
+  }
+
+  g_debug ("placing request for (uid: %s, rid: %s) on mjpeg worker %u",
+      request->uid, request->rid, gaeul_mjpeg_worker_get_index (worker));
+
+  /* The session counts towards the load of the worker right away, so
+   * that concurrent Starts spread. */
+  gaeul_mjpeg_worker_hold_session (worker);
+
+  call = g_new0 (GaeulMjpegWorkerCall, 1);
+  call->app = g_object_ref (self);
+  call->invocation = invocation;
+  call->worker = g_object_ref (worker);
+  call->request = g_steal_pointer (&request);
+
+  g_dbus_proxy_call (G_DBUS_PROXY (gaeul_mjpeg_worker_get_service (worker)),
+      g_dbus_method_invocation_get_method_name (invocation),
+      g_dbus_method_invocation_get_parameters (invocation),
+      G_DBUS_CALL_FLAGS_NONE, -1, NULL, _supervisor_start_cb, call);
+}
+
+static void
+_forward_reply_cb (GObject * source, GAsyncResult * result,
+    gpointer user_data)
+{
+  GDBusMethodInvocation *invocation = user_data;
+  g_autoptr (GVariant) reply = NULL;
+  g_autoptr (GError) error = NULL;
+
+  reply = g_dbus_proxy_call_finish (G_DBUS_PROXY (source), result, &error);
+
+  if (reply == NULL) {
+    g_dbus_error_strip_remote_error (error);
+    g_dbus_method_invocation_return_gerror (invocation, error);
+    return;
+  }
+
+  g_dbus_method_invocation_return_value (invocation, reply);
+}
+
+/* Forwards a call about @request_id to the worker of the request. */
+static void
+_forward_request_call (GaeulMjpegApplication * self,
+    GDBusMethodInvocation * invocation, const gchar * request_id)
+{
+  GaeulMjpegWorker *worker = NULL;
+
+  g_mutex_lock (&self->http_lock);
+  worker = g_hash_table_lookup (self->worker_requests, request_id);
+  g_mutex_unlock (&self->http_lock);
+
+  if (worker == NULL) {
+    g_dbus_method_invocation_return_error (invocation, G_IO_ERROR,
+        G_IO_ERROR_NOT_FOUND, "No such request (id: %s)", request_id);
+    return;
+  }
+
+  g_dbus_proxy_call (G_DBUS_PROXY (gaeul_mjpeg_worker_get_service (worker)),
+      g_dbus_method_invocation_get_method_name (invocation),
+      g_dbus_method_invocation_get_parameters (invocation),
+      G_DBUS_CALL_FLAGS_NONE, -1, NULL, _forward_reply_cb, invocation);
+}
+
+static gboolean
+gaeul_mjpeg_application_handle_start (Gaeul2DBusMJPEGService * object,
+    GDBusMethodInvocation * invocation,
+    const gchar * uid, const gchar * rid,
+    guint width, guint height, guint fps, guint latency, guint flip,
+    guint orientation, gpointer user_data)
+{
+  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (user_data);
+
+  if (self->workers != NULL) {
+    _supervisor_start (self, invocation);
+  } else {
+    _start_request (self, invocation);
+  }
+
+  return TRUE;
+}
+
+static gboolean
+gaeul_mjpeg_application_handle_start_with_options (Gaeul2DBusMJPEGService *
+    object, GDBusMethodInvocation * invocation,
+    const gchar * uid, const gchar * rid,
+    guint width, guint height, guint fps, guint latency, guint flip,
+    guint orientation, GVariant * options, gpointer user_data)
+{
+  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (user_data);
+
+  if (self->workers != NULL) {
+    _supervisor_start (self, invocation);
+  } else {
+    _start_request (self, invocation);
   }
 
-  g_hash_table_insert (self->request_ids, g_strdup (request_id),
-      g_steal_pointer (&request));
+  return TRUE;
+}
+
+static void
+_mosaic_client_added_cb (GaeulMjpegMosaic * mosaic, GSocket * socket,
+    gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+
+  g_atomic_int_inc (&self->n_http_clients);
+}
+
+static void
+_mosaic_client_removed_cb (GaeulMjpegMosaic * mosaic, GSocket * socket,
+    gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+
+  g_atomic_int_add (&self->n_http_clients, -1);
+  _release_connection (socket);
+}
+
+/* A mosaic shares nothing with the other requests, so the agent composes
+ * it itself, also when the transcoders run on workers. Each tile counts as
+ * an SRT connection, and the mosaic as a single user session. */
+static gboolean
+gaeul_mjpeg_application_handle_start_mosaic (Gaeul2DBusMJPEGService * object,
+    GDBusMethodInvocation * invocation, const gchar * layout,
+    GVariant * tiles, guint width, guint height, guint fps, guint latency,
+    gpointer user_data)
+{
+  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (user_data);
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GaeulMjpegMosaic) mosaic = NULL;
+  g_autofree gchar *return_url = NULL;
+  g_autofree gchar *request_id = NULL;
+  guint n_tiles = g_variant_n_children (tiles);
+
+  if (_get_n_user_sessions (self) >= self->limit_user_sessions) {
+    g_info ("rejecting mosaic, %u user sessions already",
+        self->limit_user_sessions);
+    g_dbus_method_invocation_return_error (invocation, GAEUL_MJPEG_ERROR,
+        GAEUL_MJPEG_ERROR_TOO_MANY_USER_SESSIONS,
+        "Too many user sessions (limit: %u)", self->limit_user_sessions);
+    return TRUE;
+  }
+
+  /* Idle pipelines are the first to go when SRT connections run out. */
+  while (_get_n_srt_connections (self) + n_tiles >
+      self->limit_srt_connections && !g_queue_is_empty (&self->lingering)) {
+    _linger_pool_evict (self);
+  }
+  _linger_pool_schedule (self);
+
+  if (_get_n_srt_connections (self) + n_tiles > self->limit_srt_connections) {
+    g_info ("rejecting mosaic of %u tiles, %u SRT connections already",
+        n_tiles, self->limit_srt_connections);
+    g_dbus_method_invocation_return_error (invocation, GAEUL_MJPEG_ERROR,
+        GAEUL_MJPEG_ERROR_TOO_MANY_SRT_CONNECTIONS,
+        "Too many SRT connections (limit: %u)", self->limit_srt_connections);
+    _publish_admission_usage (self);
+    return TRUE;
+  }
+
+  mosaic = gaeul_mjpeg_mosaic_new (self->relay_url, layout, tiles, width,
+      height, fps, latency, &error);
+
+  if (mosaic == NULL) {
+    g_dbus_method_invocation_return_gerror (invocation, error);
+    return TRUE;
+  }
+
+  g_signal_connect (mosaic, "client-added",
+      G_CALLBACK (_mosaic_client_added_cb), self);
+  g_signal_connect (mosaic, "client-removed",
+      G_CALLBACK (_mosaic_client_removed_cb), self);
+
+  request_id = g_uuid_string_random ();
+  return_url =
+      _build_return_url (self->external_url, self->local_ip,
+      g_settings_get_uint (self->settings, "bind-port"), request_id);
+
+  g_debug ("start mosaic (id: %s) of %u tiles, resolution: %ux%u fps: %u",
+      request_id, n_tiles, width, height, fps);
+
+  self->n_mosaic_tiles += n_tiles;
+  g_hash_table_insert (self->mosaics, g_strdup (request_id),
+      g_steal_pointer (&mosaic));
+
+  _http_add_request_id (self, request_id);
+
+  _publish_admission_usage (self);
+
+  gaeul2_dbus_mjpegservice_complete_start_mosaic (object, invocation,
+      return_url, request_id);
+
+  return TRUE;
+}
+
+/* Removes the mosaic of @request_id, whose last reference is then dropped
+ * by the teardown thread. */
+static void
+_remove_mosaic (GaeulMjpegApplication * self, const gchar * request_id)
+{
+  GaeulMjpegMosaic *mosaic = g_hash_table_lookup (self->mosaics, request_id);
+
+  g_debug ("stopping mosaic %p (id: %s)", mosaic, request_id);
+
+  self->srt_bytes_received_stopped +=
+      gaeul_mjpeg_mosaic_get_bytes_received (mosaic);
+  self->http_bytes_sent_stopped += gaeul_mjpeg_mosaic_get_bytes_sent (mosaic);
+  self->n_mosaic_tiles -= gaeul_mjpeg_mosaic_get_n_tiles (mosaic);
+
+  g_object_ref (mosaic);
+  g_hash_table_remove (self->mosaics, request_id);
+
+  g_thread_pool_push (self->teardown_pool, mosaic, NULL);
+}
+
+/* Stops the request of @request_id, and returns whether there was one. */
+static gboolean
+_stop_request (GaeulMjpegApplication * self, const gchar * request_id)
+{
+  GaeulMjpegRequest *r = NULL;
+  GaeulMjpegPipeline *pipeline = NULL;
 
-  gaeul2_dbus_mjpegservice_complete_start (object, invocation, return_url,
-      request_id);
+  if (g_hash_table_contains (self->mosaics, request_id)) {
+    g_mutex_lock (&self->http_lock);
+    g_hash_table_remove (self->http_request_ids, request_id);
+    g_mutex_unlock (&self->http_lock);
+
+    _remove_mosaic (self, request_id);
+    _publish_admission_usage (self);
+
+    return TRUE;
+  }
+
+  if (self->workers != NULL) {
+    g_autoptr (GaeulMjpegWorker) worker =
+        _supervisor_remove_request (self, request_id);
+
+    if (worker != NULL) {
+      gaeul2_dbus_mjpegservice_call_stop (gaeul_mjpeg_worker_get_service
+          (worker), request_id, NULL, NULL, NULL);
+    }
+
+    _publish_admission_usage (self);
+
+    return worker != NULL;
+  }
+
+  if ((r = g_hash_table_lookup (self->request_ids, request_id)) == NULL) {
+    return FALSE;
+  }
+
+  pipeline = g_hash_table_lookup (self->pipelines, r);
+
+  _unindex_request (self, request_id, r);
+
+  g_mutex_lock (&self->http_lock);
+  g_hash_table_remove (self->http_request_ids, request_id);
+  g_mutex_unlock (&self->http_lock);
+
+  if (pipeline != NULL && --pipeline->n_sessions == 0) {
+    _pipeline_release (self, pipeline);
+  }
+
+  g_hash_table_remove (self->request_ids, request_id);
+
+  _publish_admission_usage (self);
 
   return TRUE;
 }
@@ -610,31 +2701,443 @@ gaeul_mjpeg_application_handle_stop (Gaeul2DBusMJPEGService * object,
     const gchar * request_id, gpointer user_data)
 {
   GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (user_data);
-  GaeulMjpegRequest *r = NULL;
 
-  if ((r = g_hash_table_lookup (self->request_ids, request_id)) == NULL) {
+  if (!_stop_request (self, request_id) && self->workers == NULL) {
     g_info ("Stop operation is requested (id: %s), but not existed",
         request_id);
     return TRUE;
   }
 
-  /* FIXME: It's not a good idea to access refcount directly */
-  if (r->refcount > 1) {
-    gaeul_mjpeg_request_unref (r);
-    g_info ("after unref r->refcount: %u", r->refcount);
+  gaeul2_dbus_mjpegservice_complete_stop (object, invocation);
+
+  return TRUE;
+}
+
+/* Only a branch serving the request alone is changed, as the other
+ * requests sharing it would be changed along. */
+static gboolean
+gaeul_mjpeg_application_handle_update (Gaeul2DBusMJPEGService * object,
+    GDBusMethodInvocation * invocation, const gchar * request_id,
+    guint width, guint height, guint fps, guint flip, guint orientation,
+    gpointer user_data)
+{
+  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (user_data);
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GaeulMjpegRequest) update = NULL;
+  GaeulMjpegRequest *r = NULL;
+  GaeulMjpegPipeline *pipeline = NULL;
+  GaeulMjpegPipeline *other = NULL;
+  GaeulMjpegLease *lease = NULL;
+  gpointer request_id_key = NULL;
+  gpointer pipeline_key = NULL;
+
+  if (self->workers != NULL) {
+    _forward_request_call (self, invocation, request_id);
+    return TRUE;
+  }
+
+  if (!g_hash_table_lookup_extended (self->request_ids, request_id,
+          &request_id_key, (gpointer *) & r) ||
+      (pipeline = g_hash_table_lookup (self->pipelines, r)) == NULL) {
+    g_dbus_method_invocation_return_error (invocation, G_IO_ERROR,
+        G_IO_ERROR_NOT_FOUND, "No such request (id: %s)", request_id);
+    return TRUE;
+  }
+
+  if (pipeline->n_sessions > 1) {
+    g_dbus_method_invocation_return_error (invocation, G_IO_ERROR,
+        G_IO_ERROR_BUSY, "Request (id: %s) shares its stream with %u others",
+        request_id, pipeline->n_sessions - 1);
+    return TRUE;
+  }
+
+  update = gaeul_mjpeg_request_new (r->uid, r->rid, r->protocol_latency,
+      r->demux_latency, width, height, fps, flip, orientation, r->flags);
+
+  g_debug ("update transcoder (id: %s) resolution: %dx%d fps: %d "
+      "flip: %u orientation: %u", request_id, update->width, update->height,
+      update->fps, update->flip, update->orientation);
+
+  /* Nobody is watching the output of a lingering pipeline. */
+  if ((other = g_hash_table_lookup (self->pipelines, update)) != NULL &&
+      other != pipeline && other->linger_link != NULL) {
+    _linger_pool_remove (self, other);
+    _pipeline_destroy (self, other);
+    _linger_pool_schedule (self);
+  }
+
+  if (!gaeul_mjpeg_transcoder_update_branch (pipeline->transcoder, r, update,
+          &error)) {
+    g_dbus_method_invocation_return_gerror (invocation, error);
+    return TRUE;
+  }
+
+  g_hash_table_lookup_extended (self->pipelines, r, &pipeline_key, NULL);
+  g_hash_table_steal (self->pipelines, pipeline_key);
+  gaeul_mjpeg_request_unref (pipeline_key);
+
+  pipeline->request = update;
+  g_hash_table_insert (self->pipelines, gaeul_mjpeg_request_ref (update),
+      pipeline);
+
+  /* The key of the request id stays, as the index borrows it. */
+  _unindex_request (self, request_id_key, r);
+  g_hash_table_insert (self->request_ids, g_strdup (request_id),
+      gaeul_mjpeg_request_ref (update));
+  _index_request (self, request_id_key, update);
+
+  g_mutex_lock (&self->http_lock);
+  if ((lease = g_hash_table_lookup (self->http_request_ids,
+              request_id)) != NULL) {
+    _lease_renew (self, lease);
+  }
+  g_mutex_unlock (&self->http_lock);
+
+  _publish_admission_usage (self);
+
+  gaeul2_dbus_mjpegservice_complete_update (object, invocation);
+
+  return TRUE;
+}
+
+typedef struct
+{
+  GaeulMjpegApplication *app;
+  gchar *request_id;
+} GaeulMjpegLeaseCheck;
+
+static void
+_lease_check_free (GaeulMjpegLeaseCheck * check)
+{
+  g_object_unref (check->app);
+  g_free (check->request_id);
+  g_free (check);
+}
+
+/* Reaps the request of an expired lease, or of an eager start whose first
+ * HTTP client didn't arrive in time. A stream that still has HTTP clients
+ * counts as activity, which renews the lease instead. */
+static void
+_lease_expire (GaeulMjpegApplication * self, const gchar * request_id,
+    gboolean has_clients)
+{
+  GaeulMjpegLease *lease = NULL;
+  gint64 now = g_get_monotonic_time ();
+  gboolean expired = FALSE;
+  gboolean missed = FALSE;
+
+  g_mutex_lock (&self->http_lock);
+  if ((lease = g_hash_table_lookup (self->http_request_ids,
+              request_id)) != NULL) {
+    if (lease->arrival_deadline != 0 && lease->arrival_deadline <= now) {
+      missed = TRUE;
+    } else if (!has_clients && lease->deadline != 0 &&
+        lease->deadline <= now) {
+      expired = TRUE;
+    } else {
+      if (has_clients) {
+        _lease_renew (self, lease);
+      }
+
+      /* It may have been renewed while it was being checked, which put it
+       * back on the wheel already. */
+      gaeul_mjpeg_lease_wheel_schedule (&self->lease_wheel, lease);
+    }
+  }
+  g_mutex_unlock (&self->http_lock);
+
+  if (missed) {
+    g_info ("no HTTP client arrived for eager request (id: %s), stopping",
+        request_id);
+    _stop_request (self, request_id);
+  } else if (expired) {
+    g_info ("lease of request (id: %s) expired, reaping", request_id);
+    self->n_reaped_sessions++;
+    _stop_request (self, request_id);
+  }
+}
+
+static void
+_lease_check_cb (GObject * source, GAsyncResult * result, gpointer user_data)
+{
+  GaeulMjpegLeaseCheck *check = user_data;
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GVariant) stats = NULL;
+  guint http_connections = 0;
+
+  if (!gaeul2_dbus_mjpegservice_call_get_request_stats_finish
+      (GAEUL2_DBUS_MJPEGSERVICE (source), &stats, result, &error)) {
+    g_debug ("failed to check request (id: %s) (reason: %s)",
+        check->request_id, error->message);
   } else {
-    GstElement *pipeline = g_hash_table_lookup (self->pipelines, r);
+    g_variant_lookup (stats, "http-connections", "u", &http_connections);
+  }
+
+  _lease_expire (check->app, check->request_id, http_connections > 0);
+  _lease_check_free (check);
+}
+
+/* The lease is not scheduled while it is being checked. */
+static void
+_lease_check (GaeulMjpegApplication * self, const gchar * request_id)
+{
+  GaeulMjpegRequest *r = NULL;
+  GaeulMjpegPipeline *pipeline = NULL;
+  GaeulMjpegMosaic *mosaic = NULL;
+  GaeulMjpegBranchStats stats = { 0, };
 
-    if (pipeline != NULL) {
-      gst_element_set_state (pipeline, GST_STATE_NULL);
+  if ((mosaic = g_hash_table_lookup (self->mosaics, request_id)) != NULL) {
+    _lease_expire (self, request_id,
+        gaeul_mjpeg_mosaic_get_n_clients (mosaic) > 0);
+    return;
+  }
+
+  /* The clients are counted by the worker of the request. */
+  if (self->workers != NULL) {
+    g_autoptr (GaeulMjpegWorker) worker = NULL;
+    GaeulMjpegLeaseCheck *check = NULL;
+
+    g_mutex_lock (&self->http_lock);
+    worker = g_hash_table_lookup (self->worker_requests, request_id);
+    if (worker != NULL) {
+      g_object_ref (worker);
     }
-    g_debug ("stopping pipeline %p", pipeline);
-    g_hash_table_remove (self->pipelines, r);
+    g_mutex_unlock (&self->http_lock);
+
+    if (worker == NULL) {
+      _lease_expire (self, request_id, FALSE);
+      return;
+    }
+
+    check = g_new0 (GaeulMjpegLeaseCheck, 1);
+    check->app = g_object_ref (self);
+    check->request_id = g_strdup (request_id);
+
+    gaeul2_dbus_mjpegservice_call_get_request_stats
+        (gaeul_mjpeg_worker_get_service (worker), request_id, NULL,
+        _lease_check_cb, check);
+    return;
   }
 
-  g_hash_table_remove (self->request_ids, request_id);
+  if ((r = g_hash_table_lookup (self->request_ids, request_id)) != NULL &&
+      (pipeline = g_hash_table_lookup (self->pipelines, r)) != NULL) {
+    gaeul_mjpeg_transcoder_get_branch_stats (pipeline->transcoder, r, &stats);
+  }
 
-  gaeul2_dbus_mjpegservice_complete_stop (object, invocation);
+  _lease_expire (self, request_id, stats.n_clients > 0);
+}
+
+static gboolean
+_lease_wheel_timeout (gpointer user_data)
+{
+  GaeulMjpegApplication *self = user_data;
+  g_autoptr (GPtrArray) expired = NULL;
+  guint i;
+
+  g_mutex_lock (&self->http_lock);
+  expired = gaeul_mjpeg_lease_wheel_turn (&self->lease_wheel,
+      g_get_monotonic_time ());
+  g_mutex_unlock (&self->http_lock);
+
+  for (i = 0; i < expired->len; i++) {
+    _lease_check (self, g_ptr_array_index (expired, i));
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+gaeul_mjpeg_application_handle_keep_alive (Gaeul2DBusMJPEGService * object,
+    GDBusMethodInvocation * invocation, const gchar * request_id,
+    gpointer user_data)
+{
+  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (user_data);
+  GaeulMjpegLease *lease = NULL;
+
+  g_mutex_lock (&self->http_lock);
+  if ((lease = g_hash_table_lookup (self->http_request_ids,
+              request_id)) != NULL) {
+    _lease_renew (self, lease);
+  }
+  g_mutex_unlock (&self->http_lock);
+
+  if (lease == NULL) {
+    g_dbus_method_invocation_return_error (invocation, G_IO_ERROR,
+        G_IO_ERROR_NOT_FOUND, "No such request (id: %s)", request_id);
+    return TRUE;
+  }
+
+  gaeul2_dbus_mjpegservice_complete_keep_alive (object, invocation);
+
+  return TRUE;
+}
+
+static gboolean
+gaeul_mjpeg_application_handle_get_request_stats (Gaeul2DBusMJPEGService *
+    object, GDBusMethodInvocation * invocation, const gchar * request_id,
+    gpointer user_data)
+{
+  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (user_data);
+  GaeulMjpegRequest *r = NULL;
+  GaeulMjpegPipeline *pipeline = NULL;
+  GaeulMjpegBranchStats stats = { 0, };
+  GaeulMjpegDecoderStats decoder_stats = { 0, };
+  GVariantBuilder builder;
+
+  if (self->workers != NULL) {
+    _forward_request_call (self, invocation, request_id);
+    return TRUE;
+  }
+
+  if ((r = g_hash_table_lookup (self->request_ids, request_id)) == NULL ||
+      (pipeline = g_hash_table_lookup (self->pipelines, r)) == NULL ||
+      !gaeul_mjpeg_transcoder_get_branch_stats (pipeline->transcoder, r,
+          &stats)) {
+    g_dbus_method_invocation_return_error (invocation, G_IO_ERROR,
+        G_IO_ERROR_NOT_FOUND, "No such request (id: %s)", request_id);
+    return TRUE;
+  }
+
+  gaeul_mjpeg_transcoder_get_decoder_stats (pipeline->transcoder,
+      &decoder_stats);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", "http-connections",
+      g_variant_new_uint32 (stats.n_clients));
+  g_variant_builder_add (&builder, "{sv}", "bytes-received",
+      g_variant_new_uint64 (gaeul_mjpeg_transcoder_get_bytes_received
+          (pipeline->transcoder)));
+  g_variant_builder_add (&builder, "{sv}", "bytes-sent",
+      g_variant_new_uint64 (stats.bytes_sent));
+  g_variant_builder_add (&builder, "{sv}", "frames-encoded",
+      g_variant_new_uint64 (stats.frames_encoded));
+  g_variant_builder_add (&builder, "{sv}", "frames-dropped",
+      g_variant_new_uint64 (stats.frames_dropped));
+  g_variant_builder_add (&builder, "{sv}", "frames-skipped",
+      g_variant_new_uint64 (gaeul_mjpeg_transcoder_get_frames_skipped
+          (pipeline->transcoder)));
+  g_variant_builder_add (&builder, "{sv}", "demux-latency",
+      g_variant_new_uint32 (gaeul_mjpeg_transcoder_get_demux_latency
+          (pipeline->transcoder)));
+  g_variant_builder_add (&builder, "{sv}", "ingest-buffers-dropped",
+      g_variant_new_uint64 (gaeul_mjpeg_transcoder_get_ingest_buffers_dropped
+          (pipeline->transcoder)));
+  g_variant_builder_add (&builder, "{sv}", "encode-time",
+      g_variant_new_uint64 (stats.encode_time));
+  g_variant_builder_add (&builder, "{sv}", "frames-repeated",
+      g_variant_new_uint64 (stats.frames_repeated));
+  g_variant_builder_add (&builder, "{sv}", "pipeline-errors",
+      g_variant_new_uint64 (gaeul_mjpeg_transcoder_get_errors
+          (pipeline->transcoder)));
+  g_variant_builder_add (&builder, "{sv}", "source-reconnects",
+      g_variant_new_uint64 (gaeul_mjpeg_transcoder_get_source_reconnects
+          (pipeline->transcoder)));
+  g_variant_builder_add (&builder, "{sv}", "priority",
+      g_variant_new_uint32 (pipeline->priority));
+  g_variant_builder_add (&builder, "{sv}", "degradation",
+      g_variant_new_uint32 (stats.degradation));
+  g_variant_builder_add (&builder, "{sv}", "codec",
+      g_variant_new_string (decoder_stats.codec != NULL ?
+          decoder_stats.codec : ""));
+  g_variant_builder_add (&builder, "{sv}", "decoder-build-time",
+      g_variant_new_uint64 (decoder_stats.build_time));
+  g_variant_builder_add (&builder, "{sv}", "frames-decoded",
+      g_variant_new_uint64 (decoder_stats.frames_decoded));
+  g_variant_builder_add (&builder, "{sv}", "decode-time",
+      g_variant_new_uint64 (decoder_stats.decode_time));
+
+  gaeul2_dbus_mjpegservice_complete_get_request_stats (object, invocation,
+      g_variant_builder_end (&builder));
+
+  return TRUE;
+}
+
+static gboolean
+gaeul_mjpeg_application_handle_get_client_stats (Gaeul2DBusMJPEGService *
+    object, GDBusMethodInvocation * invocation, const gchar * request_id,
+    gpointer user_data)
+{
+  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (user_data);
+  GaeulMjpegRequest *r = NULL;
+  GaeulMjpegPipeline *pipeline = NULL;
+  g_autoptr (GArray) clients = NULL;
+  GVariantBuilder builder;
+  guint i;
+
+  if (self->workers != NULL) {
+    _forward_request_call (self, invocation, request_id);
+    return TRUE;
+  }
+
+  if ((r = g_hash_table_lookup (self->request_ids, request_id)) == NULL ||
+      (pipeline = g_hash_table_lookup (self->pipelines, r)) == NULL ||
+      (clients = gaeul_mjpeg_transcoder_get_client_stats (pipeline->transcoder,
+              r)) == NULL) {
+    g_dbus_method_invocation_return_error (invocation, G_IO_ERROR,
+        G_IO_ERROR_NOT_FOUND, "No such request (id: %s)", request_id);
+    return TRUE;
+  }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(stt)"));
+  for (i = 0; i < clients->len; i++) {
+    GaeulMjpegClientStats *stats =
+        &g_array_index (clients, GaeulMjpegClientStats, i);
+
+    g_variant_builder_add (&builder, "(stt)",
+        stats->address != NULL ? stats->address : "", stats->bytes_sent,
+        stats->buffers_dropped);
+  }
+
+  gaeul2_dbus_mjpegservice_complete_get_client_stats (object, invocation,
+      g_variant_builder_end (&builder));
+
+  return TRUE;
+}
+
+static gboolean
+gaeul_mjpeg_application_handle_add_client (Gaeul2DBusMJPEGWorker * object,
+    GDBusMethodInvocation * invocation, GUnixFDList * fd_list,
+    const gchar * request_id, GVariant * socket_handle, gpointer user_data)
+{
+  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (user_data);
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GSocket) socket = NULL;
+  gint fd = -1;
+
+  fd = g_unix_fd_list_get (fd_list, g_variant_get_handle (socket_handle),
+      &error);
+
+  if (fd >= 0 && (socket = g_socket_new_from_fd (fd, &error)) == NULL) {
+    close (fd);
+  }
+
+  if (socket == NULL) {
+    g_dbus_method_invocation_return_gerror (invocation, error);
+    return TRUE;
+  }
+
+  if (!_attach_client (self, request_id, socket)) {
+    g_dbus_method_invocation_return_error (invocation, G_IO_ERROR,
+        G_IO_ERROR_NOT_FOUND, "No such request (id: %s)", request_id);
+    return TRUE;
+  }
+
+  gaeul2_dbus_mjpegworker_complete_add_client (object, invocation, NULL);
+
+  return TRUE;
+}
+
+static gboolean
+gaeul_mjpeg_application_handle_get_stats (Gaeul2DBusMJPEGWorker * object,
+    GDBusMethodInvocation * invocation, gpointer user_data)
+{
+  GaeulMjpegApplication *self = GAEUL_MJPEG_APPLICATION (user_data);
+
+  gaeul2_dbus_mjpegworker_complete_get_stats (object, invocation,
+      self->n_srtconnections, self->n_httpconnections,
+      self->srt_bytes_received, self->http_bytes_sent,
+      self->n_lazy_first_frames, self->lazy_first_frame_time,
+      self->n_eager_first_frames, self->eager_first_frame_time);
 
   return TRUE;
 }
@@ -646,19 +3149,77 @@ gaeul_mjpeg_application_init (GaeulMjpegApplication * self)
 
   self->soup_server = soup_server_new (NULL, NULL);
 
+  self->http_context = g_main_context_new ();
+  self->http_loop = g_main_loop_new (self->http_context, FALSE);
+  g_mutex_init (&self->http_lock);
+  gaeul_mjpeg_lease_wheel_init (&self->lease_wheel, g_get_monotonic_time ());
+  self->http_request_ids =
+      g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) gaeul_mjpeg_lease_free);
+  self->pending_clients = g_async_queue_new ();
+
+  self->transcoder_builds =
+      g_hash_table_new_full (g_variant_hash, g_variant_equal,
+      (GDestroyNotify) g_variant_unref, NULL);
+
+  self->teardown_pool =
+      g_thread_pool_new (_teardown_transcoder, NULL, 1, FALSE, NULL);
+
+  self->worker_fd = -1;
+  self->worker_requests =
+      g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+  self->worker_placements = gaeul_tuple_new ();
+
   self->request_ids =
-      g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) gaeul_mjpeg_request_unref);
 
   self->pipelines =
       g_hash_table_new_full ((GHashFunc) gaeul_mjpeg_request_hash,
       (GEqualFunc) gaeul_mjpeg_request_equal,
       (GDestroyNotify) gaeul_mjpeg_request_unref,
-      (GDestroyNotify) gst_object_unref);
+      (GDestroyNotify) _pipeline_free);
+
+  self->transcoders = gaeul_tuple_new ();
+
+  self->uid_request_ids =
+      g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+      (GDestroyNotify) g_hash_table_unref);
+
+  self->mosaics =
+      g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+
+  g_queue_init (&self->lingering);
+
+#if GLIB_CHECK_VERSION(2,64,0)
+  self->memory_monitor = g_memory_monitor_dup_default ();
+  g_signal_connect (self->memory_monitor, "low-memory-warning",
+      G_CALLBACK (_low_memory_warning_cb), self);
+#endif
 
   self->service = gaeul2_dbus_mjpegservice_skeleton_new ();
 
   g_signal_connect (self->service, "handle-start",
       G_CALLBACK (gaeul_mjpeg_application_handle_start), self);
+  g_signal_connect (self->service, "handle-start-with-options",
+      G_CALLBACK (gaeul_mjpeg_application_handle_start_with_options), self);
+  g_signal_connect (self->service, "handle-start-mosaic",
+      G_CALLBACK (gaeul_mjpeg_application_handle_start_mosaic), self);
   g_signal_connect (self->service, "handle-stop",
       G_CALLBACK (gaeul_mjpeg_application_handle_stop), self);
+  g_signal_connect (self->service, "handle-get-request-stats",
+      G_CALLBACK (gaeul_mjpeg_application_handle_get_request_stats), self);
+  g_signal_connect (self->service, "handle-get-client-stats",
+      G_CALLBACK (gaeul_mjpeg_application_handle_get_client_stats), self);
+  g_signal_connect (self->service, "handle-update",
+      G_CALLBACK (gaeul_mjpeg_application_handle_update), self);
+  g_signal_connect (self->service, "handle-keep-alive",
+      G_CALLBACK (gaeul_mjpeg_application_handle_keep_alive), self);
+
+  self->worker_service = gaeul2_dbus_mjpegworker_skeleton_new ();
+
+  g_signal_connect (self->worker_service, "handle-add-client",
+      G_CALLBACK (gaeul_mjpeg_application_handle_add_client), self);
+  g_signal_connect (self->worker_service, "handle-get-stats",
+      G_CALLBACK (gaeul_mjpeg_application_handle_get_stats), self);
 }
@@ -0,0 +1,170 @@
+/**
+ *  Copyright 2020 SK Telecom Co., Ltd.
+ *    Author: Jeongseok Kim <jeongseok.kim@sk.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "config.h"
+
+#include "mjpeg/mjpeg-lease.h"
+
+GaeulMjpegLease *
+gaeul_mjpeg_lease_new (const gchar * request_id)
+{
+  GaeulMjpegLease *lease = NULL;
+
+  g_return_val_if_fail (request_id != NULL, NULL);
+
+  lease = g_new0 (GaeulMjpegLease, 1);
+  lease->request_id = g_strdup (request_id);
+
+  return lease;
+}
+
+/* Also takes @lease off the wheel. */
+void
+gaeul_mjpeg_lease_free (GaeulMjpegLease * lease)
+{
+  g_return_if_fail (lease != NULL);
+
+  if (lease->link != NULL) {
+    g_queue_delete_link (lease->slot, lease->link);
+  }
+
+  g_free (lease->request_id);
+  g_free (lease);
+}
+
+gboolean
+gaeul_mjpeg_lease_is_scheduled (GaeulMjpegLease * lease)
+{
+  g_return_val_if_fail (lease != NULL, FALSE);
+
+  return lease->link != NULL;
+}
+
+/* Returns the earlier of the deadlines of @lease, 0 if it has none. */
+static gint64
+_lease_get_due_time (GaeulMjpegLease * lease)
+{
+  if (lease->deadline == 0 || (lease->arrival_deadline != 0 &&
+          lease->arrival_deadline < lease->deadline)) {
+    return lease->arrival_deadline;
+  }
+
+  return lease->deadline;
+}
+
+void
+gaeul_mjpeg_lease_wheel_init (GaeulMjpegLeaseWheel * wheel, gint64 now)
+{
+  guint i;
+
+  g_return_if_fail (wheel != NULL);
+
+  for (i = 0; i < GAEUL_MJPEG_LEASE_WHEEL_SLOTS; i++) {
+    g_queue_init (&wheel->slots[i]);
+  }
+
+  wheel->tick = now / GAEUL_MJPEG_LEASE_TICK;
+}
+
+/* Puts @lease on the wheel, unless it is already there in the slot of its
+ * due time or of an earlier tick. A lease is never in two slots, however
+ * often it is scheduled. */
+void
+gaeul_mjpeg_lease_wheel_schedule (GaeulMjpegLeaseWheel * wheel,
+    GaeulMjpegLease * lease)
+{
+  gint64 due_time = 0;
+  gint64 tick = 0;
+
+  g_return_if_fail (wheel != NULL);
+  g_return_if_fail (lease != NULL);
+
+  if ((due_time = _lease_get_due_time (lease)) == 0) {
+    return;
+  }
+
+  tick = MAX (due_time / GAEUL_MJPEG_LEASE_TICK, wheel->tick + 1);
+
+  if (lease->link != NULL) {
+    if (lease->tick <= tick) {
+      return;
+    }
+    g_queue_delete_link (lease->slot, lease->link);
+  }
+
+  lease->tick = tick;
+  lease->slot = &wheel->slots[tick % GAEUL_MJPEG_LEASE_WHEEL_SLOTS];
+  g_queue_push_tail (lease->slot, lease);
+  lease->link = g_queue_peek_tail_link (lease->slot);
+}
+
+void
+gaeul_mjpeg_lease_wheel_renew (GaeulMjpegLeaseWheel * wheel,
+    GaeulMjpegLease * lease, gint64 deadline)
+{
+  g_return_if_fail (wheel != NULL);
+  g_return_if_fail (lease != NULL);
+
+  lease->deadline = deadline;
+  gaeul_mjpeg_lease_wheel_schedule (wheel, lease);
+}
+
+/* Turns the wheel up to @now. The leases past either of their deadlines
+ * are taken off the wheel, and their request ids returned for them to be
+ * checked.
+ *
+ * Returns: (transfer full) (element-type utf8): the request ids of the
+ *   expired leases */
+GPtrArray *
+gaeul_mjpeg_lease_wheel_turn (GaeulMjpegLeaseWheel * wheel, gint64 now)
+{
+  GPtrArray *expired = g_ptr_array_new_with_free_func (g_free);
+  gint64 tick = now / GAEUL_MJPEG_LEASE_TICK;
+
+  g_return_val_if_fail (wheel != NULL, expired);
+
+  /* Ticks that were missed are caught up with, but one turn of the wheel
+   * already visits every slot. */
+  wheel->tick = MAX (wheel->tick, tick - GAEUL_MJPEG_LEASE_WHEEL_SLOTS);
+
+  while (wheel->tick < tick) {
+    GQueue *slot = NULL;
+    GQueue due;
+    GaeulMjpegLease *lease = NULL;
+
+    wheel->tick++;
+    slot = &wheel->slots[wheel->tick % GAEUL_MJPEG_LEASE_WHEEL_SLOTS];
+    due = *slot;
+    g_queue_init (slot);
+
+    while ((lease = g_queue_pop_head (&due)) != NULL) {
+      gint64 due_time = _lease_get_due_time (lease);
+
+      lease->link = NULL;
+
+      /* A lease left without deadlines simply drops off the wheel. */
+      if (due_time != 0 && due_time <= now) {
+        g_ptr_array_add (expired, g_strdup (lease->request_id));
+      } else {
+        gaeul_mjpeg_lease_wheel_schedule (wheel, lease);
+      }
+    }
+  }
+
+  return expired;
+}
@@ -0,0 +1,83 @@
+/**
+ *  Copyright 2020 SK Telecom Co., Ltd.
+ *    Author: Jeongseok Kim <jeongseok.kim@sk.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef __GAEUL_MJPEG_LEASE_H__
+#define __GAEUL_MJPEG_LEASE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Leases are checked once per tick, by a wheel of this many slots. */
+#define GAEUL_MJPEG_LEASE_TICK          G_TIME_SPAN_SECOND
+#define GAEUL_MJPEG_LEASE_WHEEL_SLOTS   64
+
+/* A lease sits in the slot of the wheel for the tick it was due at when
+ * it was last scheduled, the earlier of its deadlines. Renewing only pushes the deadline back, and the
+ * lease moves on when its slot comes up. */
+typedef struct _GaeulMjpegLease
+{
+  gchar *request_id;
+
+  /* in monotonic time, 0 for none */
+  gint64 deadline;
+
+  /* when the first HTTP client of an eager start is due by, 0 once it
+   * arrived or when none is waited for */
+  gint64 arrival_deadline;
+
+  /*< private >*/
+  GQueue *slot;
+  GList *link;
+  gint64 tick;
+} GaeulMjpegLease;
+
+typedef struct _GaeulMjpegLeaseWheel
+{
+  /*< private >*/
+  GQueue slots[GAEUL_MJPEG_LEASE_WHEEL_SLOTS];
+
+  /* the last tick the wheel was turned to */
+  gint64 tick;
+} GaeulMjpegLeaseWheel;
+
+GaeulMjpegLease    *gaeul_mjpeg_lease_new          (const gchar *request_id);
+
+void                gaeul_mjpeg_lease_free         (GaeulMjpegLease *lease);
+
+gboolean            gaeul_mjpeg_lease_is_scheduled (GaeulMjpegLease *lease);
+
+void                gaeul_mjpeg_lease_wheel_init   (GaeulMjpegLeaseWheel *wheel,
+                                                    gint64 now);
+
+void                gaeul_mjpeg_lease_wheel_schedule
+                                                   (GaeulMjpegLeaseWheel *wheel,
+                                                    GaeulMjpegLease *lease);
+
+void                gaeul_mjpeg_lease_wheel_renew  (GaeulMjpegLeaseWheel *wheel,
+                                                    GaeulMjpegLease *lease,
+                                                    gint64 deadline);
+
+GPtrArray          *gaeul_mjpeg_lease_wheel_turn   (GaeulMjpegLeaseWheel *wheel,
+                                                    gint64 now);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC                      (GaeulMjpegLease, gaeul_mjpeg_lease_free)
+
+G_END_DECLS
+
+#endif // __GAEUL_MJPEG_LEASE_H__
@@ -0,0 +1,579 @@
+/**
+ *  Copyright 2020 SK Telecom Co., Ltd.
+ *    Author: Jeongseok Kim <jeongseok.kim@sk.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "config.h"
+
+#include "mjpeg/mjpeg-mosaic.h"
+#include "mjpeg/mjpeg-pipeline.h"
+
+#include <gst/gst.h>
+
+/* *INDENT-OFF* */
+/* Every tile is scaled into its cell, with borders that keep its aspect
+ * ratio, and the cells are composed over a black background. */
+#define GST_MOSAIC_PIPELINE_DESC \
+    "compositor name=mix background=black%s ! " \
+    "video/x-raw, width=%u, height=%u, framerate=%u/1 ! " \
+    "jpegenc ! multipartmux boundary=endofsection ! " \
+    "multisocketsink name=msocksink sync=false sync-method=latest-keyframe buffers-min=%d"
+
+/* The parser and the decoder of a tile are only added once tsdemux finds
+ * the codec of its stream. */
+#define GST_MOSAIC_TILE_DESC \
+    " srtsrc name=src_%u uri=\"%s\" latency=%u ! queue ! " \
+    "tsdemux name=demux_%u latency=%d " \
+    "videoconvert name=convert_%u ! videoscale ! " \
+    "video/x-raw, width=%u, height=%u, pixel-aspect-ratio=1/1 ! mix.sink_%u"
+
+#define GST_MOSAIC_TILE_POSITION_DESC \
+    " sink_%u::xpos=%u sink_%u::ypos=%u"
+/* *INDENT-ON* */
+
+/* The tiles don't measure the PCR interval of their streams, so tsdemux
+ * gets the latency the transcoders start with. */
+#define MOSAIC_DEMUX_LATENCY            65
+
+/* Like the tiers of the transcoders, the sink keeps the last two frames
+ * of the header, data and footer buffers of multipartmux. */
+#define MOSAIC_LAST_FRAME_BUFFERS       6
+
+struct _GaeulMjpegMosaic
+{
+  GObject parent;
+
+  GstElement *pipeline;
+  GstElement *sink;
+  GPtrArray *srcs;
+
+  /* the errors posted by the tiles */
+  gint n_errors;
+
+  /* The pipeline is paused while it has no client. */
+  GaeulMjpegPlayback *playback;
+};
+
+typedef enum
+{
+  SIG_CLIENT_ADDED,
+  SIG_CLIENT_REMOVED,
+  LAST_SIGNAL
+} GaeulMjpegMosaicSignal;
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+/* *INDENT-OFF* */
+G_DEFINE_TYPE (GaeulMjpegMosaic, gaeul_mjpeg_mosaic, G_TYPE_OBJECT)
+/* *INDENT-ON* */
+
+static void
+_sink_client_added_cb (GstElement * sink, GSocket * socket,
+    gpointer user_data)
+{
+  GaeulMjpegMosaic *self = user_data;
+
+  gaeul_mjpeg_playback_client_added (self->playback);
+  g_signal_emit (self, signals[SIG_CLIENT_ADDED], 0, socket);
+}
+
+static void
+_sink_client_removed_cb (GstElement * sink, GSocket * socket, gint status,
+    gpointer user_data)
+{
+  GaeulMjpegMosaic *self = user_data;
+
+  gaeul_mjpeg_playback_client_removed (self->playback);
+  g_signal_emit (self, signals[SIG_CLIENT_REMOVED], 0, socket);
+}
+
+static void
+_mosaic_recalculate_latency_async (GstElement * pipeline, gpointer user_data)
+{
+  gst_bin_recalculate_latency (GST_BIN (pipeline));
+}
+
+static GstBusSyncReply
+_mosaic_bus_sync_handler (GstBus * bus, GstMessage * message,
+    gpointer user_data)
+{
+  GaeulMjpegMosaic *self = user_data;
+
+  switch (GST_MESSAGE_TYPE (message)) {
+    case GST_MESSAGE_ERROR:{
+      g_autoptr (GError) error = NULL;
+      g_autofree gchar *debug = NULL;
+
+      /* An error of a tile leaves its cell black, but the others go on. */
+      gst_message_parse_error (message, &error, &debug);
+      g_warning ("error from %s in mosaic %p: %s (%s)",
+          GST_OBJECT_NAME (GST_MESSAGE_SRC (message)), self, error->message,
+          debug != NULL ? debug : "no details");
+
+      g_atomic_int_inc (&self->n_errors);
+      break;
+    }
+    case GST_MESSAGE_LATENCY:
+      /* recalculated away from the streaming thread that posted it */
+      gst_element_call_async (self->pipeline,
+          _mosaic_recalculate_latency_async, NULL, NULL);
+      break;
+    default:
+      break;
+  }
+
+  /* Nobody pops the bus, so nothing is left on it. */
+  return GST_BUS_DROP;
+}
+
+static void
+_decodebin_pad_added_cb (GstElement * decodebin, GstPad * pad,
+    gpointer user_data)
+{
+  GstElement *convert = user_data;
+  g_autoptr (GstPad) sinkpad = gst_element_get_static_pad (convert, "sink");
+
+  if (!gst_pad_is_linked (sinkpad)) {
+    gst_pad_link (pad, sinkpad);
+  }
+}
+
+/* Decodes the first video stream of a tile with the parser and the
+ * decoder of its codec, like the transcoders do. */
+static void
+_demux_pad_added_cb (GstElement * demux, GstPad * pad, gpointer user_data)
+{
+  GstElement *convert = user_data;
+  g_autoptr (GstObject) bin = gst_element_get_parent (demux);
+  g_autoptr (GstCaps) caps = NULL;
+  g_autoptr (GstCaps) filter_caps = NULL;
+  g_autoptr (GstPad) sinkpad = NULL;
+  const GaeulMjpegCodec *codec = NULL;
+  GstElement *parser = NULL;
+  GstElement *capsfilter = NULL;
+  GstElement *queue = NULL;
+  GstElement *decoder = NULL;
+
+  if ((caps = gst_pad_get_current_caps (pad)) == NULL) {
+    caps = gst_pad_query_caps (pad, NULL);
+  }
+
+  if (gst_caps_is_empty (caps)) {
+    return;
+  }
+
+  if ((codec = gaeul_mjpeg_codec_find (caps)) == NULL) {
+    g_debug ("ignoring %s stream of %s",
+        gst_structure_get_name (gst_caps_get_structure (caps, 0)),
+        GST_OBJECT_NAME (demux));
+    return;
+  }
+
+  if (g_object_get_data (G_OBJECT (demux), "codec") != NULL) {
+    g_debug ("%s already decodes a stream, ignoring %s",
+        GST_OBJECT_NAME (demux), GST_PAD_NAME (pad));
+    return;
+  }
+
+  parser = gst_element_factory_make (codec->parser, NULL);
+  capsfilter = gst_element_factory_make ("capsfilter", NULL);
+  queue = gst_element_factory_make ("queue", NULL);
+  if ((decoder = gst_element_factory_make (codec->decoder, NULL)) == NULL) {
+    g_warning ("%s is not available, autoplugging a decoder for %s",
+        codec->decoder, codec->name);
+    decoder = gst_element_factory_make ("decodebin", NULL);
+  }
+
+  if (parser == NULL || capsfilter == NULL || queue == NULL ||
+      decoder == NULL) {
+    g_warning ("Can't decode %s stream of %s, missing elements",
+        codec->name, GST_OBJECT_NAME (demux));
+    g_clear_object (&parser);
+    g_clear_object (&capsfilter);
+    g_clear_object (&queue);
+    g_clear_object (&decoder);
+    return;
+  }
+
+  g_object_set_data (G_OBJECT (demux), "codec", (gpointer) codec);
+
+  filter_caps = gst_caps_new_simple (codec->caps_name,
+      "stream-format", G_TYPE_STRING, "byte-stream",
+      "alignment", G_TYPE_STRING, "au", NULL);
+  g_object_set (capsfilter, "caps", filter_caps, NULL);
+
+  gst_bin_add_many (GST_BIN (bin), parser, capsfilter, queue, decoder, NULL);
+  gst_element_link_many (parser, capsfilter, queue, decoder, NULL);
+
+  /* decodebin only has a source pad once it found a decoder. */
+  if (!gst_element_link (decoder, convert)) {
+    g_signal_connect (decoder, "pad-added",
+        G_CALLBACK (_decodebin_pad_added_cb), convert);
+  }
+
+  gst_element_sync_state_with_parent (decoder);
+  gst_element_sync_state_with_parent (queue);
+  gst_element_sync_state_with_parent (capsfilter);
+  gst_element_sync_state_with_parent (parser);
+
+  sinkpad = gst_element_get_static_pad (parser, "sink");
+  gst_pad_link (pad, sinkpad);
+
+  g_debug ("Decoding %s stream of %s", codec->name, GST_OBJECT_NAME (demux));
+}
+
+static void
+gaeul_mjpeg_mosaic_dispose (GObject * object)
+{
+  GaeulMjpegMosaic *self = GAEUL_MJPEG_MOSAIC (object);
+
+  if (self->sink != NULL) {
+    g_signal_handlers_disconnect_by_data (self->sink, self);
+  }
+
+  if (self->pipeline != NULL) {
+    g_autoptr (GstBus) bus = gst_element_get_bus (self->pipeline);
+
+    gst_element_set_state (self->pipeline, GST_STATE_NULL);
+    gst_bus_set_sync_handler (bus, NULL, NULL, NULL);
+  }
+
+  g_clear_pointer (&self->srcs, g_ptr_array_unref);
+  g_clear_object (&self->sink);
+  g_clear_object (&self->pipeline);
+
+  G_OBJECT_CLASS (gaeul_mjpeg_mosaic_parent_class)->dispose (object);
+}
+
+static void
+gaeul_mjpeg_mosaic_finalize (GObject * object)
+{
+  GaeulMjpegMosaic *self = GAEUL_MJPEG_MOSAIC (object);
+
+  g_clear_pointer (&self->playback, gaeul_mjpeg_playback_unref);
+
+  G_OBJECT_CLASS (gaeul_mjpeg_mosaic_parent_class)->finalize (object);
+}
+
+static void
+gaeul_mjpeg_mosaic_class_init (GaeulMjpegMosaicClass * klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = gaeul_mjpeg_mosaic_dispose;
+  object_class->finalize = gaeul_mjpeg_mosaic_finalize;
+
+  signals[SIG_CLIENT_ADDED] =
+      g_signal_new ("client-added", G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL, G_TYPE_NONE, 1, G_TYPE_SOCKET);
+
+  signals[SIG_CLIENT_REMOVED] =
+      g_signal_new ("client-removed", G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL, G_TYPE_NONE, 1, G_TYPE_SOCKET);
+}
+
+static void
+gaeul_mjpeg_mosaic_init (GaeulMjpegMosaic * self)
+{
+  self->srcs = g_ptr_array_new_with_free_func (gst_object_unref);
+}
+
+static gboolean
+_parse_dimension (const gchar * str, const gchar ** end, guint * value)
+{
+  gchar *parse_end = NULL;
+  guint64 parsed = 0;
+
+  if (!g_ascii_isdigit (*str)) {
+    return FALSE;
+  }
+
+  parsed = g_ascii_strtoull (str, &parse_end, 10);
+
+  if (parsed == 0 || parsed > GAEUL_MJPEG_MOSAIC_MAX_TILES) {
+    return FALSE;
+  }
+
+  *value = parsed;
+  *end = parse_end;
+
+  return TRUE;
+}
+
+/**
+ * gaeul_mjpeg_mosaic_parse_layout:
+ * @layout: "COLUMNSxROWS", or "" or "auto" for the smallest square grid
+ * @n_tiles: the number of tiles to lay out
+ * @columns: (out): the number of columns of the grid
+ * @rows: (out): the number of rows of the grid
+ * @error: return location for a #GError
+ *
+ * Tiles fill the grid row by row, and the cells left over stay black.
+ *
+ * Returns: whether @layout is a grid with room for @n_tiles
+ */
+gboolean
+gaeul_mjpeg_mosaic_parse_layout (const gchar * layout, guint n_tiles,
+    guint * columns, guint * rows, GError ** error)
+{
+  const gchar *end = NULL;
+  guint c = 0;
+  guint r = 0;
+
+  g_return_val_if_fail (layout != NULL, FALSE);
+  g_return_val_if_fail (columns != NULL, FALSE);
+  g_return_val_if_fail (rows != NULL, FALSE);
+
+  if (n_tiles == 0 || n_tiles > GAEUL_MJPEG_MOSAIC_MAX_TILES) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+        "A mosaic takes 1 to %u tiles, not %u", GAEUL_MJPEG_MOSAIC_MAX_TILES,
+        n_tiles);
+    return FALSE;
+  }
+
+  if (*layout == '\0' || g_strcmp0 (layout, "auto") == 0) {
+    c = 1;
+    while (c * c < n_tiles) {
+      c++;
+    }
+    *columns = c;
+    *rows = (n_tiles + c - 1) / c;
+    return TRUE;
+  }
+
+  if (!_parse_dimension (layout, &end, &c) || *end != 'x' ||
+      !_parse_dimension (end + 1, &end, &r) || *end != '\0') {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+        "Invalid mosaic layout \"%s\"", layout);
+    return FALSE;
+  }
+
+  if (c * r < n_tiles) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+        "Mosaic layout %ux%u has no room for %u tiles", c, r, n_tiles);
+    return FALSE;
+  }
+
+  *columns = c;
+  *rows = r;
+
+  return TRUE;
+}
+
+/**
+ * gaeul_mjpeg_mosaic_new:
+ * @relay_uri: the SRT uri of the relay
+ * @layout: the grid of the tiles, see gaeul_mjpeg_mosaic_parse_layout()
+ * @tiles: the uid and rid of the stream of each tile, as "a(ss)"
+ * @width: the width of the composed stream
+ * @height: the height of the composed stream
+ * @fps: the framerate of the composed stream
+ * @protocol_latency: the latency of the SRT connections in milliseconds
+ * @error: return location for a #GError
+ *
+ * Builds a pipeline that decodes every stream of @tiles, composes them
+ * into one picture and encodes it as a single MJPEG stream. It connects
+ * to the relay when its first client is added.
+ *
+ * Returns: (transfer full): a new #GaeulMjpegMosaic, or %NULL on error
+ */
+GaeulMjpegMosaic *
+gaeul_mjpeg_mosaic_new (const gchar * relay_uri, const gchar * layout,
+    GVariant * tiles, guint width, guint height, guint fps,
+    guint protocol_latency, GError ** error)
+{
+  g_autoptr (GaeulMjpegMosaic) self = NULL;
+  g_autoptr (GError) internal_error = NULL;
+  g_autoptr (GString) positions = NULL;
+  g_autoptr (GString) tile_descs = NULL;
+  g_autofree gchar *pipeline_desc = NULL;
+  g_autofree gchar *playback_name = NULL;
+  g_autoptr (GstBus) bus = NULL;
+  GstElement *pipeline = NULL;
+  GVariantIter iter;
+  const gchar *uid = NULL;
+  const gchar *rid = NULL;
+  guint n_tiles = 0;
+  guint columns = 0;
+  guint rows = 0;
+  guint tile_width = 0;
+  guint tile_height = 0;
+  guint i = 0;
+
+  g_return_val_if_fail (relay_uri != NULL, NULL);
+  g_return_val_if_fail (layout != NULL, NULL);
+  g_return_val_if_fail (g_variant_is_of_type (tiles, G_VARIANT_TYPE
+          ("a(ss)")), NULL);
+
+  n_tiles = g_variant_n_children (tiles);
+
+  if (!gaeul_mjpeg_mosaic_parse_layout (layout, n_tiles, &columns, &rows,
+          error)) {
+    return NULL;
+  }
+
+  if (fps == 0 || width < columns || height < rows) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+        "Invalid mosaic output %ux%u@%u for a %ux%u grid", width, height, fps,
+        columns, rows);
+    return NULL;
+  }
+
+  tile_width = width / columns;
+  tile_height = height / rows;
+
+  positions = g_string_new (NULL);
+  tile_descs = g_string_new (NULL);
+
+  for (i = 0; i < n_tiles; i++) {
+    g_string_append_printf (positions, GST_MOSAIC_TILE_POSITION_DESC, i,
+        (i % columns) * tile_width, i, (i / columns) * tile_height);
+    g_string_append_printf (tile_descs, GST_MOSAIC_TILE_DESC, i, relay_uri,
+        protocol_latency, i, MOSAIC_DEMUX_LATENCY, i, tile_width, tile_height,
+        i);
+  }
+
+  pipeline_desc = g_strdup_printf (GST_MOSAIC_PIPELINE_DESC "%s",
+      positions->str, width, height, fps, MOSAIC_LAST_FRAME_BUFFERS,
+      tile_descs->str);
+
+  pipeline = gst_parse_launch (pipeline_desc, &internal_error);
+
+  if (internal_error != NULL) {
+    g_clear_object (&pipeline);
+    g_propagate_error (error, g_steal_pointer (&internal_error));
+    return NULL;
+  }
+
+  self = g_object_new (GAEUL_TYPE_MJPEG_MOSAIC, NULL);
+  self->pipeline = gst_object_ref_sink (pipeline);
+  self->sink = gst_bin_get_by_name (GST_BIN (self->pipeline), "msocksink");
+
+  playback_name = g_strdup_printf ("mosaic %p", self);
+  self->playback = gaeul_mjpeg_playback_new (self->pipeline, playback_name);
+
+  g_signal_connect (self->sink, "client-added",
+      G_CALLBACK (_sink_client_added_cb), self);
+  g_signal_connect (self->sink, "client-removed",
+      G_CALLBACK (_sink_client_removed_cb), self);
+
+  /* Messages are handled in the threads posting them, and the errors of
+   * the tiles are counted. */
+  bus = gst_element_get_bus (self->pipeline);
+  gst_bus_set_sync_handler (bus, _mosaic_bus_sync_handler, self, NULL);
+
+  i = 0;
+  g_variant_iter_init (&iter, tiles);
+  while (g_variant_iter_next (&iter, "(&s&s)", &uid, &rid)) {
+    g_autofree gchar *name = g_strdup_printf ("src_%u", i);
+    g_autofree gchar *demux_name = g_strdup_printf ("demux_%u", i);
+    g_autofree gchar *convert_name = g_strdup_printf ("convert_%u", i);
+    g_autofree gchar *streamid =
+        g_strdup_printf ("#!::u=%s,r=%s", uid, rid);
+    GstElement *src = gst_bin_get_by_name (GST_BIN (self->pipeline), name);
+    g_autoptr (GstElement) demux =
+        gst_bin_get_by_name (GST_BIN (self->pipeline), demux_name);
+    g_autoptr (GstElement) convert =
+        gst_bin_get_by_name (GST_BIN (self->pipeline), convert_name);
+
+    g_object_set (src, "streamid", streamid, NULL);
+    g_ptr_array_add (self->srcs, src);
+
+    /* The pipeline keeps the converter for as long as the demuxer. */
+    g_signal_connect (demux, "pad-added", G_CALLBACK (_demux_pad_added_cb),
+        convert);
+    i++;
+  }
+
+  g_debug ("Created mosaic pipeline %p of %u tiles in %ux%u, %ux%u@%u",
+      self, n_tiles, columns, rows, width, height, fps);
+
+  gst_element_set_state (self->pipeline, GST_STATE_READY);
+
+  return g_steal_pointer (&self);
+}
+
+guint
+gaeul_mjpeg_mosaic_get_n_tiles (GaeulMjpegMosaic * self)
+{
+  g_return_val_if_fail (GAEUL_IS_MJPEG_MOSAIC (self), 0);
+
+  return self->srcs->len;
+}
+
+/* Streams the mosaic to @socket, starting the pipeline if needed. */
+gboolean
+gaeul_mjpeg_mosaic_add_client (GaeulMjpegMosaic * self, GSocket * socket)
+{
+  g_return_val_if_fail (GAEUL_IS_MJPEG_MOSAIC (self), FALSE);
+  g_return_val_if_fail (G_IS_SOCKET (socket), FALSE);
+
+  g_signal_emit_by_name (self->sink, "add", socket);
+  gaeul_mjpeg_playback_play (self->playback, NULL, NULL);
+
+  return TRUE;
+}
+
+guint
+gaeul_mjpeg_mosaic_get_n_clients (GaeulMjpegMosaic * self)
+{
+  g_return_val_if_fail (GAEUL_IS_MJPEG_MOSAIC (self), 0);
+
+  return gaeul_mjpeg_playback_get_n_clients (self->playback);
+}
+
+guint64
+gaeul_mjpeg_mosaic_get_bytes_received (GaeulMjpegMosaic * self)
+{
+  guint64 received = 0;
+  guint i;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_MOSAIC (self), 0);
+
+  for (i = 0; i < self->srcs->len; i++) {
+    g_autoptr (GstStructure) s = NULL;
+    guint64 src_received = 0;
+
+    g_object_get (g_ptr_array_index (self->srcs, i), "stats", &s, NULL);
+
+    if (s != NULL &&
+        gst_structure_get_uint64 (s, "bytes-received-total", &src_received)) {
+      received += src_received;
+    }
+  }
+
+  return received;
+}
+
+guint64
+gaeul_mjpeg_mosaic_get_bytes_sent (GaeulMjpegMosaic * self)
+{
+  guint64 served = 0;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_MOSAIC (self), 0);
+
+  g_object_get (self->sink, "bytes-served", &served, NULL);
+
+  return served;
+}
+
+guint64
+gaeul_mjpeg_mosaic_get_errors (GaeulMjpegMosaic * self)
+{
+  g_return_val_if_fail (GAEUL_IS_MJPEG_MOSAIC (self), 0);
+
+  return g_atomic_int_get (&self->n_errors);
+}
@@ -0,0 +1,64 @@
+/**
+ *  Copyright 2020 SK Telecom Co., Ltd.
+ *    Author: Jeongseok Kim <jeongseok.kim@sk.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef __GAEUL_MJPEG_MOSAIC_H__
+#define __GAEUL_MJPEG_MOSAIC_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define GAEUL_TYPE_MJPEG_MOSAIC         (gaeul_mjpeg_mosaic_get_type())
+G_DECLARE_FINAL_TYPE                    (GaeulMjpegMosaic, gaeul_mjpeg_mosaic, GAEUL, MJPEG_MOSAIC, GObject)
+
+#define GAEUL_MJPEG_MOSAIC_MAX_TILES    64
+
+gboolean                gaeul_mjpeg_mosaic_parse_layout (const gchar           *layout,
+                                                         guint                  n_tiles,
+                                                         guint                 *columns,
+                                                         guint                 *rows,
+                                                         GError               **error);
+
+GaeulMjpegMosaic       *gaeul_mjpeg_mosaic_new          (const gchar           *relay_uri,
+                                                         const gchar           *layout,
+                                                         GVariant              *tiles,
+                                                         guint                  width,
+                                                         guint                  height,
+                                                         guint                  fps,
+                                                         guint                  protocol_latency,
+                                                         GError               **error);
+
+guint                   gaeul_mjpeg_mosaic_get_n_tiles  (GaeulMjpegMosaic      *self);
+
+gboolean                gaeul_mjpeg_mosaic_add_client   (GaeulMjpegMosaic      *self,
+                                                         GSocket               *socket);
+
+guint                   gaeul_mjpeg_mosaic_get_n_clients
+                                                        (GaeulMjpegMosaic      *self);
+
+guint64                 gaeul_mjpeg_mosaic_get_bytes_received
+                                                        (GaeulMjpegMosaic      *self);
+
+guint64                 gaeul_mjpeg_mosaic_get_bytes_sent
+                                                        (GaeulMjpegMosaic      *self);
+
+guint64                 gaeul_mjpeg_mosaic_get_errors   (GaeulMjpegMosaic      *self);
+
+G_END_DECLS
+
+#endif // __GAEUL_MJPEG_MOSAIC_H__
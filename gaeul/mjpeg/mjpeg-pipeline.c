@@ -0,0 +1,233 @@
+/**
+ *  Copyright 2020 SK Telecom Co., Ltd.
+ *    Author: Jeongseok Kim <jeongseok.kim@sk.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "config.h"
+
+#include "mjpeg/mjpeg-pipeline.h"
+
+struct _GaeulMjpegPlayback
+{
+  gint refcount;
+
+  GstElement *pipeline;
+  gchar *name;
+
+  GMutex lock;
+  gint n_clients;
+
+  /* set while the pipeline streams ahead of its first client */
+  gint prerolling;
+};
+
+static const GaeulMjpegCodec codecs[] = {
+  {"h264", "video/x-h264", "h264parse", "avdec_h264", FALSE},
+  {"h265", "video/x-h265", "h265parse", "avdec_h265", TRUE},
+};
+
+/* Returns the codec of the stream of @caps, or %NULL when it isn't one
+ * the pipelines can decode. */
+const GaeulMjpegCodec *
+gaeul_mjpeg_codec_find (GstCaps * caps)
+{
+  GstStructure *s = NULL;
+  guint i;
+
+  g_return_val_if_fail (GST_IS_CAPS (caps), NULL);
+
+  if (gst_caps_is_empty (caps)) {
+    return NULL;
+  }
+
+  s = gst_caps_get_structure (caps, 0);
+  for (i = 0; i < G_N_ELEMENTS (codecs); i++) {
+    if (gst_structure_has_name (s, codecs[i].caps_name)) {
+      return &codecs[i];
+    }
+  }
+
+  return NULL;
+}
+
+GaeulMjpegPlayback *
+gaeul_mjpeg_playback_new (GstElement * pipeline, const gchar * name)
+{
+  GaeulMjpegPlayback *self = NULL;
+
+  g_return_val_if_fail (GST_IS_PIPELINE (pipeline), NULL);
+  g_return_val_if_fail (name != NULL, NULL);
+
+  self = g_new0 (GaeulMjpegPlayback, 1);
+  self->refcount = 1;
+  self->pipeline = gst_object_ref (pipeline);
+  self->name = g_strdup (name);
+  g_mutex_init (&self->lock);
+
+  return self;
+}
+
+GaeulMjpegPlayback *
+gaeul_mjpeg_playback_ref (GaeulMjpegPlayback * self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+
+  g_atomic_int_inc (&self->refcount);
+
+  return self;
+}
+
+void
+gaeul_mjpeg_playback_unref (GaeulMjpegPlayback * self)
+{
+  g_return_if_fail (self != NULL);
+
+  if (g_atomic_int_dec_and_test (&self->refcount)) {
+    g_mutex_clear (&self->lock);
+    g_free (self->name);
+    gst_object_unref (self->pipeline);
+    g_free (self);
+  }
+}
+
+/* Keeps the pipeline from being paused or played, for changing the state
+ * of its elements. */
+void
+gaeul_mjpeg_playback_lock (GaeulMjpegPlayback * self)
+{
+  g_mutex_lock (&self->lock);
+}
+
+void
+gaeul_mjpeg_playback_unlock (GaeulMjpegPlayback * self)
+{
+  g_mutex_unlock (&self->lock);
+}
+
+void
+gaeul_mjpeg_playback_play (GaeulMjpegPlayback * self,
+    GaeulMjpegPlaybackFunc resume_func, gpointer user_data)
+{
+  g_return_if_fail (self != NULL);
+
+  g_mutex_lock (&self->lock);
+  if (GST_STATE_TARGET (self->pipeline) != GST_STATE_PLAYING) {
+    g_debug ("resuming %s", self->name);
+
+    if (resume_func != NULL) {
+      resume_func (user_data);
+    }
+
+    gst_element_set_state (self->pipeline, GST_STATE_PLAYING);
+  }
+  g_mutex_unlock (&self->lock);
+}
+
+/* Plays the pipeline ahead of its first client. It keeps playing without
+ * clients until one is added or the preroll is stopped. */
+void
+gaeul_mjpeg_playback_preroll (GaeulMjpegPlayback * self,
+    GaeulMjpegPlaybackFunc resume_func, gpointer user_data)
+{
+  g_return_if_fail (self != NULL);
+
+  g_atomic_int_set (&self->prerolling, 1);
+  gaeul_mjpeg_playback_play (self, resume_func, user_data);
+}
+
+/* Returns whether the pipeline was prerolling. It is left playing, for the
+ * caller to pause it if it has no client. */
+gboolean
+gaeul_mjpeg_playback_stop_preroll (GaeulMjpegPlayback * self)
+{
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  return g_atomic_int_compare_and_exchange (&self->prerolling, 1, 0);
+}
+
+gboolean
+gaeul_mjpeg_playback_is_prerolling (GaeulMjpegPlayback * self)
+{
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  return g_atomic_int_get (&self->prerolling);
+}
+
+void
+gaeul_mjpeg_playback_pause_if_unused (GaeulMjpegPlayback * self)
+{
+  g_return_if_fail (self != NULL);
+
+  g_mutex_lock (&self->lock);
+  if (g_atomic_int_get (&self->n_clients) == 0 &&
+      !g_atomic_int_get (&self->prerolling) &&
+      GST_STATE_TARGET (self->pipeline) == GST_STATE_PLAYING) {
+    /* A live pipeline in PAUSED neither reads from SRT nor decodes, but the
+     * SRT connections stay open so that the next client starts quickly. */
+    g_debug ("no more clients for %s, pausing", self->name);
+    gst_element_set_state (self->pipeline, GST_STATE_PAUSED);
+  }
+  g_mutex_unlock (&self->lock);
+}
+
+static void
+_playback_pause_async (GstElement * pipeline, gpointer user_data)
+{
+  gaeul_mjpeg_playback_pause_if_unused (user_data);
+}
+
+void
+gaeul_mjpeg_playback_client_added (GaeulMjpegPlayback * self)
+{
+  g_return_if_fail (self != NULL);
+
+  g_atomic_int_set (&self->prerolling, 0);
+  g_atomic_int_inc (&self->n_clients);
+}
+
+/* Pauses the pipeline once its last client is gone. This may be called
+ * from a streaming thread, which is not allowed to change the state of its
+ * own pipeline, so the pause is done from another thread. */
+void
+gaeul_mjpeg_playback_client_removed (GaeulMjpegPlayback * self)
+{
+  g_return_if_fail (self != NULL);
+
+  if (g_atomic_int_dec_and_test (&self->n_clients)) {
+    gst_element_call_async (self->pipeline, _playback_pause_async,
+        gaeul_mjpeg_playback_ref (self),
+        (GDestroyNotify) gaeul_mjpeg_playback_unref);
+  }
+}
+
+/* Drops @n_clients clients that are gone along with the elements that
+ * served them, leaving the pipeline to the caller. */
+void
+gaeul_mjpeg_playback_forget_clients (GaeulMjpegPlayback * self,
+    guint n_clients)
+{
+  g_return_if_fail (self != NULL);
+
+  g_atomic_int_add (&self->n_clients, -(gint) n_clients);
+}
+
+guint
+gaeul_mjpeg_playback_get_n_clients (GaeulMjpegPlayback * self)
+{
+  g_return_val_if_fail (self != NULL, 0);
+
+  return g_atomic_int_get (&self->n_clients);
+}
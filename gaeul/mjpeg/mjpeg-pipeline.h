@@ -0,0 +1,92 @@
+/**
+ *  Copyright 2020 SK Telecom Co., Ltd.
+ *    Author: Jeongseok Kim <jeongseok.kim@sk.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef __GAEUL_MJPEG_PIPELINE_H__
+#define __GAEUL_MJPEG_PIPELINE_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/* The codecs of the video streams tsdemux may find, with the parser and
+ * the decoder their decode stage is built from. */
+typedef struct _GaeulMjpegCodec
+{
+  const gchar *name;
+  const gchar *caps_name;
+  const gchar *parser;
+  const gchar *decoder;
+  gboolean hevc;
+} GaeulMjpegCodec;
+
+const GaeulMjpegCodec  *gaeul_mjpeg_codec_find         (GstCaps               *caps);
+
+/* Plays a pipeline while it has clients, and pauses it once the last one
+ * is gone, unless it streams ahead of its first client. The lock keeps a
+ * pause from racing with a client that is just being added. */
+typedef struct _GaeulMjpegPlayback GaeulMjpegPlayback;
+
+/* Called with the lock held, right before a paused pipeline is played. */
+typedef void (*GaeulMjpegPlaybackFunc) (gpointer user_data);
+
+GaeulMjpegPlayback     *gaeul_mjpeg_playback_new       (GstElement            *pipeline,
+                                                        const gchar           *name);
+
+GaeulMjpegPlayback     *gaeul_mjpeg_playback_ref       (GaeulMjpegPlayback    *self);
+
+void                    gaeul_mjpeg_playback_unref     (GaeulMjpegPlayback    *self);
+
+void                    gaeul_mjpeg_playback_lock      (GaeulMjpegPlayback    *self);
+
+void                    gaeul_mjpeg_playback_unlock    (GaeulMjpegPlayback    *self);
+
+void                    gaeul_mjpeg_playback_play      (GaeulMjpegPlayback    *self,
+                                                        GaeulMjpegPlaybackFunc resume_func,
+                                                        gpointer               user_data);
+
+void                    gaeul_mjpeg_playback_preroll   (GaeulMjpegPlayback    *self,
+                                                        GaeulMjpegPlaybackFunc resume_func,
+                                                        gpointer               user_data);
+
+gboolean                gaeul_mjpeg_playback_stop_preroll
+                                                       (GaeulMjpegPlayback    *self);
+
+gboolean                gaeul_mjpeg_playback_is_prerolling
+                                                       (GaeulMjpegPlayback    *self);
+
+void                    gaeul_mjpeg_playback_pause_if_unused
+                                                       (GaeulMjpegPlayback    *self);
+
+void                    gaeul_mjpeg_playback_client_added
+                                                       (GaeulMjpegPlayback    *self);
+
+void                    gaeul_mjpeg_playback_client_removed
+                                                       (GaeulMjpegPlayback    *self);
+
+void                    gaeul_mjpeg_playback_forget_clients
+                                                       (GaeulMjpegPlayback    *self,
+                                                        guint                  n_clients);
+
+guint                   gaeul_mjpeg_playback_get_n_clients
+                                                       (GaeulMjpegPlayback    *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC                          (GaeulMjpegPlayback, gaeul_mjpeg_playback_unref)
+
+G_END_DECLS
+
+#endif // __GAEUL_MJPEG_PIPELINE_H__
@@ -1,20 +1,109 @@
+#include "config.h"
+
 #include "mjpeg/mjpeg-request.h"
 
 /* *INDENT-OFF* */
 G_DEFINE_BOXED_TYPE(GaeulMjpegRequest, gaeul_mjpeg_request, gaeul_mjpeg_request_ref, gaeul_mjpeg_request_unref)
 /* *INDENT-ON* */
 
+/* Folds a value into a hash the way g_str_hash() folds characters. */
+#define HASH_FOLD(h, v)  ((h) = ((h) << 5) + (h) + (guint) (v))
+
+/* The video directions of videoflip up to ur-ll are the eight symmetries
+ * of a rectangle. Each is kept as a clockwise rotation by quarter turns,
+ * done after an optional horizontal flip. */
+static const struct
+{
+  guint rotation;
+  gboolean mirror;
+} video_directions[] = {
+  {0, FALSE},                   /* identity */
+  {1, FALSE},                   /* 90r */
+  {2, FALSE},                   /* 180 */
+  {3, FALSE},                   /* 90l */
+  {0, TRUE},                    /* horiz */
+  {2, TRUE},                    /* vert */
+  {3, TRUE},                    /* ul-lr */
+  {1, TRUE},                    /* ur-ll */
+};
+
+static gint
+_video_direction_compose (guint first, guint then)
+{
+  guint rotation = 0;
+  gboolean mirror = FALSE;
+  guint i;
+
+  if (first >= G_N_ELEMENTS (video_directions) ||
+      then >= G_N_ELEMENTS (video_directions)) {
+    return -1;
+  }
+
+  /* A flip done after a rotation reverses it. */
+  if (video_directions[then].mirror) {
+    rotation = video_directions[then].rotation + 4 -
+        video_directions[first].rotation;
+    mirror = !video_directions[first].mirror;
+  } else {
+    rotation = video_directions[then].rotation +
+        video_directions[first].rotation;
+    mirror = video_directions[first].mirror;
+  }
+
+  for (i = 0; i < G_N_ELEMENTS (video_directions); i++) {
+    if (video_directions[i].rotation == rotation % 4 &&
+        video_directions[i].mirror == mirror) {
+      return i;
+    }
+  }
+
+  g_assert_not_reached ();
+}
+
+static guint
+_request_parameter_hash (GaeulMjpegRequest * r)
+{
+  guint h = 5381;
+
+  HASH_FOLD (h, r->protocol_latency);
+  HASH_FOLD (h, r->demux_latency);
+  HASH_FOLD (h, r->width);
+  HASH_FOLD (h, r->height);
+  if (!gaeul_mjpeg_request_has_lossless_direction (r)) {
+    HASH_FOLD (h, r->flip);
+    HASH_FOLD (h, r->orientation);
+  }
+  HASH_FOLD (h, r->flags);
+
+  return h;
+}
+
+static guint
+_request_hash (GaeulMjpegRequest * r)
+{
+  guint h = g_str_hash (r->uid);
+
+  HASH_FOLD (h, g_str_hash (r->rid));
+  HASH_FOLD (h, r->parameter_hash);
+
+  return h;
+}
+
 GaeulMjpegRequest *
 gaeul_mjpeg_request_new (const gchar * uid, const gchar * rid,
     guint protocol_latency, guint demux_latency, gint width, gint height,
-    gint fps, guint flip, guint orientation)
+    gint fps, guint flip, guint orientation, GaeulMjpegRequestFlags flags)
 {
-  GaeulMjpegRequest *r = g_new0 (GaeulMjpegRequest, 1);
+  GaeulMjpegRequest *r = NULL;
 
+  g_return_val_if_fail (uid != NULL, NULL);
+  g_return_val_if_fail (rid != NULL, NULL);
+
+  r = g_new0 (GaeulMjpegRequest, 1);
   r->refcount = 1;
 
-  r->uid = g_strdup (uid);
-  r->rid = g_strdup (rid);
+  r->uid = g_intern_string (uid);
+  r->rid = g_intern_string (rid);
 
   r->protocol_latency = protocol_latency;
   r->demux_latency = demux_latency;
@@ -25,6 +114,13 @@ gaeul_mjpeg_request_new (const gchar * uid, const gchar * rid,
 
   r->flip = flip;
   r->orientation = orientation;
+  r->flags = flags;
+  r->direction = _video_direction_compose (flip, orientation);
+
+  /* Requests are immutable, and hashed on every lookup of the pipelines
+   * and branches they are keyed with. */
+  r->parameter_hash = _request_parameter_hash (r);
+  r->hash = _request_hash (r);
 
   return r;
 }
@@ -45,8 +141,6 @@ gaeul_mjpeg_request_unref (GaeulMjpegRequest * self)
   g_return_if_fail (self != NULL);
 
   if (g_atomic_int_dec_and_test (&self->refcount)) {
-    g_free (self->uid);
-    g_free (self->rid);
     g_free (self);
   }
 }
@@ -54,16 +148,7 @@ gaeul_mjpeg_request_unref (GaeulMjpegRequest * self)
 guint
 gaeul_mjpeg_request_hash (GaeulMjpegRequest * self)
 {
-  g_autofree gchar *str = NULL;
-
-  str = g_strdup_printf ("%s%s"
-      "%" G_GUINT32_FORMAT "%" G_GUINT32_FORMAT
-      "%" G_GINT32_FORMAT "%" G_GINT32_FORMAT "%" G_GINT32_FORMAT
-      "%" G_GUINT32_FORMAT "%" G_GUINT32_FORMAT,
-      self->uid, self->rid, self->protocol_latency, self->demux_latency,
-      self->width, self->height, self->fps, self->flip, self->orientation);
-
-  return g_str_hash (str);
+  return self->hash;
 }
 
 gboolean
@@ -72,21 +157,61 @@ gaeul_mjpeg_request_equal (GaeulMjpegRequest * r1, GaeulMjpegRequest * r2)
   g_return_val_if_fail (r1 != NULL, FALSE);
   g_return_val_if_fail (r2 != NULL, FALSE);
 
-  return
-      (g_strcmp0 (r1->uid, r2->uid) == 0) && (g_strcmp0 (r1->rid, r2->rid) == 0)
+  /* The frame rate is left out, as one encoded stream is sent at the rate
+   * of each request. So are the flips and rotations that can be done on
+   * the encoded stream. */
+  return (r1->hash == r2->hash)
+      && (r1->uid == r2->uid) && (r1->rid == r2->rid)
       && (r1->protocol_latency == r2->protocol_latency)
       && (r1->demux_latency == r2->demux_latency) && (r1->height == r2->height)
-      && (r1->width == r2->width) && (r1->fps == r2->fps)
-      && (r1->flip == r2->flip) && (r1->orientation == r2->orientation);
+      && (r1->width == r2->width)
+      && ((gaeul_mjpeg_request_has_lossless_direction (r1) &&
+              gaeul_mjpeg_request_has_lossless_direction (r2)) ||
+          ((r1->flip == r2->flip) && (r1->orientation == r2->orientation)))
+      && (r1->flags == r2->flags);
+}
+
+/**
+ * gaeul_mjpeg_request_get_video_direction:
+ * @self: a #GaeulMjpegRequest
+ *
+ * Returns: the video direction of videoflip that flips the output by
+ * @flip, then rotates it by @orientation, or -1 when there is none, like
+ * for "auto".
+ */
+gint
+gaeul_mjpeg_request_get_video_direction (GaeulMjpegRequest * self)
+{
+  g_return_val_if_fail (self != NULL, -1);
+
+  return self->direction;
+}
+
+/**
+ * gaeul_mjpeg_request_has_lossless_direction:
+ * @self: a #GaeulMjpegRequest
+ *
+ * Returns: whether the flip and rotation of @self are done as lossless
+ * transforms of the encoded JPEGs, rather than before encoding. Lossless
+ * transforms only move whole MCUs, so the output must be made of them for
+ * its edges not to be cut off.
+ */
+gboolean
+gaeul_mjpeg_request_has_lossless_direction (GaeulMjpegRequest * self)
+{
+  g_return_val_if_fail (self != NULL, FALSE);
+
+#ifdef HAVE_TURBOJPEG
+  return self->direction >= 0 &&
+      self->width > 0 && self->width % GAEUL_MJPEG_MCU_SIZE == 0 &&
+      self->height > 0 && self->height % GAEUL_MJPEG_MCU_SIZE == 0;
+#else
+  return FALSE;
+#endif
 }
 
 guint
 gaeul_mjpeg_request_parameter_hash (GaeulMjpegRequest * self)
 {
-  g_autofree gchar *str = NULL;
-  str =
-      g_strdup_printf ("%u/%u/%d/%d/%d/%u/%u", self->protocol_latency,
-      self->demux_latency, self->width, self->height, self->fps,
-      self->flip, self->orientation);
-  return g_str_hash (str);
+  return self->parameter_hash;
 }
@@ -23,14 +23,28 @@
 
 G_BEGIN_DECLS
 
-#define GAEUL_TYPE_MJPEG_REQUEST    (gaeul_mjpeg_requet_get_type())
+#define GAEUL_TYPE_MJPEG_REQUEST    (gaeul_mjpeg_request_get_type())
+
+/**
+ * GaeulMjpegRequestFlags:
+ * @GAEUL_MJPEG_REQUEST_FLAG_NONE: No flags
+ * @GAEUL_MJPEG_REQUEST_FLAG_KEYFRAME_ONLY: Decode and encode only the
+ *   keyframes of the stream, for thumbnails
+ */
+typedef enum
+{
+  GAEUL_MJPEG_REQUEST_FLAG_NONE = 0,
+  GAEUL_MJPEG_REQUEST_FLAG_KEYFRAME_ONLY = (1 << 0),
+} GaeulMjpegRequestFlags;
 
 typedef struct _GaeulMjpegRequest
 {
-  gchar *uid;
-  gchar *rid;
+  /* interned, so that they can be compared by address */
+  const gchar *uid;
+  const gchar *rid;
 
   guint protocol_latency;
+  /* 0 leaves it to the PCR interval of the stream */
   guint demux_latency;
 
   gint width;
@@ -40,17 +54,29 @@ typedef struct _GaeulMjpegRequest
   guint flip;
   guint orientation;
 
+  GaeulMjpegRequestFlags flags;
+
   /*< private >*/
   gint refcount;
+
+  /* the direction of flip then orientation, -1 when it has none */
+  gint direction;
+
+  guint hash;
+  guint parameter_hash;
 } GaeulMjpegRequest;
 
+/* The JPEGs are encoded from 4:2:0 frames, in MCUs of 16x16 pixels. */
+#define GAEUL_MJPEG_MCU_SIZE    16
+
 GType               gaeul_mjpeg_request_get_type (void);
 
 GaeulMjpegRequest  *gaeul_mjpeg_request_new    (const gchar *uid, const gchar *rid,
                                                 guint protocol_latency,
                                                 guint demux_latency,
                                                 gint width, gint height, gint fps,
-                                                guint flip, guint orientation);
+                                                guint flip, guint orientation,
+                                                GaeulMjpegRequestFlags flags);
 
 GaeulMjpegRequest  *gaeul_mjpeg_request_ref    (GaeulMjpegRequest *self);
 
@@ -63,6 +89,12 @@ guint               gaeul_mjpeg_request_parameter_hash
 
 gboolean            gaeul_mjpeg_request_equal  (GaeulMjpegRequest *r1, GaeulMjpegRequest *r2);
 
+gint                gaeul_mjpeg_request_get_video_direction
+                                               (GaeulMjpegRequest *self);
+
+gboolean            gaeul_mjpeg_request_has_lossless_direction
+                                               (GaeulMjpegRequest *self);
+
 
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC                  (GaeulMjpegRequest, gaeul_mjpeg_request_unref)
@@ -0,0 +1,3447 @@
+/**
+ *  Copyright 2020 SK Telecom Co., Ltd.
+ *    Author: Jeongseok Kim <jeongseok.kim@sk.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "config.h"
+
+#include "mjpeg/mjpeg-transcoder.h"
+#include "mjpeg/mjpeg-pipeline.h"
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+/* *INDENT-OFF* */
+#define GST_MJPEG_BRANCH_DESC \
+    "queue name=queue ! videorate name=rate max-duplication-time=%" G_GUINT64_FORMAT " ! videoscale ! " \
+    "capsfilter name=caps caps=\"video/x-raw, framerate=%d/1, width=%d, height=%d\" ! " \
+    "videoflip name=flip video-direction=%u ! " \
+    "videoflip name=orientation video-direction=%u ! " \
+    "%s name=enc ! tee name=enc_tee allow-not-linked=true"
+
+/* Every decoded keyframe becomes a JPEG, so there is no frame rate to keep. */
+#define GST_MJPEG_KEYFRAME_BRANCH_DESC \
+    "queue name=queue ! videoscale ! " \
+    "capsfilter name=caps caps=\"video/x-raw, width=%d, height=%d\" ! " \
+    "videoflip name=flip video-direction=%u ! " \
+    "videoflip name=orientation video-direction=%u ! " \
+    "jpegenc name=enc ! tee name=enc_tee allow-not-linked=true"
+
+/* libav encodes several frames at once with frame threads, and hands them
+ * out in order. Its quantizer of 3 is about the default quality of
+ * jpegenc. */
+#define GST_MJPEG_PARALLEL_ENCODER_DESC \
+    "avenc_mjpeg pass=quant quantizer=3"
+
+#define GST_MJPEG_TIER_DESC \
+    "multipartmux name=mux boundary=endofsection ! " \
+    "multisocketsink name=msocksink sync=false sync-method=latest-keyframe buffers-min=%d"
+/* *INDENT-ON* */
+
+/* multipartmux pushes the part header, the JPEG data and the part footer
+ * as separate buffers, and only the header is a sync point. Keeping the
+ * last two frames around lets the sink start every new client from the
+ * header of the most recent complete frame. */
+#define MJPEG_BUFFERS_PER_FRAME         3
+#define MJPEG_LAST_FRAME_BUFFERS        (2 * MJPEG_BUFFERS_PER_FRAME)
+
+/* GST_CLIENT_STATUS_REMOVED and GST_CLIENT_STATUS_SLOW of multisocketsink,
+ * which doesn't install its headers. */
+#define MJPEG_CLIENT_STATUS_REMOVED     2
+#define MJPEG_CLIENT_STATUS_SLOW        3
+
+/* Frames are not produced while nobody is watching, so videorate must not
+ * try to fill that gap with duplicates once frames flow again. */
+#define MJPEG_MAX_DUPLICATION_TIME      GST_SECOND
+
+/* The share of reference frames is measured over roughly this many
+ * frames, so that it follows changes in the structure of the stream. */
+#define DECIMATION_WINDOW               300
+
+/* tsdemux has to hold a couple of PCRs before it can timestamp the
+ * stream. With a demux-latency of 0, its latency is set from the largest
+ * PCR interval seen over the first PCRs of the stream, and the default
+ * assumes the common interval of 40 ms until then. */
+#define MJPEG_DEFAULT_DEMUX_LATENCY     65
+#define MJPEG_MIN_DEMUX_LATENCY         20
+#define MJPEG_MAX_DEMUX_LATENCY         1000
+#define MJPEG_DEMUX_LATENCY_PCRS        2
+#define MJPEG_PCR_SAMPLES               8
+
+#define TS_PACKET_SIZE                  188
+#define TS_SYNC_BYTE                    0x47
+#define TS_NULL_PID                     0x1fff
+#define TS_PCR_CLOCK                    27000000
+
+/* Encoding start times kept per branch, in case frames never come out of
+ * the encoder, like on a flush. */
+#define MJPEG_MAX_ENCODING_FRAMES       64
+
+/* Frames are compared with the last encoded one in blocks of this many
+ * bytes of luma, on as many lines. */
+#define MJPEG_STATIC_BLOCK_SIZE         16
+
+/* The source is taken for stalled when nothing came in for this long. It
+ * is then connected again after a delay that doubles with every attempt,
+ * while the last JPEG is sent again every time the source is watched,
+ * about once a second. */
+#define MJPEG_STALL_TIMEOUT             (2 * G_USEC_PER_SEC)
+#define MJPEG_MIN_RECONNECT_DELAY       G_USEC_PER_SEC
+#define MJPEG_MAX_RECONNECT_DELAY       (30 * G_USEC_PER_SEC)
+#define MJPEG_KEEPALIVE_INTERVAL        GST_SECOND
+
+/* The limits of queue, which the ingest and pre-encode queues get back
+ * when they are no longer bounded in time. */
+#define QUEUE_DEFAULT_MAX_SIZE_BUFFERS  200
+#define QUEUE_DEFAULT_MAX_SIZE_BYTES    (10 * 1024 * 1024)
+#define QUEUE_DEFAULT_MAX_SIZE_TIME     GST_SECOND
+
+/* A client that drains less than its tier sends is moved to the tier at
+ * half the frame rate, down to this rate. */
+#define MJPEG_MIN_CLIENT_FPS            1
+
+/* A client that kept up for this many adaptations in a row is moved back
+ * to twice the frame rate, up to the one it asked for. */
+#define MJPEG_CLIENT_PROBATION          10
+
+/* Tiers are keyed by their frame rate and by the video direction of
+ * videoflip they apply to the JPEGs. */
+#define TIER_KEY(fps, direction)        GINT_TO_POINTER ((fps) << 3 | (direction))
+
+/* Timestamps of the frames in the decoder kept, in case they never come
+ * out, like the ones it skips. */
+#define MJPEG_MAX_DECODING_FRAMES       64
+
+typedef struct _GaeulMjpegDecoding
+{
+  GstClockTime pts;
+  gint64 start;
+} GaeulMjpegDecoding;
+
+#ifdef HAVE_TURBOJPEG
+/* The lossless transforms of the video directions up to ur-ll */
+static const gint tier_transforms[] = {
+  TJXOP_NONE,                   /* identity */
+  TJXOP_ROT90,                  /* 90r */
+  TJXOP_ROT180,                 /* 180 */
+  TJXOP_ROT270,                 /* 90l */
+  TJXOP_HFLIP,                  /* horiz */
+  TJXOP_VFLIP,                  /* vert */
+  TJXOP_TRANSPOSE,              /* ul-lr */
+  TJXOP_TRANSVERSE,             /* ur-ll */
+};
+#endif
+
+typedef struct _GaeulMjpegBranch GaeulMjpegBranch;
+
+/* A tier sends the JPEG stream of a branch at one frame rate and in one
+ * direction, from the tee after the encoder down to the multisocketsink
+ * that HTTP clients are attached to. Clients of the same branch share its
+ * encoder, whatever rate and direction they are served at. */
+typedef struct _GaeulMjpegTier
+{
+  GaeulMjpegBranch *branch;
+
+  /* 0 sends every frame */
+  gint fps;
+  GstClockTime period;
+
+  /* flips and rotates the JPEGs losslessly when not 0 */
+  guint direction;
+#ifdef HAVE_TURBOJPEG
+  tjhandle transformer;
+#endif
+
+  /* only touched from the streaming thread of the encoder */
+  GstClockTime next_pts;
+
+  GstElement *bin;
+  GstElement *sink;
+  GstPad *tee_pad;
+
+  /* bytes pushed to the sink, guarded by the lock of the branch */
+  guint64 bytes_pushed;
+} GaeulMjpegTier;
+
+/* A client of a branch, and how well it keeps up with its tier. */
+typedef struct _GaeulMjpegClient
+{
+  GSocket *socket;
+  GaeulMjpegTier *tier;
+
+  /* the frame rate the client asked for */
+  gint fps;
+
+  /* sent by and dropped at the tiers the client was moved away from */
+  guint64 bytes_sent;
+  guint64 buffers_dropped;
+
+  /* counters of the current tier at the last adaptation */
+  guint64 last_bytes_sent;
+  guint64 last_buffers_dropped;
+  guint64 last_bytes_pushed;
+  guint n_steady;
+} GaeulMjpegClient;
+
+/* A branch is the per-variant part of a transcoder, from the tee down to
+ * the encoder and its tiers. */
+struct _GaeulMjpegBranch
+{
+  GaeulMjpegRequest *request;
+
+  /* only valid until the branch is detached from its transcoder */
+  GaeulMjpegTranscoder *transcoder;
+  gboolean detached;
+
+  GstElement *pipeline;
+  GstElement *tee;
+  GstPad *tee_pad;
+
+  GstElement *bin;
+  GstElement *queue;
+  GstElement *rate;
+  GstElement *caps;
+  GstElement *enc_tee;
+
+  /* the highest frame rate asked for by the requests sharing the branch */
+  gint fps;
+
+  /* every level halves the frame rate encoded at, and every other level
+   * the size as well, only changed from the main thread */
+  guint degradation;
+
+  /* tiers keyed by their frame rate, only changed from the main thread */
+  GHashTable *tiers;
+
+  /* clients keyed by their socket */
+  GMutex lock;
+  GHashTable *clients;
+  gint n_clients;
+
+  /* bytes sent to the clients that already left, and the frames that were
+   * encoded or dropped by the branch itself */
+  guint64 bytes_sent;
+  guint64 frames_encoded;
+  guint64 frames_dropped;
+
+  /* set while the queue of the branch drops its oldest frames */
+  gint leaky;
+
+  /* monotonic times the frames in the encoder went in, and the time spent
+   * on the frames that came out */
+  GQueue encoding;
+  guint64 encode_time;
+
+  /* Frames whose luma doesn't differ from the last encoded frame by more
+   * than the threshold in any block aren't encoded, and the last JPEG is
+   * sent again instead, as it is while the source stalls. The reference
+   * luma is only touched from the streaming thread of the encoder input,
+   * the JPEG is guarded by the lock. */
+  gint static_threshold;
+  GstPad *enc_sinkpad;
+  GstPad *enc_srcpad;
+  GstCaps *reference_caps;
+  GstVideoInfo reference_info;
+  guint8 *reference;
+  guint n_unchanged;
+  gboolean repeating;
+  GstBuffer *last_jpeg;
+  guint64 frames_repeated;
+
+  /* monotonic time when the first client was added, and how long it took
+   * until the first frame reached the sink */
+  gint64 start_time;
+  gint64 startup_latency;
+};
+
+typedef enum
+{
+  PROP_RELAY_URI = 1,
+  PROP_UID,
+  PROP_RID,
+  PROP_PROTOCOL_LATENCY,
+  PROP_DEMUX_LATENCY,
+
+  /*< private > */
+  PROP_LAST
+} GaeulMjpegTranscoderProperty;
+
+static GParamSpec *properties[PROP_LAST] = { NULL };
+
+struct _GaeulMjpegTranscoder
+{
+  GObject parent;
+
+  gchar *relay_uri;
+  gchar *uid;
+  gchar *rid;
+  guint protocol_latency;
+  guint demux_latency;
+
+  GstElement *pipeline;
+  GstElement *src;
+  GstElement *src_queue;
+  GstElement *demux;
+  GstElement *es_tee;
+  GstElement *decoder_queue;
+  GstElement *convert;
+  GstElement *tee;
+
+  /* The decode stage is built for the codec of the first video stream
+   * tsdemux finds, from the parser down to the decoders. The lock keeps
+   * the keyframe decoder from being added while it is built. The codec is
+   * set once, before any data reaches the parser. */
+  GMutex decoder_lock;
+  const GaeulMjpegCodec *codec;
+  GstElement *parser;
+
+  /* the threads of the decoders built from now on, and whether they trade
+   * throughput for latency */
+  gint decoder_threads;
+  gint decoder_low_latency;
+
+  /* The full decoder only gets the stream while a branch that needs every
+   * frame has a client, and starts again from a keyframe. */
+  gboolean decoder_needs_keyframe;
+
+  /* Non-reference frames are skipped at decode while the reference frames
+   * alone are enough for the highest frame rate requested. The counts are
+   * only touched from the streaming thread of the parser. */
+  gint max_fps;
+  gint source_fps_n;
+  gint source_fps_d;
+  guint n_frames;
+  guint n_reference_frames;
+
+  /* the highest TemporalId of the H.265 stream, from its SPS or its
+   * pictures, whichever is higher */
+  guint max_temporal_id;
+
+  GMutex stats_lock;
+  guint64 frames_skipped;
+  guint64 ingest_buffers_dropped;
+  guint64 n_errors;
+  guint64 n_reconnects;
+
+  /* the time it took to build the decode stage, and the frames in and out
+   * of the full decoder */
+  gint64 decoder_build_time;
+  GQueue decoding;
+  guint64 frames_decoded;
+  guint64 decode_time;
+
+  /* The monotonic time the source last pushed data, and whether it failed
+   * or ended, guarded by the stats lock. The rest of the watch on the
+   * source is only touched from the main thread. */
+  gint64 last_input_time;
+  gboolean source_lost;
+  gboolean stalled;
+  gint64 reconnect_delay;
+  gint64 next_reconnect_time;
+
+  /* The PCR interval of the stream, only touched from the streaming thread
+   * of the demuxer until the latency of tsdemux is chosen. */
+  guint pcr_pid;
+  guint64 last_pcr;
+  guint64 max_pcr_interval;
+  guint n_pcr_samples;
+  gint current_demux_latency;
+
+  /* the decoder of keyframe-only branches, created on demand */
+  GstElement *keyframe_decoder;
+  GstElement *keyframe_tee;
+  GstPad *keyframe_es_pad;
+  gint n_keyframe_clients;
+
+  GHashTable *branches;
+
+  /* bytes sent by the branches that were already removed */
+  guint64 bytes_sent;
+
+  /* how the sinks treat clients that can't keep up */
+  GaeulMjpegSlowClientPolicy slow_client_policy;
+  guint max_queued_bytes;
+  guint max_queued_frames;
+
+  /* the time in milliseconds the ingest and pre-encode queues may hold
+   * before dropping their oldest data, 0 for the default limits */
+  gint queue_max_time;
+
+  /* the frames encoded at once by the branches created from now on */
+  gint encoder_threads;
+
+  /* the mean difference of luma in a block below which a frame is not
+   * encoded again, 0 encodes every frame */
+  gint static_threshold;
+
+  /* The pipeline is paused while no branch has a client. */
+  GaeulMjpegPlayback *playback;
+};
+
+typedef enum
+{
+  SIG_CLIENT_ADDED,
+  SIG_CLIENT_REMOVED,
+  LAST_SIGNAL
+} GaeulMjpegTranscoderSignal;
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+static void gaeul_mjpeg_transcoder_initable_iface_init (GInitableIface * iface);
+
+/* The pipeline is built by GInitable, so that GAsyncInitable can build it
+ * in a worker thread. */
+/* *INDENT-OFF* */
+G_DEFINE_TYPE_WITH_CODE (GaeulMjpegTranscoder, gaeul_mjpeg_transcoder, G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE (G_TYPE_INITABLE, gaeul_mjpeg_transcoder_initable_iface_init)
+    G_IMPLEMENT_INTERFACE (G_TYPE_ASYNC_INITABLE, NULL))
+/* *INDENT-ON* */
+
+static void
+_client_free (GaeulMjpegClient * client)
+{
+  g_object_unref (client->socket);
+  g_free (client);
+}
+
+static void
+_tier_client_added_cb (GstElement * sink, GSocket * socket,
+    gpointer user_data)
+{
+  GaeulMjpegTier *tier = user_data;
+  GaeulMjpegBranch *branch = tier->branch;
+  GaeulMjpegClient *client = NULL;
+  g_autoptr (GaeulMjpegTranscoder) transcoder = NULL;
+  g_autoptr (GaeulMjpegRequest) request = NULL;
+
+  g_debug ("client added %p", socket);
+
+  g_mutex_lock (&branch->lock);
+  /* A client moved from another tier is already known. */
+  if (!branch->detached && !g_hash_table_contains (branch->clients, socket)) {
+    client = g_new0 (GaeulMjpegClient, 1);
+    client->socket = g_object_ref (socket);
+    client->tier = tier;
+    client->fps = tier->fps;
+    client->last_bytes_pushed = tier->bytes_pushed;
+    g_hash_table_insert (branch->clients, socket, client);
+
+    if (branch->start_time == 0) {
+      branch->start_time = g_get_monotonic_time ();
+    }
+    g_atomic_int_inc (&branch->n_clients);
+    if (branch->request->flags & GAEUL_MJPEG_REQUEST_FLAG_KEYFRAME_ONLY) {
+      g_atomic_int_inc (&branch->transcoder->n_keyframe_clients);
+    }
+    gaeul_mjpeg_playback_client_added (branch->transcoder->playback);
+    transcoder = g_object_ref (branch->transcoder);
+    request = gaeul_mjpeg_request_ref (branch->request);
+  }
+  g_mutex_unlock (&branch->lock);
+
+  /* Handlers may call back into the transcoder, so the lock of the branch
+   * is not held while they run. The request is the one of the branch when
+   * the client was added, which an update may replace meanwhile. */
+  if (transcoder != NULL) {
+    g_signal_emit (transcoder, signals[SIG_CLIENT_ADDED], 0, request, socket);
+  }
+}
+
+static guint64
+_sink_get_bytes_sent (GstElement * sink, GSocket * socket)
+{
+  g_autoptr (GstStructure) s = NULL;
+  guint64 sent = 0;
+
+  g_signal_emit_by_name (sink, "get-stats", socket, &s);
+
+  if (s != NULL) {
+    gst_structure_get_uint64 (s, "bytes-sent", &sent);
+  }
+
+  return sent;
+}
+
+/* multisocketsink leaves the sockets it is given open, so a client that is
+ * removed for good is shut down to see the end of its stream instead of
+ * stalling. The socket itself is left to its owner, the application closing
+ * the connection it took from libsoup. */
+static void
+_client_shutdown (GSocket * socket)
+{
+  g_autoptr (GError) error = NULL;
+
+  if (!g_socket_shutdown (socket, TRUE, TRUE, &error)) {
+    g_debug ("failed to shut down client %p (reason: %s)", socket,
+        error->message);
+  }
+}
+
+static void
+_tier_client_removed_cb (GstElement * sink, GSocket * socket, gint status,
+    gpointer user_data)
+{
+  GaeulMjpegTier *tier = user_data;
+  GaeulMjpegBranch *branch = tier->branch;
+  GaeulMjpegClient *client = NULL;
+  g_autoptr (GaeulMjpegTranscoder) transcoder = NULL;
+  g_autoptr (GaeulMjpegRequest) request = NULL;
+  g_autoptr (GstStructure) s = NULL;
+  guint64 sent = 0;
+  guint64 dropped = 0;
+
+  g_debug ("client removed %p", socket);
+
+  if (status == MJPEG_CLIENT_STATUS_SLOW) {
+    g_info ("disconnected slow client %p", socket);
+  }
+
+  /* The sink forgets about the client once this returns, so its share of
+   * the bytes sent is kept by the branch. */
+  g_signal_emit_by_name (sink, "get-stats", socket, &s);
+  if (s != NULL) {
+    gst_structure_get_uint64 (s, "bytes-sent", &sent);
+    gst_structure_get_uint64 (s, "dropped-buffers", &dropped);
+  }
+
+  g_mutex_lock (&branch->lock);
+  if (branch->detached) {
+    g_mutex_unlock (&branch->lock);
+    _client_shutdown (socket);
+    return;
+  }
+
+  if ((client = g_hash_table_lookup (branch->clients, socket)) == NULL) {
+    g_mutex_unlock (&branch->lock);
+    return;
+  }
+
+  /* The client is being moved to another tier. */
+  if (status == MJPEG_CLIENT_STATUS_REMOVED && client->tier != tier) {
+    client->bytes_sent += sent;
+    client->buffers_dropped += dropped;
+    g_mutex_unlock (&branch->lock);
+    return;
+  }
+
+  branch->bytes_sent += client->bytes_sent + sent;
+  g_hash_table_remove (branch->clients, socket);
+
+  g_atomic_int_add (&branch->n_clients, -1);
+  if (branch->request->flags & GAEUL_MJPEG_REQUEST_FLAG_KEYFRAME_ONLY) {
+    g_atomic_int_add (&branch->transcoder->n_keyframe_clients, -1);
+  }
+
+  transcoder = g_object_ref (branch->transcoder);
+  request = gaeul_mjpeg_request_ref (branch->request);
+  gaeul_mjpeg_playback_client_removed (transcoder->playback);
+  g_mutex_unlock (&branch->lock);
+
+  _client_shutdown (socket);
+
+  g_signal_emit (transcoder, signals[SIG_CLIENT_REMOVED], 0, request, socket);
+}
+
+static GstPadProbeReturn
+_branch_drop_probe_cb (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  GaeulMjpegBranch *branch = user_data;
+
+  /* Another branch keeps the pipeline playing, but nobody is watching this
+   * one, so don't spend time on scaling and encoding its frames. */
+  if (g_atomic_int_get (&branch->n_clients) == 0) {
+    g_mutex_lock (&branch->lock);
+    branch->frames_dropped++;
+    g_mutex_unlock (&branch->lock);
+
+    return GST_PAD_PROBE_DROP;
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Returns whether the mean absolute difference of any block of @luma and
+ * @reference is above @threshold. The plain loops over bytes are left for
+ * the compiler to turn into SAD instructions. */
+static gboolean
+_luma_differs (const guint8 * luma, gint stride, const guint8 * reference,
+    gint width, gint height, guint threshold)
+{
+  gint n_blocks = (width + MJPEG_STATIC_BLOCK_SIZE - 1) /
+      MJPEG_STATIC_BLOCK_SIZE;
+  g_autofree guint *sads = g_new (guint, n_blocks);
+  gint y0, y, x0, x;
+
+  for (y0 = 0; y0 < height; y0 += MJPEG_STATIC_BLOCK_SIZE) {
+    gint block_height = MIN (MJPEG_STATIC_BLOCK_SIZE, height - y0);
+
+    memset (sads, 0, n_blocks * sizeof (guint));
+
+    for (y = y0; y < y0 + block_height; y++) {
+      const guint8 *a = luma + y * stride;
+      const guint8 *b = reference + y * width;
+
+      for (x0 = 0; x0 < width; x0 += MJPEG_STATIC_BLOCK_SIZE) {
+        gint x1 = MIN (x0 + MJPEG_STATIC_BLOCK_SIZE, width);
+        guint sad = 0;
+
+        for (x = x0; x < x1; x++) {
+          sad += ABS (a[x] - b[x]);
+        }
+        sads[x0 / MJPEG_STATIC_BLOCK_SIZE] += sad;
+      }
+    }
+
+    for (x0 = 0; x0 < width; x0 += MJPEG_STATIC_BLOCK_SIZE) {
+      guint n_bytes = MIN (MJPEG_STATIC_BLOCK_SIZE, width - x0) * block_height;
+
+      if (sads[x0 / MJPEG_STATIC_BLOCK_SIZE] > threshold * n_bytes) {
+        return TRUE;
+      }
+    }
+  }
+
+  return FALSE;
+}
+
+/* Compares @buffer with the last encoded frame, and makes it the new
+ * reference when it changed. Returns whether it is unchanged. */
+static gboolean
+_branch_frame_is_static (GaeulMjpegBranch * branch, GstPad * pad,
+    GstBuffer * buffer, guint threshold)
+{
+  g_autoptr (GstCaps) caps = gst_pad_get_current_caps (pad);
+  GstVideoFrame frame;
+  const guint8 *luma = NULL;
+  gint stride, width, height, y;
+  gboolean changed = TRUE;
+
+  if (caps == NULL) {
+    return FALSE;
+  }
+
+  /* The size changes along with the request of the branch, and the JPEG
+   * of the old size must not be sent again. */
+  if (branch->reference_caps == NULL ||
+      !gst_caps_is_equal (caps, branch->reference_caps)) {
+    if (!gst_video_info_from_caps (&branch->reference_info, caps)) {
+      return FALSE;
+    }
+
+    gst_caps_replace (&branch->reference_caps, caps);
+    g_clear_pointer (&branch->reference, g_free);
+
+    g_mutex_lock (&branch->lock);
+    gst_buffer_replace (&branch->last_jpeg, NULL);
+    g_mutex_unlock (&branch->lock);
+  }
+
+  if (!gst_video_frame_map (&frame, &branch->reference_info, buffer,
+          GST_MAP_READ)) {
+    return FALSE;
+  }
+
+  /* The first plane holds the luma of the planar formats, and all the
+   * components of the packed ones. */
+  luma = GST_VIDEO_FRAME_PLANE_DATA (&frame, 0);
+  stride = GST_VIDEO_FRAME_PLANE_STRIDE (&frame, 0);
+  width = GST_VIDEO_FRAME_COMP_WIDTH (&frame, 0) *
+      GST_VIDEO_FRAME_COMP_PSTRIDE (&frame, 0);
+  height = GST_VIDEO_FRAME_COMP_HEIGHT (&frame, 0);
+
+  if (branch->reference != NULL) {
+    changed = _luma_differs (luma, stride, branch->reference, width, height,
+        threshold);
+  }
+
+  if (changed) {
+    if (branch->reference == NULL) {
+      branch->reference = g_malloc (width * height);
+    }
+    for (y = 0; y < height; y++) {
+      memcpy (branch->reference + y * width, luma + y * stride, width);
+    }
+    branch->n_unchanged = 0;
+  } else {
+    branch->n_unchanged++;
+  }
+
+  gst_video_frame_unmap (&frame);
+
+  return !changed;
+}
+
+static GstPadProbeReturn
+_branch_encode_probe_cb (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  GaeulMjpegBranch *branch = user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstBuffer *jpeg = NULL;
+  guint threshold = g_atomic_int_get (&branch->static_threshold);
+  gint64 *start = NULL;
+
+  if (threshold == 0) {
+    g_clear_pointer (&branch->reference, g_free);
+  } else if (_branch_frame_is_static (branch, pad, buffer, threshold)) {
+    /* Frames in the encoder, when it encodes several at once, only come
+     * out when others go in. Those still in there must all be unchanged
+     * ones, or the JPEG of the last change would wait for the next. */
+    g_mutex_lock (&branch->lock);
+    if (branch->last_jpeg != NULL &&
+        branch->n_unchanged > branch->encoding.length) {
+      jpeg = gst_buffer_copy (branch->last_jpeg);
+      branch->frames_repeated++;
+    }
+    g_mutex_unlock (&branch->lock);
+
+    if (jpeg != NULL) {
+      gst_buffer_copy_into (jpeg, buffer, GST_BUFFER_COPY_TIMESTAMPS, 0, -1);
+
+      branch->repeating = TRUE;
+      gst_pad_push (branch->enc_srcpad, jpeg);
+      branch->repeating = FALSE;
+
+      return GST_PAD_PROBE_DROP;
+    }
+  }
+
+  start = g_new (gint64, 1);
+  *start = g_get_monotonic_time ();
+
+  g_mutex_lock (&branch->lock);
+  g_queue_push_tail (&branch->encoding, start);
+  if (branch->encoding.length > MJPEG_MAX_ENCODING_FRAMES) {
+    g_free (g_queue_pop_head (&branch->encoding));
+  }
+  g_mutex_unlock (&branch->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Every frame comes out of the encoders in the order it went in, even
+ * when several are encoded at once. */
+static GstPadProbeReturn
+_branch_encoded_probe_cb (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  GaeulMjpegBranch *branch = user_data;
+  gint64 *start = NULL;
+
+  /* a JPEG sent again for an unchanged frame */
+  if (branch->repeating) {
+    return GST_PAD_PROBE_OK;
+  }
+
+  g_mutex_lock (&branch->lock);
+  branch->frames_encoded++;
+  gst_buffer_replace (&branch->last_jpeg, GST_PAD_PROBE_INFO_BUFFER (info));
+  if ((start = g_queue_pop_head (&branch->encoding)) != NULL) {
+    branch->encode_time += g_get_monotonic_time () - *start;
+    g_free (start);
+  }
+  g_mutex_unlock (&branch->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Returns the parallel encoder with @n_threads frame threads, or NULL
+ * when libav isn't there to provide it. */
+static const gchar *
+_get_parallel_encoder (guint n_threads)
+{
+  GstElementFactory *factory = NULL;
+
+  if (n_threads <= 1) {
+    return NULL;
+  }
+
+  if ((factory = gst_element_factory_find ("avenc_mjpeg")) == NULL) {
+    g_warning ("avenc_mjpeg is not available, encoding on one thread");
+    return NULL;
+  }
+
+  gst_object_unref (factory);
+
+  return GST_MJPEG_PARALLEL_ENCODER_DESC;
+}
+
+static void
+_encoder_set_threads (GstElement * enc, guint n_threads)
+{
+  GObjectClass *klass = G_OBJECT_GET_CLASS (enc);
+
+  /* The property was renamed along with the move to the AVOptions of
+   * libav. */
+  if (g_object_class_find_property (klass, "threads") != NULL) {
+    g_object_set (enc, "threads", n_threads, NULL);
+    gst_util_set_object_arg (G_OBJECT (enc), "thread-type", "frame");
+  } else if (g_object_class_find_property (klass, "max-threads") != NULL) {
+    g_object_set (enc, "max-threads", n_threads, NULL);
+  }
+}
+
+static GList *
+_branch_get_client_sockets (GaeulMjpegBranch * branch)
+{
+  GList *sockets = NULL;
+
+  g_mutex_lock (&branch->lock);
+  sockets = g_hash_table_get_keys (branch->clients);
+  g_list_foreach (sockets, (GFunc) g_object_ref, NULL);
+  g_mutex_unlock (&branch->lock);
+
+  return sockets;
+}
+
+/* Returns the sink the client of @socket is attached to, and what the
+ * client got from the tiers it was attached to before. The sink is to be
+ * queried without the lock of the branch, which its client-removed handler
+ * takes. */
+static GstElement *
+_branch_get_client_sink (GaeulMjpegBranch * branch, GSocket * socket,
+    guint64 * bytes_sent, guint64 * buffers_dropped)
+{
+  GaeulMjpegClient *client = NULL;
+  GstElement *sink = NULL;
+
+  g_mutex_lock (&branch->lock);
+  if ((client = g_hash_table_lookup (branch->clients, socket)) != NULL) {
+    sink = gst_object_ref (client->tier->sink);
+    *bytes_sent = client->bytes_sent;
+    *buffers_dropped = client->buffers_dropped;
+  }
+  g_mutex_unlock (&branch->lock);
+
+  return sink;
+}
+
+static guint64
+_branch_get_bytes_sent (GaeulMjpegBranch * branch)
+{
+  GList *sockets = NULL;
+  GList *l = NULL;
+  guint64 sent = 0;
+
+  g_mutex_lock (&branch->lock);
+  sent = branch->bytes_sent;
+  g_mutex_unlock (&branch->lock);
+
+  sockets = _branch_get_client_sockets (branch);
+
+  for (l = sockets; l != NULL; l = l->next) {
+    g_autoptr (GstElement) sink = NULL;
+    guint64 client_sent = 0;
+    guint64 client_dropped = 0;
+
+    sink = _branch_get_client_sink (branch, l->data, &client_sent,
+        &client_dropped);
+    if (sink != NULL) {
+      sent += client_sent + _sink_get_bytes_sent (sink, l->data);
+    }
+  }
+
+  g_list_free_full (sockets, g_object_unref);
+
+  return sent;
+}
+
+/* Queued data is counted in bytes when @max_queued_bytes is set, in frames
+ * otherwise. Either limit set to 0 lets the queue of a client grow without
+ * bound. */
+static void
+_sink_set_slow_client_policy (GstElement * sink,
+    GaeulMjpegSlowClientPolicy policy, guint max_queued_bytes,
+    guint max_queued_frames)
+{
+  gint64 limit = -1;
+  gint64 soft_max = -1;
+  gint64 hard_max = -1;
+
+  if (max_queued_bytes > 0) {
+    gst_util_set_object_arg (G_OBJECT (sink), "unit-format", "bytes");
+    limit = max_queued_bytes;
+  } else {
+    gst_util_set_object_arg (G_OBJECT (sink), "unit-format", "buffers");
+    if (max_queued_frames > 0) {
+      limit = MAX ((gint64) max_queued_frames * MJPEG_BUFFERS_PER_FRAME,
+          MJPEG_LAST_FRAME_BUFFERS);
+    }
+  }
+
+  switch (policy) {
+    case GAEUL_MJPEG_SLOW_CLIENT_DROP_TO_LATEST:
+    case GAEUL_MJPEG_SLOW_CLIENT_DROP_TO_KEYFRAME:
+      /* Only the part headers are sync points, so the client resumes at
+       * the start of a frame. Resuming at the latest buffer could start it
+       * in the middle of a part, and every JPEG is a keyframe anyway. */
+      gst_util_set_object_arg (G_OBJECT (sink), "recover-policy", "keyframe");
+      soft_max = limit;
+      break;
+    case GAEUL_MJPEG_SLOW_CLIENT_DISCONNECT:
+      gst_util_set_object_arg (G_OBJECT (sink), "recover-policy", "none");
+      hard_max = limit;
+      break;
+  }
+
+  g_object_set (sink, "units-soft-max", soft_max, "units-max", hard_max, NULL);
+}
+
+/* Tells whether an access unit of a byte-stream H.264 or H.265 stream
+ * holds a picture that no other picture refers to. Every slice of a
+ * picture agrees on it, so the first slice decides. Must be called from
+ * the streaming thread of the parser. */
+static gboolean
+_is_non_reference (GaeulMjpegTranscoder * self, GstBuffer * buffer)
+{
+  const GaeulMjpegCodec *codec = self->codec;
+  GstMapInfo map;
+  gboolean non_reference = FALSE;
+  gsize i;
+
+  if (!gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+    return FALSE;
+  }
+
+  for (i = 0; i + 3 < map.size; i++) {
+    guint8 nal_type;
+
+    if (map.data[i] != 0 || map.data[i + 1] != 0 || map.data[i + 2] != 1) {
+      continue;
+    }
+
+    if (codec->hevc) {
+      guint temporal_id;
+
+      if (i + 5 >= map.size) {
+        break;
+      }
+
+      nal_type = (map.data[i + 3] >> 1) & 0x3f;
+      temporal_id = MAX (map.data[i + 4] & 0x7, 1) - 1;
+
+      /* sps_max_sub_layers_minus1 follows sps_video_parameter_set_id */
+      if (nal_type == 33) {
+        self->max_temporal_id =
+            MAX (self->max_temporal_id, (map.data[i + 5] >> 1) & 0x7);
+      }
+
+      /* coded slice segments (0-31), of which the even ones up to 14 are
+       * sub-layer non-reference pictures. Pictures of higher sub-layers
+       * may still refer to them, so only those of the highest one go. */
+      if (nal_type <= 31) {
+        self->max_temporal_id = MAX (self->max_temporal_id, temporal_id);
+        non_reference = nal_type <= 14 && nal_type % 2 == 0 &&
+            temporal_id == self->max_temporal_id;
+        break;
+      }
+    } else {
+      nal_type = map.data[i + 3] & 0x1f;
+
+      /* coded slice of a non-IDR (1-4) or an IDR (5) picture */
+      if (nal_type >= 1 && nal_type <= 5) {
+        non_reference = ((map.data[i + 3] >> 5) & 0x3) == 0;
+        break;
+      }
+    }
+
+    i += 3;
+  }
+
+  gst_buffer_unmap (buffer, &map);
+
+  return non_reference;
+}
+
+static void
+_queue_set_max_time (GstElement * queue, guint max_time)
+{
+  if (max_time == 0) {
+    g_object_set (queue, "max-size-buffers", QUEUE_DEFAULT_MAX_SIZE_BUFFERS,
+        "max-size-bytes", QUEUE_DEFAULT_MAX_SIZE_BYTES,
+        "max-size-time", (guint64) QUEUE_DEFAULT_MAX_SIZE_TIME, NULL);
+    gst_util_set_object_arg (G_OBJECT (queue), "leaky", "no");
+    return;
+  }
+
+  /* Only the time bounds the queue, and its oldest data goes first. */
+  g_object_set (queue, "max-size-buffers", 0, "max-size-bytes", 0,
+      "max-size-time", (guint64) max_time * GST_MSECOND, NULL);
+  gst_util_set_object_arg (G_OBJECT (queue), "leaky", "downstream");
+}
+
+/* A leaky queue drops its oldest buffer right after it overruns. */
+static void
+_src_queue_overrun_cb (GstElement * queue, gpointer user_data)
+{
+  GaeulMjpegTranscoder *self = user_data;
+
+  if (g_atomic_int_get (&self->queue_max_time) > 0) {
+    g_mutex_lock (&self->stats_lock);
+    self->ingest_buffers_dropped++;
+    g_mutex_unlock (&self->stats_lock);
+  }
+}
+
+static void
+_branch_queue_overrun_cb (GstElement * queue, gpointer user_data)
+{
+  GaeulMjpegBranch *branch = user_data;
+
+  if (g_atomic_int_get (&branch->leaky)) {
+    g_mutex_lock (&branch->lock);
+    branch->frames_dropped++;
+    g_mutex_unlock (&branch->lock);
+  }
+}
+
+static void
+_branch_set_queue_max_time (GaeulMjpegBranch * branch, guint max_time)
+{
+  _queue_set_max_time (branch->queue, max_time);
+  g_atomic_int_set (&branch->leaky, max_time > 0);
+}
+
+/* Returns the PCR of the TS packet at @data, in 27 MHz units, or
+ * GST_CLOCK_TIME_NONE when it carries none. */
+static guint64
+_ts_packet_get_pcr (const guint8 * data, guint * pid)
+{
+  guint64 base = 0;
+  guint64 ext = 0;
+
+  /* adaptation_field_control, and the PCR_flag of the adaptation field */
+  if (!(data[3] & 0x20) || data[4] < 7 || !(data[5] & 0x10)) {
+    return GST_CLOCK_TIME_NONE;
+  }
+
+  *pid = ((data[1] & 0x1f) << 8) | data[2];
+
+  base = ((guint64) data[6] << 25) | ((guint64) data[7] << 17) |
+      ((guint64) data[8] << 9) | ((guint64) data[9] << 1) | (data[10] >> 7);
+  ext = ((data[10] & 0x01) << 8) | data[11];
+
+  return base * 300 + ext;
+}
+
+static void
+_transcoder_set_demux_latency (GaeulMjpegTranscoder * self)
+{
+  guint64 interval_ms = (self->max_pcr_interval * 1000 + TS_PCR_CLOCK - 1) /
+      TS_PCR_CLOCK;
+  gint latency = CLAMP (interval_ms * MJPEG_DEMUX_LATENCY_PCRS,
+      MJPEG_MIN_DEMUX_LATENCY, MJPEG_MAX_DEMUX_LATENCY);
+
+  g_debug ("PCR interval of (u=%s,r=%s) is up to %" G_GUINT64_FORMAT
+      " ms, setting demux latency to %d ms", self->uid, self->rid,
+      interval_ms, latency);
+
+  g_object_set (self->demux, "latency", latency, NULL);
+  g_atomic_int_set (&self->current_demux_latency, latency);
+
+  gst_element_post_message (self->demux,
+      gst_message_new_latency (GST_OBJECT (self->demux)));
+}
+
+static void
+_transcoder_recalculate_latency_async (GstElement * pipeline,
+    gpointer user_data)
+{
+  gst_bin_recalculate_latency (GST_BIN (pipeline));
+}
+
+static GstBusSyncReply
+_transcoder_bus_sync_handler (GstBus * bus, GstMessage * message,
+    gpointer user_data)
+{
+  GaeulMjpegTranscoder *self = user_data;
+
+  switch (GST_MESSAGE_TYPE (message)) {
+    case GST_MESSAGE_ERROR:{
+      g_autoptr (GError) error = NULL;
+      g_autofree gchar *debug = NULL;
+
+      gst_message_parse_error (message, &error, &debug);
+      g_warning ("error from %s in (u=%s,r=%s): %s (%s)",
+          GST_OBJECT_NAME (GST_MESSAGE_SRC (message)), self->uid, self->rid,
+          error->message, debug != NULL ? debug : "no details");
+
+      /* An error of the source stops it for good, until it is connected
+       * again. */
+      g_mutex_lock (&self->stats_lock);
+      self->n_errors++;
+      if (GST_MESSAGE_SRC (message) == GST_OBJECT (self->src)) {
+        self->source_lost = TRUE;
+      }
+      g_mutex_unlock (&self->stats_lock);
+      break;
+    }
+    case GST_MESSAGE_LATENCY:
+      /* recalculated away from the streaming thread that posted it */
+      gst_element_call_async (self->pipeline,
+          _transcoder_recalculate_latency_async, NULL, NULL);
+      break;
+    default:
+      break;
+  }
+
+  /* Nobody pops the bus, so nothing is left on it. */
+  return GST_BUS_DROP;
+}
+
+static GstPadProbeReturn
+_src_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  GaeulMjpegTranscoder *self = user_data;
+
+  if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+    /* The sinks would not take another frame after the end of the stream,
+     * which rather means that the source has to be connected again. */
+    if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_EOS) {
+      g_debug ("end of stream of (u=%s,r=%s)", self->uid, self->rid);
+
+      g_mutex_lock (&self->stats_lock);
+      self->source_lost = TRUE;
+      g_mutex_unlock (&self->stats_lock);
+
+      return GST_PAD_PROBE_DROP;
+    }
+
+    return GST_PAD_PROBE_OK;
+  }
+
+  g_mutex_lock (&self->stats_lock);
+  self->last_input_time = g_get_monotonic_time ();
+  g_mutex_unlock (&self->stats_lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+_demux_pcr_probe_cb (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  GaeulMjpegTranscoder *self = user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstMapInfo map;
+  gsize offset = 0;
+
+  if (!gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+    return GST_PAD_PROBE_OK;
+  }
+
+  while (offset + TS_PACKET_SIZE <= map.size &&
+      self->n_pcr_samples < MJPEG_PCR_SAMPLES) {
+    const guint8 *data = map.data + offset;
+    guint64 pcr = 0;
+    guint pid = TS_NULL_PID;
+
+    if (data[0] != TS_SYNC_BYTE) {
+      offset++;
+      continue;
+    }
+
+    offset += TS_PACKET_SIZE;
+
+    if ((pcr = _ts_packet_get_pcr (data, &pid)) == GST_CLOCK_TIME_NONE) {
+      continue;
+    }
+
+    /* Only the PCRs of the first PID carrying them are compared. */
+    if (self->pcr_pid == TS_NULL_PID) {
+      self->pcr_pid = pid;
+    } else if (pid != self->pcr_pid) {
+      continue;
+    }
+
+    /* Wraparounds, discontinuities and gaps of over a second don't tell
+     * the interval the stream is muxed with. */
+    if (self->last_pcr != GST_CLOCK_TIME_NONE && pcr > self->last_pcr &&
+        pcr - self->last_pcr < TS_PCR_CLOCK && !(data[5] & 0x80)) {
+      self->max_pcr_interval =
+          MAX (self->max_pcr_interval, pcr - self->last_pcr);
+      self->n_pcr_samples++;
+    }
+
+    self->last_pcr = pcr;
+  }
+
+  gst_buffer_unmap (buffer, &map);
+
+  if (self->n_pcr_samples < MJPEG_PCR_SAMPLES) {
+    return GST_PAD_PROBE_OK;
+  }
+
+  _transcoder_set_demux_latency (self);
+
+  return GST_PAD_PROBE_REMOVE;
+}
+
+static gboolean
+_transcoder_can_skip_non_reference (GaeulMjpegTranscoder * self)
+{
+  gint max_fps = g_atomic_int_get (&self->max_fps);
+  gdouble reference_fps = 0;
+
+  if (max_fps <= 0 || self->source_fps_n <= 0 || self->source_fps_d <= 0 ||
+      self->n_frames == 0) {
+    return FALSE;
+  }
+
+  reference_fps = (gdouble) self->source_fps_n / self->source_fps_d *
+      self->n_reference_frames / self->n_frames;
+
+  return max_fps <= reference_fps;
+}
+
+static GstPadProbeReturn
+_decoder_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  GaeulMjpegTranscoder *self = user_data;
+  GstBuffer *buffer = NULL;
+  gboolean non_reference = FALSE;
+
+  if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+
+    if (GST_EVENT_TYPE (event) == GST_EVENT_CAPS) {
+      GstCaps *caps = NULL;
+
+      gst_event_parse_caps (event, &caps);
+      if (!gst_structure_get_fraction (gst_caps_get_structure (caps, 0),
+              "framerate", &self->source_fps_n, &self->source_fps_d)) {
+        self->source_fps_n = 0;
+        self->source_fps_d = 1;
+      }
+    }
+
+    return GST_PAD_PROBE_OK;
+  }
+
+  buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  non_reference = _is_non_reference (self, buffer);
+
+  if (self->n_frames >= DECIMATION_WINDOW) {
+    self->n_frames /= 2;
+    self->n_reference_frames /= 2;
+  }
+  self->n_frames++;
+  if (!non_reference) {
+    self->n_reference_frames++;
+  }
+
+  if (gaeul_mjpeg_playback_get_n_clients (self->playback) ==
+      g_atomic_int_get (&self->n_keyframe_clients) &&
+      !gaeul_mjpeg_playback_is_prerolling (self->playback)) {
+    self->decoder_needs_keyframe = TRUE;
+    return GST_PAD_PROBE_DROP;
+  }
+
+  if (self->decoder_needs_keyframe) {
+    if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+      return GST_PAD_PROBE_DROP;
+    }
+
+    buffer = gst_buffer_make_writable (buffer);
+    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DISCONT);
+    GST_PAD_PROBE_INFO_DATA (info) = buffer;
+
+    self->decoder_needs_keyframe = FALSE;
+  }
+
+  if (non_reference && _transcoder_can_skip_non_reference (self)) {
+    g_mutex_lock (&self->stats_lock);
+    self->frames_skipped++;
+    g_mutex_unlock (&self->stats_lock);
+
+    return GST_PAD_PROBE_DROP;
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+static gint
+_branch_get_encoded_fps (GaeulMjpegBranch * branch)
+{
+  if (branch->degradation == 0) {
+    return branch->fps;
+  }
+
+  return MAX (branch->fps >> ((branch->degradation + 1) / 2), 1);
+}
+
+/* Sets the output of @branch from its request, its frame rate and how far
+ * it is degraded. */
+static void
+_branch_update_caps (GaeulMjpegBranch * branch)
+{
+  g_autoptr (GstElement) capsfilter = NULL;
+  g_autoptr (GstCaps) caps = NULL;
+  guint shift = branch->degradation / 2;
+  gint width = branch->request->width;
+  gint height = branch->request->height;
+
+  /* The JPEGs of lossless directions stay in whole MCUs. */
+  if (shift > 0 &&
+      gaeul_mjpeg_request_has_lossless_direction (branch->request)) {
+    width = GST_ROUND_UP_N (MAX (width >> shift, 1), GAEUL_MJPEG_MCU_SIZE);
+    height = GST_ROUND_UP_N (MAX (height >> shift, 1), GAEUL_MJPEG_MCU_SIZE);
+  } else if (shift > 0) {
+    width = GST_ROUND_UP_2 (MAX (width >> shift, 1));
+    height = GST_ROUND_UP_2 (MAX (height >> shift, 1));
+  }
+
+  if (branch->request->flags & GAEUL_MJPEG_REQUEST_FLAG_KEYFRAME_ONLY) {
+    caps = gst_caps_new_simple ("video/x-raw",
+        "width", G_TYPE_INT, width, "height", G_TYPE_INT, height, NULL);
+  } else {
+    caps = gst_caps_new_simple ("video/x-raw",
+        "framerate", GST_TYPE_FRACTION, _branch_get_encoded_fps (branch), 1,
+        "width", G_TYPE_INT, width, "height", G_TYPE_INT, height, NULL);
+  }
+
+  capsfilter = gst_bin_get_by_name (GST_BIN (branch->bin), "caps");
+  g_object_set (capsfilter, "caps", caps, NULL);
+}
+
+static void
+_transcoder_update_max_fps (GaeulMjpegTranscoder * self)
+{
+  GHashTableIter iter;
+  gpointer value;
+  gint max_fps = 0;
+
+  g_hash_table_iter_init (&iter, self->branches);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    GaeulMjpegBranch *branch = value;
+
+    if (!(branch->request->flags & GAEUL_MJPEG_REQUEST_FLAG_KEYFRAME_ONLY)) {
+      max_fps = MAX (max_fps, _branch_get_encoded_fps (branch));
+    }
+  }
+
+  g_atomic_int_set (&self->max_fps, max_fps);
+}
+
+static GstPadProbeReturn
+_keyframe_decoder_probe_cb (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  GaeulMjpegTranscoder *self = user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+
+  /* The parser repeats the parameter sets with every IDR frame, so each
+   * keyframe can be decoded on its own. */
+  if (g_atomic_int_get (&self->n_keyframe_clients) == 0 ||
+      GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+    return GST_PAD_PROBE_DROP;
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+_decode_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  GaeulMjpegTranscoder *self = user_data;
+  GaeulMjpegDecoding *decoding = g_new (GaeulMjpegDecoding, 1);
+
+  decoding->pts = GST_BUFFER_PTS (GST_PAD_PROBE_INFO_BUFFER (info));
+  decoding->start = g_get_monotonic_time ();
+
+  g_mutex_lock (&self->stats_lock);
+  g_queue_push_tail (&self->decoding, decoding);
+  if (self->decoding.length > MJPEG_MAX_DECODING_FRAMES) {
+    g_free (g_queue_pop_head (&self->decoding));
+  }
+  g_mutex_unlock (&self->stats_lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Frames come out of the decoder in presentation order, so they are found
+ * by their timestamp. */
+static GstPadProbeReturn
+_decoded_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  GaeulMjpegTranscoder *self = user_data;
+  GstClockTime pts = GST_BUFFER_PTS (GST_PAD_PROBE_INFO_BUFFER (info));
+  GList *l = NULL;
+
+  g_mutex_lock (&self->stats_lock);
+  self->frames_decoded++;
+  for (l = self->decoding.head; l != NULL; l = l->next) {
+    GaeulMjpegDecoding *decoding = l->data;
+
+    if (decoding->pts == pts) {
+      self->decode_time += g_get_monotonic_time () - decoding->start;
+      g_free (decoding);
+      g_queue_delete_link (&self->decoding, l);
+      break;
+    }
+  }
+  g_mutex_unlock (&self->stats_lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstElement *
+_element_factory_make (const gchar * factory, const gchar * name,
+    GError ** error)
+{
+  GstElement *element = gst_element_factory_make (factory, name);
+
+  if (element == NULL) {
+    g_set_error (error, GST_CORE_ERROR, GST_CORE_ERROR_MISSING_PLUGIN,
+        "No %s element to build a transcoder with", factory);
+  }
+
+  return element;
+}
+
+/* Adds a new @factory element named @name to @bin, which owns it. */
+static GstElement *
+_bin_add_element (GstElement * bin, const gchar * factory, const gchar * name,
+    GError ** error)
+{
+  GstElement *element = _element_factory_make (factory, name, error);
+
+  if (element != NULL) {
+    gst_bin_add (GST_BIN (bin), element);
+  }
+
+  return element;
+}
+
+static void
+_bin_add_ghost_pad (GstElement * bin, GstElement * element,
+    const gchar * name)
+{
+  g_autoptr (GstPad) pad = gst_element_get_static_pad (element, name);
+
+  gst_element_add_pad (bin, gst_ghost_pad_new (name, pad));
+}
+
+/* Returns the decoder of @codec, or decodebin to find one when libav
+ * isn't there to provide it. */
+static GstElement *
+_transcoder_make_decoder (GaeulMjpegTranscoder * self,
+    const GaeulMjpegCodec * codec)
+{
+  GstElement *decoder = gst_element_factory_make (codec->decoder, NULL);
+  GObjectClass *klass = NULL;
+
+  if (decoder == NULL) {
+    g_warning ("%s is not available, autoplugging a decoder for %s",
+        codec->decoder, codec->name);
+    return gst_element_factory_make ("decodebin", NULL);
+  }
+
+  klass = G_OBJECT_GET_CLASS (decoder);
+
+  /* 0 lets libav choose from the number of cores. */
+  if (g_object_class_find_property (klass, "max-threads") != NULL) {
+    g_object_set (decoder, "max-threads",
+        g_atomic_int_get (&self->decoder_threads), NULL);
+  }
+
+  /* Frame threads hold back a frame for each thread, which slice threads
+   * don't. */
+  if (g_atomic_int_get (&self->decoder_low_latency) &&
+      g_object_class_find_property (klass, "thread-type") != NULL) {
+    gst_util_set_object_arg (G_OBJECT (decoder), "thread-type", "slice");
+  }
+
+  return decoder;
+}
+
+static void
+_decodebin_pad_added_cb (GstElement * decodebin, GstPad * pad,
+    gpointer user_data)
+{
+  GstElement *convert = user_data;
+  g_autoptr (GstPad) sinkpad = gst_element_get_static_pad (convert, "sink");
+
+  if (!gst_pad_is_linked (sinkpad)) {
+    gst_pad_link (pad, sinkpad);
+  }
+}
+
+/* Puts a decoder for the codec of the stream between @queue and @convert
+ * of @bin. Must be called with the decoder lock held. */
+static gboolean
+_transcoder_insert_decoder (GaeulMjpegTranscoder * self, GstBin * bin,
+    GstElement * queue, GstElement * convert)
+{
+  GstElement *decoder = _transcoder_make_decoder (self, self->codec);
+
+  if (decoder == NULL) {
+    g_warning ("no decoder for %s stream of (u=%s,r=%s)", self->codec->name,
+        self->uid, self->rid);
+    return FALSE;
+  }
+
+  gst_bin_add (bin, decoder);
+  gst_element_link (queue, decoder);
+
+  /* decodebin only has a source pad once it found a decoder. */
+  if (!gst_element_link (decoder, convert)) {
+    g_signal_connect (decoder, "pad-added",
+        G_CALLBACK (_decodebin_pad_added_cb), convert);
+  }
+
+  gst_element_sync_state_with_parent (decoder);
+
+  return TRUE;
+}
+
+/* Builds the parser and the decoders of @codec. Must be called with the
+ * decoder lock held. */
+static gboolean
+_transcoder_build_decode_stage (GaeulMjpegTranscoder * self,
+    const GaeulMjpegCodec * codec)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GstCaps) caps = NULL;
+  GstElement *parser = NULL;
+  GstElement *capsfilter = NULL;
+  gint64 start = g_get_monotonic_time ();
+
+  if ((parser = _element_factory_make (codec->parser, NULL, &error)) == NULL ||
+      (capsfilter = _element_factory_make ("capsfilter", NULL,
+              &error)) == NULL) {
+    g_warning ("Can't transcode %s stream of (u=%s,r=%s): %s", codec->name,
+        self->uid, self->rid, error->message);
+    if (parser != NULL) {
+      gst_object_unref (parser);
+    }
+    return FALSE;
+  }
+
+  /* The parameter sets are repeated with every IDR frame, and access units
+   * come whole, for the keyframe decoder to start from any keyframe. */
+  g_object_set (parser, "config-interval", -1, NULL);
+
+  caps = gst_caps_new_simple (codec->caps_name,
+      "stream-format", G_TYPE_STRING, "byte-stream",
+      "alignment", G_TYPE_STRING, "au", NULL);
+  g_object_set (capsfilter, "caps", caps, NULL);
+
+  /* The decoder comes first, so that nothing feeds es_tee unless the
+   * stream can be decoded, and the stage is built again for the next
+   * stream otherwise. */
+  self->codec = codec;
+  self->max_temporal_id = 0;
+  if (!_transcoder_insert_decoder (self, GST_BIN (self->pipeline),
+          self->decoder_queue, self->convert)) {
+    self->codec = NULL;
+    gst_object_unref (parser);
+    gst_object_unref (capsfilter);
+
+    g_mutex_lock (&self->stats_lock);
+    self->n_errors++;
+    g_mutex_unlock (&self->stats_lock);
+    return FALSE;
+  }
+
+  gst_bin_add_many (GST_BIN (self->pipeline), parser, capsfilter, NULL);
+  gst_element_link_many (parser, capsfilter, self->es_tee, NULL);
+
+  self->parser = gst_object_ref (parser);
+
+  if (self->keyframe_decoder != NULL) {
+    g_autoptr (GstElement) queue =
+        gst_bin_get_by_name (GST_BIN (self->keyframe_decoder), "queue");
+    g_autoptr (GstElement) convert =
+        gst_bin_get_by_name (GST_BIN (self->keyframe_decoder), "convert");
+
+    /* Only the keyframe branches go without frames. */
+    if (!_transcoder_insert_decoder (self, GST_BIN (self->keyframe_decoder),
+            queue, convert)) {
+      g_mutex_lock (&self->stats_lock);
+      self->n_errors++;
+      g_mutex_unlock (&self->stats_lock);
+    }
+  }
+
+  gst_element_sync_state_with_parent (capsfilter);
+  gst_element_sync_state_with_parent (parser);
+
+  g_mutex_lock (&self->stats_lock);
+  self->decoder_build_time = g_get_monotonic_time () - start;
+  g_mutex_unlock (&self->stats_lock);
+
+  g_debug ("Built %s decode stage for (u=%s,r=%s) in %" G_GINT64_FORMAT
+      " us", codec->name, self->uid, self->rid,
+      g_get_monotonic_time () - start);
+
+  return TRUE;
+}
+
+/* The decode stage is built for the first video stream, and the streams
+ * of the same codec that replace it, like after the source is connected
+ * again, take its place. */
+static void
+_demux_pad_added_cb (GstElement * demux, GstPad * pad, gpointer user_data)
+{
+  GaeulMjpegTranscoder *self = user_data;
+  g_autoptr (GstCaps) caps = NULL;
+  g_autoptr (GstPad) sinkpad = NULL;
+  const GaeulMjpegCodec *codec = NULL;
+
+  if ((caps = gst_pad_get_current_caps (pad)) == NULL) {
+    caps = gst_pad_query_caps (pad, NULL);
+  }
+
+  if (gst_caps_is_empty (caps)) {
+    return;
+  }
+
+  if ((codec = gaeul_mjpeg_codec_find (caps)) == NULL) {
+    g_debug ("ignoring %s stream of (u=%s,r=%s)",
+        gst_structure_get_name (gst_caps_get_structure (caps, 0)),
+        self->uid, self->rid);
+    return;
+  }
+
+  g_mutex_lock (&self->decoder_lock);
+  if (self->codec == NULL) {
+    _transcoder_build_decode_stage (self, codec);
+  }
+
+  if (self->codec == codec) {
+    sinkpad = gst_element_get_static_pad (self->parser, "sink");
+    if (!gst_pad_is_linked (sinkpad)) {
+      gst_pad_link (pad, sinkpad);
+    }
+  } else if (self->codec != NULL) {
+    g_warning ("stream of (u=%s,r=%s) changed from %s to %s, ignoring it",
+        self->uid, self->rid, self->codec->name, codec->name);
+  }
+  g_mutex_unlock (&self->decoder_lock);
+}
+
+/* Reports the remaining clients of a branch as removed, as the branch is
+ * about to be torn down, possibly after the transcoder itself is gone. */
+static void
+_branch_detach_clients (GaeulMjpegBranch * branch)
+{
+  GaeulMjpegTranscoder *transcoder = branch->transcoder;
+  g_autoptr (GaeulMjpegRequest) request = NULL;
+  GList *sockets = NULL;
+  GList *l;
+
+  g_mutex_lock (&branch->lock);
+  branch->detached = TRUE;
+  request = gaeul_mjpeg_request_ref (branch->request);
+
+  sockets = g_hash_table_get_keys (branch->clients);
+  g_list_foreach (sockets, (GFunc) g_object_ref, NULL);
+
+  if (branch->request->flags & GAEUL_MJPEG_REQUEST_FLAG_KEYFRAME_ONLY) {
+    g_atomic_int_add (&transcoder->n_keyframe_clients,
+        -g_atomic_int_get (&branch->n_clients));
+  }
+  gaeul_mjpeg_playback_forget_clients (transcoder->playback,
+      g_atomic_int_get (&branch->n_clients));
+  g_atomic_int_set (&branch->n_clients, 0);
+
+  g_hash_table_remove_all (branch->clients);
+  branch->transcoder = NULL;
+  g_mutex_unlock (&branch->lock);
+
+  for (l = sockets; l != NULL; l = l->next) {
+    g_signal_emit (transcoder, signals[SIG_CLIENT_REMOVED], 0, request,
+        l->data);
+  }
+  g_list_free_full (sockets, g_object_unref);
+}
+
+static GstPadProbeReturn
+_branch_first_frame_probe_cb (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  GaeulMjpegBranch *branch = user_data;
+  GstPadProbeReturn ret = GST_PAD_PROBE_OK;
+
+  /* Every tier has this probe, and the first frame of any of them counts. */
+  g_mutex_lock (&branch->lock);
+  if (branch->startup_latency >= 0) {
+    ret = GST_PAD_PROBE_REMOVE;
+  } else if (branch->start_time > 0) {
+    branch->startup_latency = g_get_monotonic_time () - branch->start_time;
+    ret = GST_PAD_PROBE_REMOVE;
+  }
+  g_mutex_unlock (&branch->lock);
+
+  return ret;
+}
+
+static void
+_tier_free (GaeulMjpegTier * tier)
+{
+  g_signal_handlers_disconnect_by_data (tier->sink, tier);
+
+  g_clear_object (&tier->tee_pad);
+  g_clear_object (&tier->sink);
+  g_clear_object (&tier->bin);
+
+#ifdef HAVE_TURBOJPEG
+  g_clear_pointer (&tier->transformer, tjDestroy);
+#endif
+
+  g_free (tier);
+}
+
+static void
+_branch_free (GaeulMjpegBranch * branch)
+{
+  g_clear_pointer (&branch->tiers, g_hash_table_unref);
+  g_clear_pointer (&branch->clients, g_hash_table_unref);
+  g_queue_clear_full (&branch->encoding, g_free);
+  g_clear_pointer (&branch->reference, g_free);
+  gst_caps_replace (&branch->reference_caps, NULL);
+  gst_buffer_replace (&branch->last_jpeg, NULL);
+  g_clear_object (&branch->enc_srcpad);
+  g_clear_object (&branch->enc_sinkpad);
+
+  g_clear_pointer (&branch->request, gaeul_mjpeg_request_unref);
+  g_clear_object (&branch->enc_tee);
+  g_clear_object (&branch->caps);
+  g_clear_object (&branch->rate);
+  g_clear_object (&branch->queue);
+  g_clear_object (&branch->bin);
+  g_clear_object (&branch->tee_pad);
+  g_clear_object (&branch->tee);
+  g_clear_object (&branch->pipeline);
+
+  g_mutex_clear (&branch->lock);
+
+  g_free (branch);
+}
+
+static void
+_branch_unlink (GaeulMjpegBranch * branch)
+{
+  g_autoptr (GstPad) sinkpad = gst_element_get_static_pad (branch->bin, "sink");
+
+  gst_pad_unlink (branch->tee_pad, sinkpad);
+  gst_element_release_request_pad (branch->tee, branch->tee_pad);
+}
+
+static void
+_branch_dispose (GaeulMjpegBranch * branch)
+{
+  gst_element_set_state (branch->bin, GST_STATE_NULL);
+  gst_bin_remove (GST_BIN (branch->pipeline), branch->bin);
+
+  _branch_free (branch);
+}
+
+static void
+_branch_dispose_async (GstElement * pipeline, gpointer user_data)
+{
+  _branch_dispose (user_data);
+}
+
+static GstPadProbeReturn
+_branch_unlink_probe_cb (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  GaeulMjpegBranch *branch = user_data;
+
+  _branch_unlink (branch);
+
+  /* Changing the state of the branch is not allowed from the streaming
+   * thread of the tee, so the rest of the teardown is done elsewhere. */
+  gst_element_call_async (branch->pipeline, _branch_dispose_async, branch,
+      NULL);
+
+  return GST_PAD_PROBE_REMOVE;
+}
+
+static GaeulMjpegRequest *
+_request_copy (GaeulMjpegRequest * r)
+{
+  return gaeul_mjpeg_request_new (r->uid, r->rid, r->protocol_latency,
+      r->demux_latency, r->width, r->height, r->fps, r->flip, r->orientation,
+      r->flags);
+}
+
+static void
+_detach_clients_foreach (gpointer key, GaeulMjpegBranch * branch,
+    gpointer user_data)
+{
+  _branch_detach_clients (branch);
+}
+
+static void
+gaeul_mjpeg_transcoder_dispose (GObject * object)
+{
+  GaeulMjpegTranscoder *self = GAEUL_MJPEG_TRANSCODER (object);
+
+  if (self->branches != NULL) {
+    g_hash_table_foreach (self->branches, (GHFunc) _detach_clients_foreach,
+        NULL);
+  }
+
+  if (self->pipeline != NULL) {
+    g_autoptr (GstBus) bus = gst_element_get_bus (self->pipeline);
+
+    gst_element_set_state (self->pipeline, GST_STATE_NULL);
+    gst_bus_set_sync_handler (bus, NULL, NULL, NULL);
+  }
+
+  g_clear_pointer (&self->branches, g_hash_table_unref);
+
+  g_clear_object (&self->keyframe_es_pad);
+  g_clear_object (&self->keyframe_tee);
+  g_clear_object (&self->keyframe_decoder);
+  g_clear_object (&self->parser);
+  g_clear_object (&self->tee);
+  g_clear_object (&self->convert);
+  g_clear_object (&self->decoder_queue);
+  g_clear_object (&self->es_tee);
+  g_clear_object (&self->demux);
+  g_clear_object (&self->src_queue);
+  g_clear_object (&self->src);
+  g_clear_object (&self->pipeline);
+
+  G_OBJECT_CLASS (gaeul_mjpeg_transcoder_parent_class)->dispose (object);
+}
+
+static void
+gaeul_mjpeg_transcoder_finalize (GObject * object)
+{
+  GaeulMjpegTranscoder *self = GAEUL_MJPEG_TRANSCODER (object);
+
+  g_clear_pointer (&self->relay_uri, g_free);
+  g_clear_pointer (&self->uid, g_free);
+  g_clear_pointer (&self->rid, g_free);
+
+  g_queue_clear_full (&self->decoding, g_free);
+
+  g_clear_pointer (&self->playback, gaeul_mjpeg_playback_unref);
+
+  g_mutex_clear (&self->decoder_lock);
+  g_mutex_clear (&self->stats_lock);
+
+  G_OBJECT_CLASS (gaeul_mjpeg_transcoder_parent_class)->finalize (object);
+}
+
+static void
+gaeul_mjpeg_transcoder_get_property (GObject * object,
+    guint prop_id, GValue * value, GParamSpec * pspec)
+{
+  GaeulMjpegTranscoder *self = GAEUL_MJPEG_TRANSCODER (object);
+
+  switch (prop_id) {
+    case PROP_RELAY_URI:
+      g_value_set_string (value, self->relay_uri);
+      break;
+    case PROP_UID:
+      g_value_set_string (value, self->uid);
+      break;
+    case PROP_RID:
+      g_value_set_string (value, self->rid);
+      break;
+    case PROP_PROTOCOL_LATENCY:
+      g_value_set_uint (value, self->protocol_latency);
+      break;
+    case PROP_DEMUX_LATENCY:
+      g_value_set_uint (value, self->demux_latency);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gaeul_mjpeg_transcoder_set_property (GObject * object,
+    guint prop_id, const GValue * value, GParamSpec * pspec)
+{
+  GaeulMjpegTranscoder *self = GAEUL_MJPEG_TRANSCODER (object);
+
+  switch (prop_id) {
+    case PROP_RELAY_URI:
+      g_free (self->relay_uri);
+      self->relay_uri = g_value_dup_string (value);
+      break;
+    case PROP_UID:
+      g_free (self->uid);
+      self->uid = g_value_dup_string (value);
+      break;
+    case PROP_RID:
+      g_free (self->rid);
+      self->rid = g_value_dup_string (value);
+      break;
+    case PROP_PROTOCOL_LATENCY:
+      self->protocol_latency = g_value_get_uint (value);
+      break;
+    case PROP_DEMUX_LATENCY:
+      self->demux_latency = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gaeul_mjpeg_transcoder_class_init (GaeulMjpegTranscoderClass * klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->get_property = gaeul_mjpeg_transcoder_get_property;
+  object_class->set_property = gaeul_mjpeg_transcoder_set_property;
+  object_class->dispose = gaeul_mjpeg_transcoder_dispose;
+  object_class->finalize = gaeul_mjpeg_transcoder_finalize;
+
+  properties[PROP_RELAY_URI] =
+      g_param_spec_string ("relay-uri", "relay-uri", "relay-uri", NULL,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  properties[PROP_UID] =
+      g_param_spec_string ("uid", "uid", "uid", NULL,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  properties[PROP_RID] =
+      g_param_spec_string ("rid", "rid", "rid", NULL,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  properties[PROP_PROTOCOL_LATENCY] =
+      g_param_spec_uint ("protocol-latency", "protocol-latency",
+      "protocol-latency", 0, G_MAXUINT32, 125,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  properties[PROP_DEMUX_LATENCY] =
+      g_param_spec_uint ("demux-latency", "demux-latency",
+      "The latency of tsdemux in milliseconds, 0 to measure it on the stream",
+      0, G_MAXUINT32, MJPEG_DEFAULT_DEMUX_LATENCY,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, G_N_ELEMENTS (properties),
+      properties);
+
+  signals[SIG_CLIENT_ADDED] =
+      g_signal_new ("client-added", G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL, G_TYPE_NONE, 2,
+      GAEUL_TYPE_MJPEG_REQUEST, G_TYPE_SOCKET);
+
+  signals[SIG_CLIENT_REMOVED] =
+      g_signal_new ("client-removed", G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL, G_TYPE_NONE, 2,
+      GAEUL_TYPE_MJPEG_REQUEST, G_TYPE_SOCKET);
+}
+
+static void
+gaeul_mjpeg_transcoder_init (GaeulMjpegTranscoder * self)
+{
+  g_mutex_init (&self->decoder_lock);
+  g_mutex_init (&self->stats_lock);
+
+  self->decoder_low_latency = TRUE;
+
+  self->branches =
+      g_hash_table_new_full ((GHashFunc) gaeul_mjpeg_request_hash,
+      (GEqualFunc) gaeul_mjpeg_request_equal,
+      (GDestroyNotify) gaeul_mjpeg_request_unref,
+      (GDestroyNotify) _branch_free);
+}
+
+/* Adds a new @factory element named @name to the pipeline, and returns a
+ * reference to it. */
+static GstElement *
+_transcoder_add_element (GaeulMjpegTranscoder * self, const gchar * factory,
+    const gchar * name, GError ** error)
+{
+  GstElement *element = _bin_add_element (self->pipeline, factory, name,
+      error);
+
+  return element != NULL ? gst_object_ref (element) : NULL;
+}
+
+static gboolean
+gaeul_mjpeg_transcoder_initable_init (GInitable * initable,
+    GCancellable * cancellable, GError ** error)
+{
+  GaeulMjpegTranscoder *self = GAEUL_MJPEG_TRANSCODER (initable);
+  g_autofree gchar *streamid = NULL;
+  g_autofree gchar *playback_name = NULL;
+  g_autoptr (GstPad) decoder_pad = NULL;
+  g_autoptr (GstPad) decoding_pad = NULL;
+  g_autoptr (GstPad) decoded_pad = NULL;
+  g_autoptr (GstPad) demux_pad = NULL;
+  g_autoptr (GstPad) src_pad = NULL;
+  g_autoptr (GstBus) bus = NULL;
+  guint demux_latency = self->demux_latency;
+
+  if (self->relay_uri == NULL || self->uid == NULL || self->rid == NULL) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+        "relay-uri, uid and rid are required to build a transcoder");
+    return FALSE;
+  }
+
+  if (demux_latency == 0) {
+    demux_latency = MJPEG_DEFAULT_DEMUX_LATENCY;
+  }
+
+  /* The parser and the decoders are only added once tsdemux finds the
+   * codec of the stream. */
+  self->pipeline = gst_object_ref_sink (gst_pipeline_new (NULL));
+  playback_name = g_strdup_printf ("(u=%s,r=%s)", self->uid, self->rid);
+  self->playback = gaeul_mjpeg_playback_new (self->pipeline, playback_name);
+
+  if ((self->src = _transcoder_add_element (self, "srtsrc", "src",
+              error)) == NULL ||
+      (self->src_queue = _transcoder_add_element (self, "queue",
+              "src_queue", error)) == NULL ||
+      (self->demux = _transcoder_add_element (self, "tsdemux", "demux",
+              error)) == NULL ||
+      (self->es_tee = _transcoder_add_element (self, "tee", "es_tee",
+              error)) == NULL ||
+      (self->decoder_queue = _transcoder_add_element (self, "queue",
+              "decoder_queue", error)) == NULL ||
+      (self->convert = _transcoder_add_element (self, "videoconvert",
+              "convert", error)) == NULL ||
+      (self->tee = _transcoder_add_element (self, "tee", "tee",
+              error)) == NULL) {
+    return FALSE;
+  }
+
+  g_object_set (self->src, "uri", self->relay_uri, "latency",
+      self->protocol_latency, NULL);
+  g_object_set (self->demux, "latency", demux_latency, NULL);
+  g_object_set (self->es_tee, "allow-not-linked", TRUE, NULL);
+  g_object_set (self->tee, "allow-not-linked", TRUE, NULL);
+
+  if (!gst_element_link_many (self->src, self->src_queue, self->demux,
+          NULL) || !gst_element_link (self->es_tee, self->decoder_queue) ||
+      !gst_element_link (self->convert, self->tee)) {
+    g_set_error (error, GST_CORE_ERROR, GST_CORE_ERROR_NEGOTIATION,
+        "Failed to link transcoding pipeline for (u=%s,r=%s)", self->uid,
+        self->rid);
+    return FALSE;
+  }
+
+  g_signal_connect (self->demux, "pad-added",
+      G_CALLBACK (_demux_pad_added_cb), self);
+
+  /* The transcoder is built and disposed away from the main context, so
+   * the messages are handled in the threads posting them. */
+  bus = gst_element_get_bus (self->pipeline);
+  gst_bus_set_sync_handler (bus, _transcoder_bus_sync_handler, self, NULL);
+
+  src_pad = gst_element_get_static_pad (self->src, "src");
+  gst_pad_add_probe (src_pad, GST_PAD_PROBE_TYPE_BUFFER |
+      GST_PAD_PROBE_TYPE_BUFFER_LIST | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+      _src_probe_cb, self, NULL);
+  g_signal_connect (self->src_queue, "overrun",
+      G_CALLBACK (_src_queue_overrun_cb), self);
+
+  self->decoder_needs_keyframe = TRUE;
+  decoder_pad = gst_element_get_static_pad (self->decoder_queue, "sink");
+  gst_pad_add_probe (decoder_pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+      _decoder_probe_cb, self, NULL);
+
+  decoding_pad = gst_element_get_static_pad (self->decoder_queue, "src");
+  gst_pad_add_probe (decoding_pad, GST_PAD_PROBE_TYPE_BUFFER,
+      _decode_probe_cb, self, NULL);
+  decoded_pad = gst_element_get_static_pad (self->convert, "sink");
+  gst_pad_add_probe (decoded_pad, GST_PAD_PROBE_TYPE_BUFFER,
+      _decoded_probe_cb, self, NULL);
+
+  self->current_demux_latency = demux_latency;
+  if (self->demux_latency == 0) {
+    self->pcr_pid = TS_NULL_PID;
+    self->last_pcr = GST_CLOCK_TIME_NONE;
+
+    demux_pad = gst_element_get_static_pad (self->demux, "sink");
+    gst_pad_add_probe (demux_pad, GST_PAD_PROBE_TYPE_BUFFER,
+        _demux_pcr_probe_cb, self, NULL);
+  }
+
+  streamid = g_strdup_printf ("#!::u=%s,r=%s", self->uid, self->rid);
+  g_object_set (self->src, "streamid", streamid, NULL);
+
+  g_debug ("Created transcoding pipeline for (%s)", streamid);
+
+  gst_element_set_state (self->pipeline, GST_STATE_READY);
+
+  return TRUE;
+}
+
+static void
+gaeul_mjpeg_transcoder_initable_iface_init (GInitableIface * iface)
+{
+  iface->init = gaeul_mjpeg_transcoder_initable_init;
+}
+
+GaeulMjpegTranscoder *
+gaeul_mjpeg_transcoder_new (const gchar * relay_uri, const gchar * uid,
+    const gchar * rid, guint protocol_latency, guint demux_latency,
+    GError ** error)
+{
+  g_return_val_if_fail (relay_uri != NULL, NULL);
+  g_return_val_if_fail (uid != NULL, NULL);
+  g_return_val_if_fail (rid != NULL, NULL);
+
+  return g_initable_new (GAEUL_TYPE_MJPEG_TRANSCODER, NULL, error,
+      "relay-uri", relay_uri, "uid", uid, "rid", rid,
+      "protocol-latency", protocol_latency, "demux-latency", demux_latency,
+      NULL);
+}
+
+void
+gaeul_mjpeg_transcoder_new_async (const gchar * relay_uri, const gchar * uid,
+    const gchar * rid, guint protocol_latency, guint demux_latency,
+    GCancellable * cancellable, GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+  g_return_if_fail (relay_uri != NULL);
+  g_return_if_fail (uid != NULL);
+  g_return_if_fail (rid != NULL);
+
+  g_async_initable_new_async (GAEUL_TYPE_MJPEG_TRANSCODER, G_PRIORITY_DEFAULT,
+      cancellable, callback, user_data,
+      "relay-uri", relay_uri, "uid", uid, "rid", rid,
+      "protocol-latency", protocol_latency, "demux-latency", demux_latency,
+      NULL);
+}
+
+GaeulMjpegTranscoder *
+gaeul_mjpeg_transcoder_new_finish (GAsyncResult * result, GError ** error)
+{
+  g_autoptr (GObject) source = g_async_result_get_source_object (result);
+
+  return GAEUL_MJPEG_TRANSCODER (g_async_initable_new_finish
+      (G_ASYNC_INITABLE (source), result, error));
+}
+
+static gboolean
+_transcoder_ensure_keyframe_decoder (GaeulMjpegTranscoder * self,
+    GError ** error)
+{
+  g_autoptr (GstPad) sinkpad = NULL;
+  g_autoptr (GstElement) decoder = NULL;
+  g_autoptr (GstElement) tee = NULL;
+  GstElement *queue = NULL;
+  GstElement *convert = NULL;
+  gboolean inserted = TRUE;
+
+  if (self->keyframe_decoder != NULL) {
+    return TRUE;
+  }
+
+  decoder = gst_object_ref_sink (gst_bin_new ("keyframe_decoder"));
+  if ((queue = _bin_add_element (decoder, "queue", "queue", error)) == NULL ||
+      (convert = _bin_add_element (decoder, "videoconvert", "convert",
+              error)) == NULL ||
+      (tee = _element_factory_make ("tee", "keyframe_tee", error)) == NULL) {
+    return FALSE;
+  }
+  _bin_add_ghost_pad (decoder, queue, "sink");
+  _bin_add_ghost_pad (decoder, convert, "src");
+
+  gst_object_ref_sink (tee);
+  g_object_set (tee, "allow-not-linked", TRUE, NULL);
+
+  /* The decoder itself joins the queue and videoconvert once the codec
+   * is known. */
+  g_mutex_lock (&self->decoder_lock);
+  if (self->codec != NULL) {
+    inserted = _transcoder_insert_decoder (self, GST_BIN (decoder), queue,
+        convert);
+  }
+  if (inserted) {
+    self->keyframe_decoder = g_steal_pointer (&decoder);
+    self->keyframe_tee = g_steal_pointer (&tee);
+  }
+  g_mutex_unlock (&self->decoder_lock);
+
+  if (!inserted) {
+    g_set_error (error, GST_CORE_ERROR, GST_CORE_ERROR_MISSING_PLUGIN,
+        "No decoder for the %s stream of (u=%s,r=%s)", self->codec->name,
+        self->uid, self->rid);
+    return FALSE;
+  }
+
+  gst_bin_add_many (GST_BIN (self->pipeline), self->keyframe_decoder,
+      self->keyframe_tee, NULL);
+  gst_element_link (self->keyframe_decoder, self->keyframe_tee);
+
+  /* The decoder is brought up before it is linked, as a keyframe reaching
+   * it while it is still flushing would make the tee return FLUSHING to
+   * the demuxer. */
+  gst_element_sync_state_with_parent (self->keyframe_tee);
+  gst_element_sync_state_with_parent (self->keyframe_decoder);
+
+  self->keyframe_es_pad = gst_element_get_request_pad (self->es_tee, "src_%u");
+  gst_pad_add_probe (self->keyframe_es_pad, GST_PAD_PROBE_TYPE_BUFFER,
+      _keyframe_decoder_probe_cb, self, NULL);
+
+  sinkpad = gst_element_get_static_pad (self->keyframe_decoder, "sink");
+  gst_pad_link (self->keyframe_es_pad, sinkpad);
+
+  g_debug ("Added keyframe decoder for (u=%s,r=%s)", self->uid, self->rid);
+
+  return TRUE;
+}
+
+#ifdef HAVE_TURBOJPEG
+static GstBuffer *
+_tier_transform (GaeulMjpegTier * tier, GstBuffer * buffer)
+{
+  tjtransform transform = { 0, };
+  GstBuffer *transformed = NULL;
+  GstMapInfo map;
+  unsigned char *data = NULL;
+  unsigned long size = 0;
+
+  if (!gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+    return NULL;
+  }
+
+  /* Only requests of whole MCUs get here, and partial MCUs, which can't be
+   * moved without decoding, fail rather than being cut off. */
+  transform.op = tier_transforms[tier->direction];
+  transform.options = TJXOPT_PERFECT;
+
+  if (tjTransform (tier->transformer, map.data, map.size, 1, &data, &size,
+          &transform, 0) < 0) {
+    g_debug ("Failed to transform JPEG: %s",
+        tjGetErrorStr2 (tier->transformer));
+    gst_buffer_unmap (buffer, &map);
+    tjFree (data);
+    return NULL;
+  }
+
+  gst_buffer_unmap (buffer, &map);
+
+  transformed = gst_buffer_new_wrapped_full (0, data, size, 0, size, data,
+      (GDestroyNotify) tjFree);
+  gst_buffer_copy_into (transformed, buffer, GST_BUFFER_COPY_METADATA, 0, -1);
+
+  return transformed;
+}
+#endif
+
+/* Sends a frame whenever its timestamp reaches the next slot of the tier,
+ * so that a tier gets its frame rate whatever the rate of the encoder. */
+static GstPadProbeReturn
+_tier_probe_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  GaeulMjpegTier *tier = user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstClockTime pts = GST_BUFFER_PTS (buffer);
+
+  if (tier->period > 0 && GST_CLOCK_TIME_IS_VALID (pts)) {
+    GstClockTime slack = tier->period / 8;
+
+    if (GST_CLOCK_TIME_IS_VALID (tier->next_pts) &&
+        pts + slack < tier->next_pts &&
+        pts + 2 * tier->period > tier->next_pts) {
+      return GST_PAD_PROBE_DROP;
+    }
+
+    /* The slots start over when the timestamps jump. */
+    if (GST_CLOCK_TIME_IS_VALID (tier->next_pts) &&
+        pts + slack >= tier->next_pts &&
+        pts < tier->next_pts + tier->period) {
+      tier->next_pts += tier->period;
+    } else {
+      tier->next_pts = pts + tier->period;
+    }
+  }
+
+#ifdef HAVE_TURBOJPEG
+  if (tier->transformer != NULL) {
+    GstBuffer *transformed = _tier_transform (tier, buffer);
+
+    if (transformed == NULL) {
+      return GST_PAD_PROBE_DROP;
+    }
+
+    gst_buffer_unref (buffer);
+    GST_PAD_PROBE_INFO_DATA (info) = buffer = transformed;
+  }
+#endif
+
+  g_mutex_lock (&tier->branch->lock);
+  tier->bytes_pushed += gst_buffer_get_size (buffer);
+  g_mutex_unlock (&tier->branch->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Returns the tier of @branch sending @fps frames per second in
+ * @direction, which is created on first use. Must be called from the main
+ * thread while the branch is attached to its transcoder. */
+static GaeulMjpegTier *
+_branch_ensure_tier (GaeulMjpegBranch * branch, gint fps, guint direction,
+    GError ** error)
+{
+  g_autoptr (GError) internal_error = NULL;
+  g_autofree gchar *tier_desc = NULL;
+  g_autoptr (GstElement) mux = NULL;
+  g_autoptr (GstPad) mux_pad = NULL;
+  g_autoptr (GstPad) sinkpad = NULL;
+  g_autoptr (GstPad) sink_sinkpad = NULL;
+  GaeulMjpegTranscoder *transcoder = branch->transcoder;
+  GaeulMjpegTier *tier = NULL;
+  GstElement *bin = NULL;
+
+  if ((tier = g_hash_table_lookup (branch->tiers,
+              TIER_KEY (fps, direction))) != NULL) {
+    return tier;
+  }
+
+  tier_desc = g_strdup_printf (GST_MJPEG_TIER_DESC, MJPEG_LAST_FRAME_BUFFERS);
+  bin = gst_parse_bin_from_description (tier_desc, FALSE, &internal_error);
+
+  if (internal_error != NULL) {
+    g_clear_object (&bin);
+    g_propagate_error (error, g_steal_pointer (&internal_error));
+    return NULL;
+  }
+
+  tier = g_new0 (GaeulMjpegTier, 1);
+  tier->branch = branch;
+  tier->fps = fps;
+  tier->period = fps > 0 ? GST_SECOND / fps : 0;
+  tier->next_pts = GST_CLOCK_TIME_NONE;
+  tier->direction = direction;
+#ifdef HAVE_TURBOJPEG
+  if (direction != 0) {
+    tier->transformer = tjInitTransform ();
+  }
+#endif
+  tier->bin = gst_object_ref_sink (bin);
+  tier->sink = gst_bin_get_by_name (GST_BIN (tier->bin), "msocksink");
+
+  /* multipartmux only has request pads, which are not ghosted by the
+   * parser. */
+  mux = gst_bin_get_by_name (GST_BIN (tier->bin), "mux");
+  mux_pad = gst_element_get_request_pad (mux, "sink_%u");
+  gst_element_add_pad (tier->bin, gst_ghost_pad_new ("sink", mux_pad));
+
+  _sink_set_slow_client_policy (tier->sink, transcoder->slow_client_policy,
+      transcoder->max_queued_bytes, transcoder->max_queued_frames);
+
+  g_signal_connect (tier->sink, "client-added",
+      G_CALLBACK (_tier_client_added_cb), tier);
+  g_signal_connect (tier->sink, "client-removed",
+      G_CALLBACK (_tier_client_removed_cb), tier);
+
+  sink_sinkpad = gst_element_get_static_pad (tier->sink, "sink");
+  gst_pad_add_probe (sink_sinkpad, GST_PAD_PROBE_TYPE_BUFFER,
+      _branch_first_frame_probe_cb, branch, NULL);
+
+  gst_bin_add (GST_BIN (branch->bin), tier->bin);
+
+  tier->tee_pad = gst_element_get_request_pad (branch->enc_tee, "src_%u");
+  gst_pad_add_probe (tier->tee_pad, GST_PAD_PROBE_TYPE_BUFFER,
+      _tier_probe_cb, tier, NULL);
+  sinkpad = gst_element_get_static_pad (tier->bin, "sink");
+
+  if (gst_pad_link (tier->tee_pad, sinkpad) != GST_PAD_LINK_OK) {
+    g_set_error (error, GST_CORE_ERROR, GST_CORE_ERROR_NEGOTIATION,
+        "Failed to link tier (%d fps)", fps);
+    gst_element_release_request_pad (branch->enc_tee, tier->tee_pad);
+    gst_bin_remove (GST_BIN (branch->bin), tier->bin);
+    _tier_free (tier);
+    return NULL;
+  }
+
+  gst_element_sync_state_with_parent (tier->bin);
+
+  g_debug ("Added %d fps tier in direction %u for (u=%s,r=%s) %dx%d", fps,
+      direction, transcoder->uid, transcoder->rid, branch->request->width,
+      branch->request->height);
+
+  g_hash_table_insert (branch->tiers, TIER_KEY (fps, direction), tier);
+
+  return tier;
+}
+
+/* The tiers flip and rotate the JPEGs of the requests that allow it, so
+ * that such requests share the branch of their size. */
+static guint
+_request_get_tier_direction (GaeulMjpegRequest * request)
+{
+  if (gaeul_mjpeg_request_has_lossless_direction (request)) {
+    return gaeul_mjpeg_request_get_video_direction (request);
+  }
+
+  return 0;
+}
+
+static void
+_request_get_branch_directions (GaeulMjpegRequest * request, guint * flip,
+    guint * orientation)
+{
+  if (gaeul_mjpeg_request_has_lossless_direction (request)) {
+    *flip = 0;
+    *orientation = 0;
+  } else {
+    *flip = request->flip;
+    *orientation = request->orientation;
+  }
+}
+
+/* Frames are sent at the rate each client asked for, so the branch only
+ * has to encode at the highest of them. */
+static void
+_branch_set_fps (GaeulMjpegBranch * branch, gint fps)
+{
+  if (branch->caps == NULL || fps <= branch->fps) {
+    return;
+  }
+
+  branch->fps = fps;
+  _branch_update_caps (branch);
+}
+
+/* Requests that only differ in frame rate share a branch, which encodes
+ * at the highest frame rate asked for. */
+gboolean
+gaeul_mjpeg_transcoder_add_branch (GaeulMjpegTranscoder * self,
+    GaeulMjpegRequest * request, GError ** error)
+{
+  g_autoptr (GError) internal_error = NULL;
+  g_autoptr (GstPad) sinkpad = NULL;
+  g_autofree gchar *branch_desc = NULL;
+  g_autoptr (GstElement) enc = NULL;
+  GaeulMjpegBranch *branch = NULL;
+  GstElement *bin = NULL;
+  GstElement *tee = NULL;
+  const gchar *parallel_encoder = NULL;
+  guint n_threads = 0;
+  guint flip = 0;
+  guint orientation = 0;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), FALSE);
+  g_return_val_if_fail (request != NULL, FALSE);
+
+  if ((branch = g_hash_table_lookup (self->branches, request)) != NULL) {
+    if (request->fps > branch->fps) {
+      g_debug ("Raising transcoding branch for (u=%s,r=%s) %dx%d to %d fps",
+          self->uid, self->rid, request->width, request->height, request->fps);
+      _branch_set_fps (branch, request->fps);
+      _transcoder_update_max_fps (self);
+    }
+    return TRUE;
+  }
+
+  _request_get_branch_directions (request, &flip, &orientation);
+
+  if (request->flags & GAEUL_MJPEG_REQUEST_FLAG_KEYFRAME_ONLY) {
+    if (!_transcoder_ensure_keyframe_decoder (self, error)) {
+      return FALSE;
+    }
+
+    tee = self->keyframe_tee;
+    branch_desc = g_strdup_printf (GST_MJPEG_KEYFRAME_BRANCH_DESC,
+        request->width, request->height, flip, orientation);
+  } else {
+    tee = self->tee;
+    n_threads = g_atomic_int_get (&self->encoder_threads);
+    parallel_encoder = _get_parallel_encoder (n_threads);
+    branch_desc = g_strdup_printf (GST_MJPEG_BRANCH_DESC,
+        (guint64) MJPEG_MAX_DUPLICATION_TIME, request->fps, request->width,
+        request->height, flip, orientation,
+        parallel_encoder != NULL ? parallel_encoder : "jpegenc");
+  }
+
+  bin = gst_parse_bin_from_description (branch_desc, TRUE, &internal_error);
+
+  if (internal_error != NULL) {
+    g_clear_object (&bin);
+    g_propagate_error (error, g_steal_pointer (&internal_error));
+    return FALSE;
+  }
+
+  branch = g_new0 (GaeulMjpegBranch, 1);
+  g_mutex_init (&branch->lock);
+  branch->startup_latency = -1;
+  branch->clients = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) _client_free);
+  branch->tiers = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) _tier_free);
+
+  /* The branch keeps its own copy so that it never extends the lifetime
+   * of the request the caller is tracking sessions with. */
+  branch->request = _request_copy (request);
+  branch->transcoder = self;
+  branch->fps = request->fps;
+  branch->pipeline = gst_object_ref (self->pipeline);
+  branch->tee = gst_object_ref (tee);
+  branch->bin = gst_object_ref_sink (bin);
+  branch->queue = gst_bin_get_by_name (GST_BIN (branch->bin), "queue");
+  branch->rate = gst_bin_get_by_name (GST_BIN (branch->bin), "rate");
+  branch->enc_tee = gst_bin_get_by_name (GST_BIN (branch->bin), "enc_tee");
+
+  if (!(request->flags & GAEUL_MJPEG_REQUEST_FLAG_KEYFRAME_ONLY)) {
+    branch->caps = gst_bin_get_by_name (GST_BIN (branch->bin), "caps");
+  }
+
+  g_signal_connect (branch->queue, "overrun",
+      G_CALLBACK (_branch_queue_overrun_cb), branch);
+  _branch_set_queue_max_time (branch,
+      g_atomic_int_get (&self->queue_max_time));
+
+  enc = gst_bin_get_by_name (GST_BIN (branch->bin), "enc");
+  if (parallel_encoder != NULL) {
+    _encoder_set_threads (enc, n_threads);
+  }
+
+  branch->enc_sinkpad = gst_element_get_static_pad (enc, "sink");
+  gst_pad_add_probe (branch->enc_sinkpad, GST_PAD_PROBE_TYPE_BUFFER,
+      _branch_encode_probe_cb, branch, NULL);
+  branch->static_threshold = g_atomic_int_get (&self->static_threshold);
+  branch->enc_srcpad = gst_element_get_static_pad (enc, "src");
+  gst_pad_add_probe (branch->enc_srcpad, GST_PAD_PROBE_TYPE_BUFFER,
+      _branch_encoded_probe_cb, branch, NULL);
+
+  gst_bin_add (GST_BIN (self->pipeline), branch->bin);
+
+  branch->tee_pad = gst_element_get_request_pad (branch->tee, "src_%u");
+  gst_pad_add_probe (branch->tee_pad, GST_PAD_PROBE_TYPE_BUFFER,
+      _branch_drop_probe_cb, branch, NULL);
+  sinkpad = gst_element_get_static_pad (branch->bin, "sink");
+
+  if (gst_pad_link (branch->tee_pad, sinkpad) != GST_PAD_LINK_OK) {
+    g_set_error (error, GST_CORE_ERROR, GST_CORE_ERROR_NEGOTIATION,
+        "Failed to link transcoding branch (%dx%d@%d)", request->width,
+        request->height, request->fps);
+    gst_element_release_request_pad (branch->tee, branch->tee_pad);
+    _branch_dispose (branch);
+    return FALSE;
+  }
+
+  gst_element_sync_state_with_parent (branch->bin);
+
+  g_debug ("Added transcoding branch for (u=%s,r=%s) %dx%d@%d", self->uid,
+      self->rid, request->width, request->height, request->fps);
+
+  g_hash_table_insert (self->branches, gaeul_mjpeg_request_ref
+      (branch->request), branch);
+  _transcoder_update_max_fps (self);
+
+  return TRUE;
+}
+
+void
+gaeul_mjpeg_transcoder_remove_branch (GaeulMjpegTranscoder * self,
+    GaeulMjpegRequest * request)
+{
+  g_autoptr (GstPad) tee_pad = NULL;
+  gpointer key = NULL;
+  GaeulMjpegBranch *branch = NULL;
+
+  g_return_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self));
+  g_return_if_fail (request != NULL);
+
+  if (!g_hash_table_lookup_extended (self->branches, request, &key,
+          (gpointer *) & branch)) {
+    return;
+  }
+
+  g_hash_table_steal (self->branches, key);
+  gaeul_mjpeg_request_unref (key);
+  _transcoder_update_max_fps (self);
+
+  /* The branch may be the one that was waiting for its first client. */
+  gaeul_mjpeg_playback_stop_preroll (self->playback);
+
+  g_debug ("Removing transcoding branch for (u=%s,r=%s) %dx%d@%d", self->uid,
+      self->rid, request->width, request->height, request->fps);
+
+  self->bytes_sent += _branch_get_bytes_sent (branch);
+
+  _branch_detach_clients (branch);
+
+  if (g_hash_table_size (self->branches) == 0) {
+    /* Nothing is left to feed, so the whole pipeline can be stopped
+     * before the branch is torn down synchronously. */
+    gst_element_set_state (self->pipeline, GST_STATE_NULL);
+    _branch_unlink (branch);
+    _branch_dispose (branch);
+    return;
+  }
+
+  gaeul_mjpeg_playback_pause_if_unused (self->playback);
+
+  tee_pad = gst_object_ref (branch->tee_pad);
+  gst_pad_add_probe (tee_pad, GST_PAD_PROBE_TYPE_IDLE,
+      _branch_unlink_probe_cb, branch, NULL);
+}
+
+static void _branch_move_client (GaeulMjpegBranch * branch,
+    GSocket * socket, gint fps, guint direction);
+
+/* Reconfigures the branch of @request in place to the output of @update,
+ * which may only differ in size, frame rate and video directions. The
+ * capsfilter and videoflip elements renegotiate on the next frame, so the
+ * HTTP clients of the branch stay attached. */
+gboolean
+gaeul_mjpeg_transcoder_update_branch (GaeulMjpegTranscoder * self,
+    GaeulMjpegRequest * request, GaeulMjpegRequest * update, GError ** error)
+{
+  g_autoptr (GaeulMjpegRequest) old = NULL;
+  g_autoptr (GstElement) flip = NULL;
+  g_autoptr (GstElement) orientation = NULL;
+  GaeulMjpegBranch *branch = NULL;
+  GaeulMjpegBranch *other = NULL;
+  gpointer key = NULL;
+  gboolean keyframe_only = FALSE;
+  guint flip_direction = 0;
+  guint orientation_direction = 0;
+  guint direction = 0;
+  GList *sockets = NULL;
+  GList *l = NULL;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), FALSE);
+  g_return_val_if_fail (request != NULL, FALSE);
+  g_return_val_if_fail (update != NULL, FALSE);
+  g_return_val_if_fail (update->flags == request->flags, FALSE);
+
+  if (!g_hash_table_lookup_extended (self->branches, request, &key,
+          (gpointer *) & branch)) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+        "No transcoding branch (%dx%d@%d)", request->width, request->height,
+        request->fps);
+    return FALSE;
+  }
+
+  if ((other = g_hash_table_lookup (self->branches, update)) != NULL &&
+      other != branch) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+        "Transcoding branch (%dx%d@%d) already exists", update->width,
+        update->height, update->fps);
+    return FALSE;
+  }
+
+  keyframe_only = (request->flags & GAEUL_MJPEG_REQUEST_FLAG_KEYFRAME_ONLY);
+
+  flip = gst_bin_get_by_name (GST_BIN (branch->bin), "flip");
+  orientation = gst_bin_get_by_name (GST_BIN (branch->bin), "orientation");
+
+  _request_get_branch_directions (update, &flip_direction,
+      &orientation_direction);
+
+  g_object_set (flip, "video-direction", flip_direction, NULL);
+  g_object_set (orientation, "video-direction", orientation_direction, NULL);
+
+  g_debug ("Updated transcoding branch for (u=%s,r=%s) %dx%d@%d to %dx%d@%d",
+      self->uid, self->rid, request->width, request->height, request->fps,
+      update->width, update->height, update->fps);
+
+  g_hash_table_steal (self->branches, key);
+  gaeul_mjpeg_request_unref (key);
+
+  /* The client signals take a reference to the request of the branch
+   * under its lock, from the streaming threads. */
+  g_mutex_lock (&branch->lock);
+  old = branch->request;
+  branch->request = _request_copy (update);
+  g_mutex_unlock (&branch->lock);
+
+  g_hash_table_insert (self->branches, gaeul_mjpeg_request_ref
+      (branch->request), branch);
+
+  if (!keyframe_only) {
+    branch->fps = update->fps;
+    _transcoder_update_max_fps (self);
+  }
+
+  /* The branch stays as degraded as it was. */
+  _branch_update_caps (branch);
+
+  direction = _request_get_tier_direction (update);
+
+  /* The clients asked for the old frame rate and direction. Those that
+   * were slowed down keep their frame rate, unless it is above the new
+   * one. */
+  sockets = _branch_get_client_sockets (branch);
+
+  for (l = sockets; l != NULL; l = l->next) {
+    GaeulMjpegClient *client = NULL;
+    gboolean move = FALSE;
+    gint fps = 0;
+
+    g_mutex_lock (&branch->lock);
+    if ((client = g_hash_table_lookup (branch->clients, l->data)) != NULL) {
+      fps = client->tier->fps;
+      if (!keyframe_only) {
+        if (fps >= client->fps || fps > update->fps) {
+          fps = update->fps;
+        }
+        client->fps = update->fps;
+        client->n_steady = 0;
+      }
+      move = fps != client->tier->fps || direction != client->tier->direction;
+    }
+    g_mutex_unlock (&branch->lock);
+
+    if (move) {
+      _branch_move_client (branch, l->data, fps, direction);
+    }
+  }
+
+  g_list_free_full (sockets, g_object_unref);
+
+  return TRUE;
+}
+
+guint
+gaeul_mjpeg_transcoder_get_n_branches (GaeulMjpegTranscoder * self)
+{
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), 0);
+
+  return g_hash_table_size (self->branches);
+}
+
+gboolean
+gaeul_mjpeg_transcoder_add_client (GaeulMjpegTranscoder * self,
+    GaeulMjpegRequest * request, GSocket * socket)
+{
+  g_autoptr (GError) error = NULL;
+  GaeulMjpegBranch *branch = NULL;
+  GaeulMjpegTier *tier = NULL;
+  gint fps = 0;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), FALSE);
+  g_return_val_if_fail (request != NULL, FALSE);
+  g_return_val_if_fail (G_IS_SOCKET (socket), FALSE);
+
+  if ((branch = g_hash_table_lookup (self->branches, request)) == NULL) {
+    return FALSE;
+  }
+
+  /* Clients start at the frame rate of their own request. */
+  if (!(request->flags & GAEUL_MJPEG_REQUEST_FLAG_KEYFRAME_ONLY)) {
+    fps = request->fps;
+  }
+
+  if ((tier = _branch_ensure_tier (branch, fps,
+              _request_get_tier_direction (request), &error)) == NULL) {
+    g_warning ("Failed to add client: %s", error->message);
+    return FALSE;
+  }
+
+  g_signal_emit_by_name (tier->sink, "add", socket);
+
+  return TRUE;
+}
+
+static void
+_transcoder_resume (gpointer user_data)
+{
+  GaeulMjpegTranscoder *self = user_data;
+
+  /* The time spent paused doesn't count as a stall. */
+  g_mutex_lock (&self->stats_lock);
+  self->last_input_time = g_get_monotonic_time ();
+  g_mutex_unlock (&self->stats_lock);
+  self->stalled = FALSE;
+}
+
+void
+gaeul_mjpeg_transcoder_play (GaeulMjpegTranscoder * self)
+{
+  g_return_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self));
+
+  gaeul_mjpeg_playback_play (self->playback, _transcoder_resume, self);
+}
+
+/* Starts streaming ahead of the first client, so that the SRT connection,
+ * the demuxer and the decoder are up by the time it arrives. Frames are
+ * decoded without clients until one is added or a branch is removed. */
+void
+gaeul_mjpeg_transcoder_preroll (GaeulMjpegTranscoder * self)
+{
+  g_return_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self));
+
+  gaeul_mjpeg_playback_preroll (self->playback, _transcoder_resume, self);
+}
+
+/* Gives up streaming ahead of the first client, pausing the pipeline if
+ * nobody is watching. */
+void
+gaeul_mjpeg_transcoder_stop_preroll (GaeulMjpegTranscoder * self)
+{
+  g_return_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self));
+
+  if (gaeul_mjpeg_playback_stop_preroll (self->playback)) {
+    gaeul_mjpeg_playback_pause_if_unused (self->playback);
+  }
+}
+
+gint64
+gaeul_mjpeg_transcoder_get_startup_latency (GaeulMjpegTranscoder * self,
+    GaeulMjpegRequest * request)
+{
+  GaeulMjpegBranch *branch = NULL;
+  gint64 startup_latency = -1;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), -1);
+  g_return_val_if_fail (request != NULL, -1);
+
+  if ((branch = g_hash_table_lookup (self->branches, request)) != NULL) {
+    g_mutex_lock (&branch->lock);
+    startup_latency = branch->startup_latency;
+    g_mutex_unlock (&branch->lock);
+  }
+
+  return startup_latency;
+}
+
+guint
+gaeul_mjpeg_transcoder_get_n_clients (GaeulMjpegTranscoder * self)
+{
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), 0);
+
+  return gaeul_mjpeg_playback_get_n_clients (self->playback);
+}
+
+guint64
+gaeul_mjpeg_transcoder_get_bytes_received (GaeulMjpegTranscoder * self)
+{
+  g_autoptr (GstStructure) s = NULL;
+  guint64 srt_received = 0;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), 0);
+
+  g_object_get (self->src, "stats", &s, NULL);
+
+  if (s != NULL) {
+    gst_structure_get_uint64 (s, "bytes-received-total", &srt_received);
+  }
+
+  return srt_received;
+}
+
+/* Returns the latency of tsdemux in milliseconds, which follows the PCR
+ * interval of the stream when demux-latency is 0. */
+guint
+gaeul_mjpeg_transcoder_get_demux_latency (GaeulMjpegTranscoder * self)
+{
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), 0);
+
+  return g_atomic_int_get (&self->current_demux_latency);
+}
+
+guint64
+gaeul_mjpeg_transcoder_get_bytes_sent (GaeulMjpegTranscoder * self)
+{
+  GHashTableIter iter;
+  gpointer value;
+  guint64 http_sent = 0;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), 0);
+
+  http_sent = self->bytes_sent;
+
+  g_hash_table_iter_init (&iter, self->branches);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    http_sent += _branch_get_bytes_sent (value);
+  }
+
+  return http_sent;
+}
+
+gboolean
+gaeul_mjpeg_transcoder_get_branch_stats (GaeulMjpegTranscoder * self,
+    GaeulMjpegRequest * request, GaeulMjpegBranchStats * stats)
+{
+  GaeulMjpegBranch *branch = NULL;
+  guint64 rate_dropped = 0;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), FALSE);
+  g_return_val_if_fail (request != NULL, FALSE);
+  g_return_val_if_fail (stats != NULL, FALSE);
+
+  if ((branch = g_hash_table_lookup (self->branches, request)) == NULL) {
+    return FALSE;
+  }
+
+  if (branch->rate != NULL) {
+    g_object_get (branch->rate, "drop", &rate_dropped, NULL);
+  }
+
+  stats->n_clients = g_atomic_int_get (&branch->n_clients);
+  stats->bytes_sent = _branch_get_bytes_sent (branch);
+
+  g_mutex_lock (&branch->lock);
+  stats->frames_encoded = branch->frames_encoded;
+  stats->encode_time = branch->frames_encoded > 0 ?
+      branch->encode_time / branch->frames_encoded : 0;
+  stats->frames_dropped = branch->frames_dropped + rate_dropped;
+  stats->frames_repeated = branch->frames_repeated;
+  g_mutex_unlock (&branch->lock);
+
+  stats->degradation = branch->degradation;
+
+  return TRUE;
+}
+
+static void
+_client_stats_clear (GaeulMjpegClientStats * stats)
+{
+  g_clear_pointer (&stats->address, g_free);
+}
+
+/* Returns an array of GaeulMjpegClientStats, one for each client of the
+ * branch serving @request, or %NULL when there is no such branch. */
+GArray *
+gaeul_mjpeg_transcoder_get_client_stats (GaeulMjpegTranscoder * self,
+    GaeulMjpegRequest * request)
+{
+  GaeulMjpegBranch *branch = NULL;
+  GArray *clients = NULL;
+  GList *sockets = NULL;
+  GList *l = NULL;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), NULL);
+  g_return_val_if_fail (request != NULL, NULL);
+
+  if ((branch = g_hash_table_lookup (self->branches, request)) == NULL) {
+    return NULL;
+  }
+
+  sockets = _branch_get_client_sockets (branch);
+
+  clients = g_array_new (FALSE, TRUE, sizeof (GaeulMjpegClientStats));
+
+  for (l = sockets; l != NULL; l = l->next) {
+    g_autoptr (GstElement) sink = NULL;
+    g_autoptr (GstStructure) s = NULL;
+    g_autoptr (GSocketAddress) address = NULL;
+    GaeulMjpegClientStats stats = { 0, };
+    guint64 sent = 0;
+    guint64 dropped = 0;
+
+    sink = _branch_get_client_sink (branch, l->data, &stats.bytes_sent,
+        &stats.buffers_dropped);
+    if (sink == NULL) {
+      continue;
+    }
+
+    g_signal_emit_by_name (sink, "get-stats", l->data, &s);
+
+    if (s == NULL) {
+      continue;
+    }
+
+    gst_structure_get_uint64 (s, "bytes-sent", &sent);
+    gst_structure_get_uint64 (s, "dropped-buffers", &dropped);
+    stats.bytes_sent += sent;
+    stats.buffers_dropped += dropped;
+
+    address = g_socket_get_remote_address (l->data, NULL);
+    if (G_IS_INET_SOCKET_ADDRESS (address)) {
+      g_autofree gchar *host =
+          g_inet_address_to_string (g_inet_socket_address_get_address
+          (G_INET_SOCKET_ADDRESS (address)));
+
+      stats.address = g_strdup_printf ("%s:%u", host,
+          g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address)));
+    }
+
+    g_array_append_val (clients, stats);
+  }
+
+  g_list_free_full (sockets, g_object_unref);
+
+  g_array_set_clear_func (clients, (GDestroyNotify) _client_stats_clear);
+
+  return clients;
+}
+
+void
+gaeul_mjpeg_transcoder_set_slow_client_policy (GaeulMjpegTranscoder * self,
+    GaeulMjpegSlowClientPolicy policy, guint max_queued_bytes,
+    guint max_queued_frames)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_return_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self));
+
+  self->slow_client_policy = policy;
+  self->max_queued_bytes = max_queued_bytes;
+  self->max_queued_frames = max_queued_frames;
+
+  g_hash_table_iter_init (&iter, self->branches);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    GaeulMjpegBranch *branch = value;
+    GHashTableIter tier_iter;
+    gpointer tier;
+
+    g_hash_table_iter_init (&tier_iter, branch->tiers);
+    while (g_hash_table_iter_next (&tier_iter, NULL, &tier)) {
+      _sink_set_slow_client_policy (((GaeulMjpegTier *) tier)->sink, policy,
+          max_queued_bytes, max_queued_frames);
+    }
+  }
+}
+
+/* Bounds the ingest queue and the queues before the encoders to
+ * @max_time milliseconds, beyond which they drop their oldest data
+ * instead of adding latency, or gives them the default limits of queue
+ * back with 0. */
+void
+gaeul_mjpeg_transcoder_set_queue_max_time (GaeulMjpegTranscoder * self,
+    guint max_time)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_return_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self));
+
+  g_atomic_int_set (&self->queue_max_time, max_time);
+  _queue_set_max_time (self->src_queue, max_time);
+
+  g_hash_table_iter_init (&iter, self->branches);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    _branch_set_queue_max_time (value, max_time);
+  }
+}
+
+/* Encodes up to @n_threads frames at once in the branches created from
+ * now on, except for the keyframe-only ones. Those already running keep
+ * their encoder. */
+void
+gaeul_mjpeg_transcoder_set_encoder_threads (GaeulMjpegTranscoder * self,
+    guint n_threads)
+{
+  g_return_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self));
+
+  g_atomic_int_set (&self->encoder_threads, n_threads);
+}
+
+/* Sends the last JPEG of a branch again instead of encoding a frame whose
+ * luma doesn't differ from the last encoded frame by more than @threshold
+ * on average in any block, or encodes every frame with 0. */
+void
+gaeul_mjpeg_transcoder_set_static_scene_threshold (GaeulMjpegTranscoder *
+    self, guint threshold)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_return_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self));
+
+  g_atomic_int_set (&self->static_threshold, threshold);
+
+  g_hash_table_iter_init (&iter, self->branches);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    GaeulMjpegBranch *branch = value;
+
+    g_atomic_int_set (&branch->static_threshold, threshold);
+  }
+}
+
+guint64
+gaeul_mjpeg_transcoder_get_ingest_buffers_dropped (GaeulMjpegTranscoder *
+    self)
+{
+  guint64 dropped = 0;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), 0);
+
+  g_mutex_lock (&self->stats_lock);
+  dropped = self->ingest_buffers_dropped;
+  g_mutex_unlock (&self->stats_lock);
+
+  return dropped;
+}
+
+guint64
+gaeul_mjpeg_transcoder_get_frames_skipped (GaeulMjpegTranscoder * self)
+{
+  guint64 frames_skipped = 0;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), 0);
+
+  g_mutex_lock (&self->stats_lock);
+  frames_skipped = self->frames_skipped;
+  g_mutex_unlock (&self->stats_lock);
+
+  return frames_skipped;
+}
+
+/* Returns the frame rate @client should be served at, given what its sink
+ * sent and dropped since it was attached to its current tier. */
+static gint
+_client_adapt (GaeulMjpegClient * client, guint64 bytes_sent,
+    guint64 buffers_dropped)
+{
+  GaeulMjpegTier *tier = client->tier;
+  guint64 pushed = tier->bytes_pushed - client->last_bytes_pushed;
+  guint64 drained = bytes_sent - client->last_bytes_sent;
+  gboolean lagging = buffers_dropped > client->last_buffers_dropped ||
+      drained * 4 < pushed * 3;
+
+  client->last_bytes_sent = bytes_sent;
+  client->last_buffers_dropped = buffers_dropped;
+  client->last_bytes_pushed = tier->bytes_pushed;
+
+  if (lagging) {
+    client->n_steady = 0;
+    return MAX (tier->fps / 2, MJPEG_MIN_CLIENT_FPS);
+  }
+
+  if (tier->fps < client->fps && ++client->n_steady >= MJPEG_CLIENT_PROBATION) {
+    client->n_steady = 0;
+    return MIN (tier->fps * 2, client->fps);
+  }
+
+  return tier->fps;
+}
+
+static void
+_branch_move_client (GaeulMjpegBranch * branch, GSocket * socket, gint fps,
+    guint direction)
+{
+  g_autoptr (GError) error = NULL;
+  GaeulMjpegClient *client = NULL;
+  GaeulMjpegTier *from = NULL;
+  GaeulMjpegTier *to = NULL;
+  gboolean attached = FALSE;
+
+  if ((to = _branch_ensure_tier (branch, fps, direction, &error)) == NULL) {
+    g_warning ("Failed to move client %p: %s", socket, error->message);
+    return;
+  }
+
+  g_mutex_lock (&branch->lock);
+  if ((client = g_hash_table_lookup (branch->clients, socket)) != NULL &&
+      client->tier != to) {
+    from = client->tier;
+    client->tier = to;
+    client->last_bytes_sent = 0;
+    client->last_buffers_dropped = 0;
+    client->last_bytes_pushed = to->bytes_pushed;
+  }
+  g_mutex_unlock (&branch->lock);
+
+  if (from == NULL) {
+    return;
+  }
+
+  g_info ("moving client %p from %d to %d fps", socket, from->fps, to->fps);
+
+  /* The client-removed handler keeps the client, as it already belongs to
+   * the other tier, unless it was disconnected in the meantime. */
+  g_signal_emit_by_name (from->sink, "remove", socket);
+
+  g_mutex_lock (&branch->lock);
+  attached = g_hash_table_contains (branch->clients, socket);
+  g_mutex_unlock (&branch->lock);
+
+  if (attached) {
+    g_signal_emit_by_name (to->sink, "add", socket);
+  }
+}
+
+static void
+_branch_adapt_client_rates (GaeulMjpegBranch * branch)
+{
+  GList *sockets = _branch_get_client_sockets (branch);
+  GList *l = NULL;
+
+  for (l = sockets; l != NULL; l = l->next) {
+    g_autoptr (GstElement) sink = NULL;
+    g_autoptr (GstStructure) s = NULL;
+    GaeulMjpegClient *client = NULL;
+    guint64 moved_bytes_sent = 0;
+    guint64 moved_buffers_dropped = 0;
+    guint64 bytes_sent = 0;
+    guint64 buffers_dropped = 0;
+    gint fps = 0;
+    gint target_fps = 0;
+    guint direction = 0;
+
+    /* Only the counters of the current tier matter. */
+    sink = _branch_get_client_sink (branch, l->data, &moved_bytes_sent,
+        &moved_buffers_dropped);
+    if (sink == NULL) {
+      continue;
+    }
+
+    g_signal_emit_by_name (sink, "get-stats", l->data, &s);
+    if (s == NULL) {
+      continue;
+    }
+
+    gst_structure_get_uint64 (s, "bytes-sent", &bytes_sent);
+    gst_structure_get_uint64 (s, "dropped-buffers", &buffers_dropped);
+
+    g_mutex_lock (&branch->lock);
+    if ((client = g_hash_table_lookup (branch->clients, l->data)) != NULL &&
+        client->tier->sink == sink) {
+      fps = client->tier->fps;
+      direction = client->tier->direction;
+      target_fps = _client_adapt (client, bytes_sent, buffers_dropped);
+    }
+    g_mutex_unlock (&branch->lock);
+
+    if (target_fps != fps) {
+      _branch_move_client (branch, l->data, target_fps, direction);
+    }
+  }
+
+  g_list_free_full (sockets, g_object_unref);
+}
+
+/* Measures how fast each client drains its sink, and moves the clients
+ * that can't keep up to a tier sending every other frame. They are moved
+ * back up once they keep up again. Must be called from the main thread,
+ * periodically. */
+void
+gaeul_mjpeg_transcoder_adapt_client_rates (GaeulMjpegTranscoder * self)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_return_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self));
+
+  g_hash_table_iter_init (&iter, self->branches);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    GaeulMjpegBranch *branch = value;
+
+    /* Keyframes come too seldom to be thinned out any further. */
+    if (branch->request->flags & GAEUL_MJPEG_REQUEST_FLAG_KEYFRAME_ONLY) {
+      continue;
+    }
+
+    _branch_adapt_client_rates (branch);
+  }
+}
+
+/* Sends the last JPEG of @branch again, a second later than the last one,
+ * so that its clients keep getting frames while the source stalls. */
+static void
+_branch_send_last_jpeg (GaeulMjpegBranch * branch)
+{
+  GstBuffer *jpeg = NULL;
+
+  if (g_atomic_int_get (&branch->n_clients) == 0) {
+    return;
+  }
+
+  g_mutex_lock (&branch->lock);
+  if (branch->last_jpeg != NULL) {
+    jpeg = gst_buffer_copy (branch->last_jpeg);
+    if (GST_BUFFER_PTS_IS_VALID (jpeg)) {
+      GST_BUFFER_PTS (jpeg) += MJPEG_KEEPALIVE_INTERVAL;
+    }
+    GST_BUFFER_DTS (jpeg) = GST_CLOCK_TIME_NONE;
+    gst_buffer_replace (&branch->last_jpeg, jpeg);
+  }
+  g_mutex_unlock (&branch->lock);
+
+  if (jpeg == NULL) {
+    return;
+  }
+
+  /* The encoder is busy with a frame after all, which comes out anyway. */
+  if (!GST_PAD_STREAM_TRYLOCK (branch->enc_sinkpad)) {
+    gst_buffer_unref (jpeg);
+    return;
+  }
+
+  branch->repeating = TRUE;
+  gst_pad_push (branch->enc_srcpad, jpeg);
+  branch->repeating = FALSE;
+
+  GST_PAD_STREAM_UNLOCK (branch->enc_sinkpad);
+}
+
+/* Must be called with the lock of the playback held, so that the source
+ * isn't brought back up while the pipeline is being paused. */
+static void
+_transcoder_reconnect_source (GaeulMjpegTranscoder * self)
+{
+  g_debug ("connecting (u=%s,r=%s) again", self->uid, self->rid);
+
+  g_mutex_lock (&self->stats_lock);
+  self->source_lost = FALSE;
+  self->n_reconnects++;
+  g_mutex_unlock (&self->stats_lock);
+
+  gst_element_set_state (self->src, GST_STATE_NULL);
+  gst_element_sync_state_with_parent (self->src);
+}
+
+/* Checks that the source still streams. Once it stalls, the branches keep
+ * their clients with their last JPEG while the source is connected again,
+ * up to every MJPEG_MAX_RECONNECT_DELAY, until data comes in again. Must
+ * be called from the main thread, about once a second. */
+void
+gaeul_mjpeg_transcoder_watch_source (GaeulMjpegTranscoder * self)
+{
+  GHashTableIter iter;
+  gpointer value;
+  gint64 now = g_get_monotonic_time ();
+  gint64 last_input_time = 0;
+  gboolean source_lost = FALSE;
+
+  g_return_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self));
+
+  gaeul_mjpeg_playback_lock (self->playback);
+  if (GST_STATE_TARGET (self->pipeline) != GST_STATE_PLAYING) {
+    gaeul_mjpeg_playback_unlock (self->playback);
+    return;
+  }
+
+  g_mutex_lock (&self->stats_lock);
+  last_input_time = self->last_input_time;
+  source_lost = self->source_lost;
+  g_mutex_unlock (&self->stats_lock);
+
+  if (!source_lost && now - last_input_time < MJPEG_STALL_TIMEOUT) {
+    if (self->stalled) {
+      g_info ("source of (u=%s,r=%s) is back", self->uid, self->rid);
+      self->stalled = FALSE;
+    }
+    gaeul_mjpeg_playback_unlock (self->playback);
+    return;
+  }
+
+  if (!self->stalled) {
+    g_info ("source of (u=%s,r=%s) stalled, holding the last frames",
+        self->uid, self->rid);
+    self->stalled = TRUE;
+    self->reconnect_delay = MJPEG_MIN_RECONNECT_DELAY;
+    self->next_reconnect_time = now;
+  }
+
+  if (now >= self->next_reconnect_time) {
+    _transcoder_reconnect_source (self);
+
+    self->next_reconnect_time = now + self->reconnect_delay;
+    self->reconnect_delay = MIN (self->reconnect_delay * 2,
+        MJPEG_MAX_RECONNECT_DELAY);
+  }
+  gaeul_mjpeg_playback_unlock (self->playback);
+
+  g_hash_table_iter_init (&iter, self->branches);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    _branch_send_last_jpeg (value);
+  }
+}
+
+guint64
+gaeul_mjpeg_transcoder_get_errors (GaeulMjpegTranscoder * self)
+{
+  guint64 n_errors = 0;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), 0);
+
+  g_mutex_lock (&self->stats_lock);
+  n_errors = self->n_errors;
+  g_mutex_unlock (&self->stats_lock);
+
+  return n_errors;
+}
+
+guint64
+gaeul_mjpeg_transcoder_get_source_reconnects (GaeulMjpegTranscoder * self)
+{
+  guint64 n_reconnects = 0;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), 0);
+
+  g_mutex_lock (&self->stats_lock);
+  n_reconnects = self->n_reconnects;
+  g_mutex_unlock (&self->stats_lock);
+
+  return n_reconnects;
+}
+
+/* Degrades the branch of @request by @level steps from what was asked
+ * for, up to GAEUL_MJPEG_MAX_DEGRADATION, to save processing. Its clients
+ * stay through the change of caps. */
+gboolean
+gaeul_mjpeg_transcoder_set_degradation (GaeulMjpegTranscoder * self,
+    GaeulMjpegRequest * request, guint level)
+{
+  GaeulMjpegBranch *branch = NULL;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self), FALSE);
+  g_return_val_if_fail (request != NULL, FALSE);
+
+  if ((branch = g_hash_table_lookup (self->branches, request)) == NULL) {
+    return FALSE;
+  }
+
+  level = MIN (level, GAEUL_MJPEG_MAX_DEGRADATION);
+  if (level == branch->degradation) {
+    return TRUE;
+  }
+
+  g_debug ("Degrading transcoding branch for (u=%s,r=%s) %dx%d@%d from "
+      "level %u to %u", self->uid, self->rid, branch->request->width,
+      branch->request->height, branch->fps, branch->degradation, level);
+
+  branch->degradation = level;
+  _branch_update_caps (branch);
+  _transcoder_update_max_fps (self);
+
+  return TRUE;
+}
+
+/* Decodes with up to @n_threads threads, 0 for as many as libav sees fit,
+ * in the decode stages built from now on. With @low_latency, they are
+ * slice threads, which don't hold back frames like frame threads do. */
+void
+gaeul_mjpeg_transcoder_set_decoder_options (GaeulMjpegTranscoder * self,
+    guint n_threads, gboolean low_latency)
+{
+  g_return_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self));
+
+  g_atomic_int_set (&self->decoder_threads, n_threads);
+  g_atomic_int_set (&self->decoder_low_latency, low_latency);
+}
+
+void
+gaeul_mjpeg_transcoder_get_decoder_stats (GaeulMjpegTranscoder * self,
+    GaeulMjpegDecoderStats * stats)
+{
+  g_return_if_fail (GAEUL_IS_MJPEG_TRANSCODER (self));
+  g_return_if_fail (stats != NULL);
+
+  g_mutex_lock (&self->decoder_lock);
+  stats->codec = self->codec != NULL ? self->codec->name : NULL;
+  g_mutex_unlock (&self->decoder_lock);
+
+  g_mutex_lock (&self->stats_lock);
+  stats->build_time = self->decoder_build_time;
+  stats->frames_decoded = self->frames_decoded;
+  stats->decode_time = self->frames_decoded > 0 ?
+      self->decode_time / self->frames_decoded : 0;
+  g_mutex_unlock (&self->stats_lock);
+}
@@ -0,0 +1,205 @@
+/**
+ *  Copyright 2020 SK Telecom Co., Ltd.
+ *    Author: Jeongseok Kim <jeongseok.kim@sk.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef __GAEUL_MJPEG_TRANSCODER_H__
+#define __GAEUL_MJPEG_TRANSCODER_H__
+
+#include <gio/gio.h>
+
+#include "mjpeg/mjpeg-request.h"
+
+G_BEGIN_DECLS
+
+#define GAEUL_TYPE_MJPEG_TRANSCODER     (gaeul_mjpeg_transcoder_get_type())
+G_DECLARE_FINAL_TYPE                    (GaeulMjpegTranscoder, gaeul_mjpeg_transcoder, GAEUL, MJPEG_TRANSCODER, GObject)
+
+/* Every level of degradation halves the frame rate of a branch, and every
+ * other level its size as well. */
+#define GAEUL_MJPEG_MAX_DEGRADATION     4
+
+typedef struct _GaeulMjpegBranchStats
+{
+  guint n_clients;
+  guint64 bytes_sent;
+  guint64 frames_encoded;
+  guint64 frames_dropped;
+  /* the average time in microseconds a frame spent in the encoder */
+  guint64 encode_time;
+  /* frames sent as the last JPEG again, for not differing from the last
+   * encoded frame */
+  guint64 frames_repeated;
+  /* the level the branch is degraded to under load, 0 for none */
+  guint degradation;
+} GaeulMjpegBranchStats;
+
+typedef struct _GaeulMjpegDecoderStats
+{
+  /* "h264" or "h265", NULL until the stream is found */
+  const gchar *codec;
+  /* the time in microseconds it took to build the decode stage */
+  guint64 build_time;
+  guint64 frames_decoded;
+  /* the average time in microseconds a frame spent in the decoder */
+  guint64 decode_time;
+} GaeulMjpegDecoderStats;
+
+typedef struct _GaeulMjpegClientStats
+{
+  gchar *address;
+  guint64 bytes_sent;
+  guint64 buffers_dropped;
+} GaeulMjpegClientStats;
+
+/* Must match the org.hwangsaeul.Gaeul2.MJPEG.SlowClientPolicy enum of the
+ * settings schema. */
+typedef enum
+{
+  GAEUL_MJPEG_SLOW_CLIENT_DROP_TO_LATEST,
+  GAEUL_MJPEG_SLOW_CLIENT_DROP_TO_KEYFRAME,
+  GAEUL_MJPEG_SLOW_CLIENT_DISCONNECT,
+} GaeulMjpegSlowClientPolicy;
+
+GaeulMjpegTranscoder   *gaeul_mjpeg_transcoder_new      (const gchar           *relay_uri,
+                                                         const gchar           *uid,
+                                                         const gchar           *rid,
+                                                         guint                  protocol_latency,
+                                                         guint                  demux_latency,
+                                                         GError               **error);
+
+void                    gaeul_mjpeg_transcoder_new_async
+                                                        (const gchar           *relay_uri,
+                                                         const gchar           *uid,
+                                                         const gchar           *rid,
+                                                         guint                  protocol_latency,
+                                                         guint                  demux_latency,
+                                                         GCancellable          *cancellable,
+                                                         GAsyncReadyCallback    callback,
+                                                         gpointer               user_data);
+
+GaeulMjpegTranscoder   *gaeul_mjpeg_transcoder_new_finish
+                                                        (GAsyncResult          *result,
+                                                         GError               **error);
+
+gboolean                gaeul_mjpeg_transcoder_add_branch
+                                                        (GaeulMjpegTranscoder  *self,
+                                                         GaeulMjpegRequest     *request,
+                                                         GError               **error);
+
+void                    gaeul_mjpeg_transcoder_remove_branch
+                                                        (GaeulMjpegTranscoder  *self,
+                                                         GaeulMjpegRequest     *request);
+
+gboolean                gaeul_mjpeg_transcoder_update_branch
+                                                        (GaeulMjpegTranscoder  *self,
+                                                         GaeulMjpegRequest     *request,
+                                                         GaeulMjpegRequest     *update,
+                                                         GError               **error);
+
+guint                   gaeul_mjpeg_transcoder_get_n_branches
+                                                        (GaeulMjpegTranscoder  *self);
+
+gboolean                gaeul_mjpeg_transcoder_add_client
+                                                        (GaeulMjpegTranscoder  *self,
+                                                         GaeulMjpegRequest     *request,
+                                                         GSocket               *socket);
+
+void                    gaeul_mjpeg_transcoder_play     (GaeulMjpegTranscoder  *self);
+
+void                    gaeul_mjpeg_transcoder_preroll  (GaeulMjpegTranscoder  *self);
+
+void                    gaeul_mjpeg_transcoder_stop_preroll
+                                                        (GaeulMjpegTranscoder  *self);
+
+gint64                  gaeul_mjpeg_transcoder_get_startup_latency
+                                                        (GaeulMjpegTranscoder  *self,
+                                                         GaeulMjpegRequest     *request);
+
+guint                   gaeul_mjpeg_transcoder_get_n_clients
+                                                        (GaeulMjpegTranscoder  *self);
+
+guint64                 gaeul_mjpeg_transcoder_get_bytes_received
+                                                        (GaeulMjpegTranscoder  *self);
+
+guint                   gaeul_mjpeg_transcoder_get_demux_latency
+                                                        (GaeulMjpegTranscoder  *self);
+
+guint64                 gaeul_mjpeg_transcoder_get_bytes_sent
+                                                        (GaeulMjpegTranscoder  *self);
+
+guint64                 gaeul_mjpeg_transcoder_get_frames_skipped
+                                                        (GaeulMjpegTranscoder  *self);
+
+void                    gaeul_mjpeg_transcoder_set_slow_client_policy
+                                                        (GaeulMjpegTranscoder  *self,
+                                                         GaeulMjpegSlowClientPolicy policy,
+                                                         guint                  max_queued_bytes,
+                                                         guint                  max_queued_frames);
+
+void                    gaeul_mjpeg_transcoder_set_queue_max_time
+                                                        (GaeulMjpegTranscoder  *self,
+                                                         guint                  max_time);
+
+void                    gaeul_mjpeg_transcoder_set_encoder_threads
+                                                        (GaeulMjpegTranscoder  *self,
+                                                         guint                  n_threads);
+
+void                    gaeul_mjpeg_transcoder_set_decoder_options
+                                                        (GaeulMjpegTranscoder  *self,
+                                                         guint                  n_threads,
+                                                         gboolean               low_latency);
+
+void                    gaeul_mjpeg_transcoder_get_decoder_stats
+                                                        (GaeulMjpegTranscoder  *self,
+                                                         GaeulMjpegDecoderStats *stats);
+
+void                    gaeul_mjpeg_transcoder_set_static_scene_threshold
+                                                        (GaeulMjpegTranscoder  *self,
+                                                         guint                  threshold);
+
+gboolean                gaeul_mjpeg_transcoder_set_degradation
+                                                        (GaeulMjpegTranscoder  *self,
+                                                         GaeulMjpegRequest     *request,
+                                                         guint                  level);
+
+guint64                 gaeul_mjpeg_transcoder_get_ingest_buffers_dropped
+                                                        (GaeulMjpegTranscoder  *self);
+
+void                    gaeul_mjpeg_transcoder_adapt_client_rates
+                                                        (GaeulMjpegTranscoder  *self);
+
+void                    gaeul_mjpeg_transcoder_watch_source
+                                                        (GaeulMjpegTranscoder  *self);
+
+guint64                 gaeul_mjpeg_transcoder_get_errors
+                                                        (GaeulMjpegTranscoder  *self);
+
+guint64                 gaeul_mjpeg_transcoder_get_source_reconnects
+                                                        (GaeulMjpegTranscoder  *self);
+
+GArray                 *gaeul_mjpeg_transcoder_get_client_stats
+                                                        (GaeulMjpegTranscoder  *self,
+                                                         GaeulMjpegRequest     *request);
+
+gboolean                gaeul_mjpeg_transcoder_get_branch_stats
+                                                        (GaeulMjpegTranscoder  *self,
+                                                         GaeulMjpegRequest     *request,
+                                                         GaeulMjpegBranchStats *stats);
+
+G_END_DECLS
+
+#endif // __GAEUL_MJPEG_TRANSCODER_H__
@@ -0,0 +1,537 @@
+/**
+ *  Copyright 2020 SK Telecom Co., Ltd.
+ *    Author: Jeongseok Kim <jeongseok.kim@sk.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include "mjpeg/mjpeg-worker.h"
+
+#include <gio/gunixfdlist.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define GAEUL_MJPEG_SERVICE_PATH        "/org/hwangsaeul/Gaeul2/MJPEG/Service"
+
+struct _GaeulMjpegWorker
+{
+  GObject parent;
+
+  guint index;
+
+  /* the cores the worker process is bound to */
+  guint first_cpu;
+  guint last_cpu;
+
+  GSubprocess *subprocess;
+  GDBusConnection *connection;
+  GCancellable *cancellable;
+
+  Gaeul2DBusMJPEGService *service;
+  Gaeul2DBusMJPEGWorker *worker;
+
+  gboolean closed;
+
+  /* sessions placed on the worker by the agent */
+  guint n_sessions;
+
+  /* HTTP clients handed over to the worker and not removed yet */
+  guint n_clients;
+
+  GaeulMjpegWorkerStats stats;
+};
+
+typedef enum
+{
+  SIG_CLOSED,
+  SIG_CLIENT_ADDED,
+  SIG_CLIENT_REMOVED,
+  LAST_SIGNAL
+} GaeulMjpegWorkerSignal;
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+/* *INDENT-OFF* */
+G_DEFINE_TYPE (GaeulMjpegWorker, gaeul_mjpeg_worker, G_TYPE_OBJECT)
+/* *INDENT-ON* */
+
+static void
+_remove_client (GaeulMjpegWorker * self)
+{
+  /* The clients of a closed worker are removed all at once. */
+  if (self->n_clients == 0) {
+    return;
+  }
+
+  self->n_clients--;
+  g_signal_emit (self, signals[SIG_CLIENT_REMOVED], 0);
+}
+
+static void
+_close (GaeulMjpegWorker * self)
+{
+  if (self->closed) {
+    return;
+  }
+
+  self->closed = TRUE;
+
+  while (self->n_clients > 0) {
+    _remove_client (self);
+  }
+
+  g_signal_emit (self, signals[SIG_CLOSED], 0);
+}
+
+static void
+gaeul_mjpeg_worker_dispose (GObject * object)
+{
+  GaeulMjpegWorker *self = GAEUL_MJPEG_WORKER (object);
+
+  if (self->cancellable != NULL) {
+    g_cancellable_cancel (self->cancellable);
+    g_clear_object (&self->cancellable);
+  }
+
+  if (self->connection != NULL) {
+    g_signal_handlers_disconnect_by_data (self->connection, self);
+  }
+
+  if (self->worker != NULL) {
+    g_signal_handlers_disconnect_by_data (self->worker, self);
+  }
+
+  /* Workers stop like the agent does on SIGINT. */
+  if (self->subprocess != NULL && !self->closed) {
+    g_subprocess_send_signal (self->subprocess, SIGINT);
+  }
+  self->closed = TRUE;
+
+  g_clear_object (&self->service);
+  g_clear_object (&self->worker);
+  g_clear_object (&self->connection);
+  g_clear_object (&self->subprocess);
+
+  G_OBJECT_CLASS (gaeul_mjpeg_worker_parent_class)->dispose (object);
+}
+
+static void
+gaeul_mjpeg_worker_class_init (GaeulMjpegWorkerClass * klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = gaeul_mjpeg_worker_dispose;
+
+  signals[SIG_CLOSED] =
+      g_signal_new ("closed", G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL, G_TYPE_NONE, 0);
+
+  signals[SIG_CLIENT_ADDED] =
+      g_signal_new ("client-added", G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL, G_TYPE_NONE, 0);
+
+  signals[SIG_CLIENT_REMOVED] =
+      g_signal_new ("client-removed", G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL, G_TYPE_NONE, 0);
+}
+
+static void
+gaeul_mjpeg_worker_init (GaeulMjpegWorker * self)
+{
+  self->cancellable = g_cancellable_new ();
+}
+
+static void
+_child_setup (gpointer user_data)
+{
+  GaeulMjpegWorker *self = user_data;
+  cpu_set_t cpus;
+  guint cpu = 0;
+
+  CPU_ZERO (&cpus);
+  for (cpu = self->first_cpu; cpu < self->last_cpu; cpu++) {
+    CPU_SET (cpu, &cpus);
+  }
+
+  sched_setaffinity (0, sizeof (cpus), &cpus);
+}
+
+static void
+_connection_closed_cb (GDBusConnection * connection,
+    gboolean remote_peer_vanished, GError * error, gpointer user_data)
+{
+  GaeulMjpegWorker *self = user_data;
+
+  g_info ("connection to mjpeg worker %u is closed", self->index);
+
+  if (self->subprocess != NULL) {
+    g_subprocess_force_exit (self->subprocess);
+  }
+
+  _close (self);
+}
+
+static void
+_worker_client_removed_cb (Gaeul2DBusMJPEGWorker * worker, gpointer user_data)
+{
+  _remove_client (user_data);
+}
+
+static void
+_connection_ready_cb (GObject * source, GAsyncResult * result,
+    gpointer user_data)
+{
+  GaeulMjpegWorker *self = NULL;
+  g_autoptr (GDBusConnection) connection = NULL;
+  g_autoptr (GError) error = NULL;
+
+  connection = g_dbus_connection_new_finish (result, &error);
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    return;
+  }
+
+  self = user_data;
+
+  if (connection == NULL) {
+    g_warning ("failed to connect to mjpeg worker %u (reason: %s)",
+        self->index, error->message);
+    g_subprocess_force_exit (self->subprocess);
+    _close (self);
+    return;
+  }
+
+  /* Both proxies are created without any round trip to the worker, which
+   * may not have exported its interfaces yet. The signals of a peer to peer
+   * connection need no subscription on the worker side. */
+  self->service = gaeul2_dbus_mjpegservice_proxy_new_sync (connection,
+      G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES |
+      G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS, NULL,
+      GAEUL_MJPEG_SERVICE_PATH, NULL, &error);
+
+  if (self->service != NULL) {
+    self->worker = gaeul2_dbus_mjpegworker_proxy_new_sync (connection,
+        G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES, NULL,
+        GAEUL_MJPEG_SERVICE_PATH, NULL, &error);
+  }
+
+  if (self->worker == NULL) {
+    g_warning ("failed to create mjpeg worker %u proxies (reason: %s)",
+        self->index, error->message);
+    g_clear_object (&self->service);
+    g_subprocess_force_exit (self->subprocess);
+    _close (self);
+    return;
+  }
+
+  self->connection = g_steal_pointer (&connection);
+  g_signal_connect (self->connection, "closed",
+      G_CALLBACK (_connection_closed_cb), self);
+  g_signal_connect (self->worker, "client-removed",
+      G_CALLBACK (_worker_client_removed_cb), self);
+
+  g_debug ("mjpeg worker %u is ready", self->index);
+}
+
+static void
+_subprocess_exited_cb (GObject * source, GAsyncResult * result,
+    gpointer user_data)
+{
+  GaeulMjpegWorker *self = NULL;
+  g_autoptr (GError) error = NULL;
+
+  g_subprocess_wait_finish (G_SUBPROCESS (source), result, &error);
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    return;
+  }
+
+  self = user_data;
+
+  g_info ("mjpeg worker %u exited", self->index);
+
+  _close (self);
+}
+
+GaeulMjpegWorker *
+gaeul_mjpeg_worker_new (guint index, guint n_workers,
+    const gchar * config_path, GError ** error)
+{
+  g_autoptr (GaeulMjpegWorker) self = NULL;
+  g_autoptr (GSubprocessLauncher) launcher = NULL;
+  g_autoptr (GPtrArray) argv = NULL;
+  g_autoptr (GSocket) socket = NULL;
+  g_autoptr (GSocketConnection) stream = NULL;
+  g_autofree gchar *guid = NULL;
+  g_autofree gchar *fd_str = NULL;
+  guint n_cpus = g_get_num_processors ();
+  int fds[2];
+
+  g_return_val_if_fail (index < n_workers, NULL);
+
+  self = g_object_new (GAEUL_TYPE_MJPEG_WORKER, NULL);
+  self->index = index;
+
+  /* Each worker gets its own group of cores, or shares a single core when
+   * there are more workers than cores. */
+  self->first_cpu = (index * n_cpus) / n_workers;
+  self->last_cpu = MAX (((index + 1) * n_cpus) / n_workers,
+      self->first_cpu + 1);
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+    int errsv = errno;
+
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+        "Failed to create the worker socket (reason: %s)", g_strerror (errsv));
+    return NULL;
+  }
+
+  socket = g_socket_new_from_fd (fds[0], error);
+  if (socket == NULL) {
+    close (fds[0]);
+    close (fds[1]);
+    return NULL;
+  }
+
+  fd_str = g_strdup_printf ("%d", GAEUL_MJPEG_WORKER_FD);
+
+  /* The workers are the agent itself, run in worker mode. */
+  argv = g_ptr_array_new ();
+  g_ptr_array_add (argv, (gpointer) "/proc/self/exe");
+  g_ptr_array_add (argv, (gpointer) "--dbus-type");
+  g_ptr_array_add (argv, (gpointer) "none");
+  g_ptr_array_add (argv, (gpointer) "--worker-fd");
+  g_ptr_array_add (argv, fd_str);
+  if (config_path != NULL) {
+    g_ptr_array_add (argv, (gpointer) "--config");
+    g_ptr_array_add (argv, (gpointer) config_path);
+  }
+  g_ptr_array_add (argv, NULL);
+
+  launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_NONE);
+  g_subprocess_launcher_take_fd (launcher, fds[1], GAEUL_MJPEG_WORKER_FD);
+  g_subprocess_launcher_set_child_setup (launcher, _child_setup, self, NULL);
+
+  self->subprocess = g_subprocess_launcher_spawnv (launcher,
+      (const gchar * const *) argv->pdata, error);
+
+  if (self->subprocess == NULL) {
+    return NULL;
+  }
+
+  g_debug ("spawned mjpeg worker %u (pid: %s, cpus: %u-%u)", index,
+      g_subprocess_get_identifier (self->subprocess), self->first_cpu,
+      self->last_cpu - 1);
+
+  g_subprocess_wait_async (self->subprocess, self->cancellable,
+      _subprocess_exited_cb, self);
+
+  stream = g_socket_connection_factory_create_connection (socket);
+  guid = g_dbus_generate_guid ();
+
+  g_dbus_connection_new (G_IO_STREAM (stream), guid,
+      G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_SERVER, NULL, self->cancellable,
+      _connection_ready_cb, self);
+
+  return g_steal_pointer (&self);
+}
+
+guint
+gaeul_mjpeg_worker_get_index (GaeulMjpegWorker * self)
+{
+  g_return_val_if_fail (GAEUL_IS_MJPEG_WORKER (self), 0);
+
+  return self->index;
+}
+
+gboolean
+gaeul_mjpeg_worker_is_ready (GaeulMjpegWorker * self)
+{
+  g_return_val_if_fail (GAEUL_IS_MJPEG_WORKER (self), FALSE);
+
+  return self->connection != NULL && !self->closed;
+}
+
+gboolean
+gaeul_mjpeg_worker_is_closed (GaeulMjpegWorker * self)
+{
+  g_return_val_if_fail (GAEUL_IS_MJPEG_WORKER (self), FALSE);
+
+  return self->closed;
+}
+
+Gaeul2DBusMJPEGService *
+gaeul_mjpeg_worker_get_service (GaeulMjpegWorker * self)
+{
+  g_return_val_if_fail (GAEUL_IS_MJPEG_WORKER (self), NULL);
+
+  return self->service;
+}
+
+typedef struct
+{
+  GaeulMjpegWorker *worker;
+  GIOStream *connection;
+} GaeulMjpegWorkerClient;
+
+static void
+_worker_client_free (GaeulMjpegWorkerClient * client)
+{
+  g_object_unref (client->connection);
+  g_object_unref (client->worker);
+  g_free (client);
+}
+
+static void
+_add_client_cb (GObject * source, GAsyncResult * result, gpointer user_data)
+{
+  GaeulMjpegWorkerClient *client = user_data;
+  g_autoptr (GError) error = NULL;
+
+  if (!gaeul2_dbus_mjpegworker_call_add_client_finish (GAEUL2_DBUS_MJPEGWORKER
+          (source), NULL, result, &error)) {
+    g_info ("mjpeg worker %u didn't take the client (reason: %s)",
+        client->worker->index, error->message);
+    _remove_client (client->worker);
+  }
+
+  /* The worker streams to its own copy of the socket, and the client sees
+   * the end of the stream once the worker closes it. */
+  g_io_stream_close (client->connection, NULL, NULL);
+  _worker_client_free (client);
+}
+
+/* Hands @socket over to the worker, and closes @connection, which keeps it
+ * open until then, once the worker has its own copy. Must be called from
+ * the main context, like the worker counts its clients in. */
+gboolean
+gaeul_mjpeg_worker_add_client (GaeulMjpegWorker * self,
+    const gchar * request_id, GSocket * socket, GIOStream * connection)
+{
+  g_autoptr (GUnixFDList) fd_list = NULL;
+  g_autoptr (GError) error = NULL;
+  GaeulMjpegWorkerClient *client = NULL;
+  gint index = -1;
+
+  g_return_val_if_fail (GAEUL_IS_MJPEG_WORKER (self), FALSE);
+  g_return_val_if_fail (G_IS_SOCKET (socket), FALSE);
+  g_return_val_if_fail (G_IS_IO_STREAM (connection), FALSE);
+
+  if (!gaeul_mjpeg_worker_is_ready (self)) {
+    return FALSE;
+  }
+
+  fd_list = g_unix_fd_list_new ();
+  index = g_unix_fd_list_append (fd_list, g_socket_get_fd (socket), &error);
+
+  if (index < 0) {
+    g_warning ("failed to pass client to mjpeg worker %u (reason: %s)",
+        self->index, error->message);
+    return FALSE;
+  }
+
+  client = g_new0 (GaeulMjpegWorkerClient, 1);
+  client->worker = g_object_ref (self);
+  client->connection = g_object_ref (connection);
+
+  /* The client counts from now on, as the worker may report it removed
+   * before its reply comes. */
+  self->n_clients++;
+  g_signal_emit (self, signals[SIG_CLIENT_ADDED], 0);
+
+  gaeul2_dbus_mjpegworker_call_add_client (self->worker, request_id,
+      g_variant_new_handle (index), fd_list, NULL, _add_client_cb, client);
+
+  return TRUE;
+}
+
+guint
+gaeul_mjpeg_worker_get_n_sessions (GaeulMjpegWorker * self)
+{
+  g_return_val_if_fail (GAEUL_IS_MJPEG_WORKER (self), 0);
+
+  return self->n_sessions;
+}
+
+void
+gaeul_mjpeg_worker_hold_session (GaeulMjpegWorker * self)
+{
+  g_return_if_fail (GAEUL_IS_MJPEG_WORKER (self));
+
+  self->n_sessions++;
+}
+
+void
+gaeul_mjpeg_worker_release_session (GaeulMjpegWorker * self)
+{
+  g_return_if_fail (GAEUL_IS_MJPEG_WORKER (self));
+  g_return_if_fail (self->n_sessions > 0);
+
+  self->n_sessions--;
+}
+
+static void
+_get_stats_cb (GObject * source, GAsyncResult * result, gpointer user_data)
+{
+  g_autoptr (GaeulMjpegWorker) self = user_data;
+  g_autoptr (GError) error = NULL;
+  GaeulMjpegWorkerStats stats = { 0, };
+
+  if (!gaeul2_dbus_mjpegworker_call_get_stats_finish (GAEUL2_DBUS_MJPEGWORKER
+          (source), &stats.n_srtconnections, &stats.n_httpconnections,
+          &stats.bytes_received, &stats.bytes_sent,
+          &stats.n_lazy_first_frames, &stats.lazy_first_frame_time,
+          &stats.n_eager_first_frames, &stats.eager_first_frame_time, result,
+          &error)) {
+    g_debug ("failed to get stats of mjpeg worker %u (reason: %s)",
+        self->index, error->message);
+    return;
+  }
+
+  self->stats = stats;
+}
+
+void
+gaeul_mjpeg_worker_update_stats (GaeulMjpegWorker * self)
+{
+  g_return_if_fail (GAEUL_IS_MJPEG_WORKER (self));
+
+  if (!gaeul_mjpeg_worker_is_ready (self)) {
+    return;
+  }
+
+  gaeul2_dbus_mjpegworker_call_get_stats (self->worker, NULL, _get_stats_cb,
+      g_object_ref (self));
+}
+
+/* Returns the statistics as of the last gaeul_mjpeg_worker_update_stats(). */
+void
+gaeul_mjpeg_worker_get_stats (GaeulMjpegWorker * self,
+    GaeulMjpegWorkerStats * stats)
+{
+  g_return_if_fail (GAEUL_IS_MJPEG_WORKER (self));
+  g_return_if_fail (stats != NULL);
+
+  *stats = self->stats;
+}
@@ -0,0 +1,84 @@
+/**
+ *  Copyright 2020 SK Telecom Co., Ltd.
+ *    Author: Jeongseok Kim <jeongseok.kim@sk.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef __GAEUL_MJPEG_WORKER_H__
+#define __GAEUL_MJPEG_WORKER_H__
+
+#include <gio/gio.h>
+
+#include "mjpeg/mjpeg-generated.h"
+#include "mjpeg/mjpeg-worker-generated.h"
+
+G_BEGIN_DECLS
+
+/* The worker processes are started with their end of the connection to
+ * the agent at this file descriptor. */
+#define GAEUL_MJPEG_WORKER_FD           3
+
+#define GAEUL_TYPE_MJPEG_WORKER         (gaeul_mjpeg_worker_get_type())
+G_DECLARE_FINAL_TYPE                    (GaeulMjpegWorker, gaeul_mjpeg_worker, GAEUL, MJPEG_WORKER, GObject)
+
+typedef struct _GaeulMjpegWorkerStats
+{
+  guint n_srtconnections;
+  guint n_httpconnections;
+  guint64 bytes_received;
+  guint64 bytes_sent;
+
+  /* the number of first frames sent, and their total time in
+   * microseconds, for pipelines started lazily and eagerly */
+  guint n_lazy_first_frames;
+  guint64 lazy_first_frame_time;
+  guint n_eager_first_frames;
+  guint64 eager_first_frame_time;
+} GaeulMjpegWorkerStats;
+
+GaeulMjpegWorker       *gaeul_mjpeg_worker_new          (guint                   index,
+                                                         guint                   n_workers,
+                                                         const gchar            *config_path,
+                                                         GError                **error);
+
+guint                   gaeul_mjpeg_worker_get_index    (GaeulMjpegWorker       *self);
+
+gboolean                gaeul_mjpeg_worker_is_ready     (GaeulMjpegWorker       *self);
+
+gboolean                gaeul_mjpeg_worker_is_closed    (GaeulMjpegWorker       *self);
+
+Gaeul2DBusMJPEGService *gaeul_mjpeg_worker_get_service  (GaeulMjpegWorker       *self);
+
+gboolean                gaeul_mjpeg_worker_add_client   (GaeulMjpegWorker       *self,
+                                                         const gchar            *request_id,
+                                                         GSocket                *socket,
+                                                         GIOStream              *connection);
+
+guint                   gaeul_mjpeg_worker_get_n_sessions
+                                                        (GaeulMjpegWorker       *self);
+
+void                    gaeul_mjpeg_worker_hold_session (GaeulMjpegWorker       *self);
+
+void                    gaeul_mjpeg_worker_release_session
+                                                        (GaeulMjpegWorker       *self);
+
+void                    gaeul_mjpeg_worker_update_stats (GaeulMjpegWorker       *self);
+
+void                    gaeul_mjpeg_worker_get_stats    (GaeulMjpegWorker       *self,
+                                                         GaeulMjpegWorkerStats  *stats);
+
+G_END_DECLS
+
+#endif // __GAEUL_MJPEG_WORKER_H__
@@ -133,3 +133,23 @@ gaeul_tuple_lookup (GaeulTuple * self, const gchar * first_key,
 
   return g_hash_table_lookup (self->object_map, variant_key);
 }
+
+void
+gaeul_tuple_foreach (GaeulTuple * self, GaeulTupleForeachFunc func,
+    gpointer user_data)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_return_if_fail (GAEUL_IS_TUPLE (self));
+  g_return_if_fail (func != NULL);
+
+  g_hash_table_iter_init (&iter, self->object_map);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    const gchar *first_key = NULL;
+    const gchar *second_key = NULL;
+
+    g_variant_get (key, "(&s&s)", &first_key, &second_key);
+    func (first_key, second_key, value, user_data);
+  }
+}
@@ -26,6 +26,11 @@ G_BEGIN_DECLS
 #define GAEUL_TYPE_TUPLE      (gaeul_tuple_get_type ())
 G_DECLARE_FINAL_TYPE          (GaeulTuple, gaeul_tuple, GAEUL, TUPLE, GObject)
 
+typedef void  (*GaeulTupleForeachFunc)         (const gchar        *first_key,
+                                                const gchar        *second_key,
+                                                GObject            *object,
+                                                gpointer            user_data);
+
 GaeulTuple     *gaeul_tuple_new                (void);
 
 gboolean        gaeul_tuple_insert             (GaeulTuple         *self, 
@@ -40,6 +45,11 @@ gboolean        gaeul_tuple_remove             (GaeulTuple         *self,
 GObject        *gaeul_tuple_lookup             (GaeulTuple         *self,
                                                 const gchar        *first_key,
                                                 const gchar        *second_key);
+
+void            gaeul_tuple_foreach            (GaeulTuple         *self,
+                                                GaeulTupleForeachFunc func,
+                                                gpointer            user_data);
+
 G_END_DECLS
 
 #endif // __GAEUL_TUPLE_H__
@@ -19,7 +19,28 @@
 #include "types.h"
 
 #include <glib.h>
+#include <gio/gio.h>
 
 /* *INDENT-OFF* */
 G_DEFINE_QUARK (gaeul-authenticator-error-quark, gaeul_authenticator_error)
 /* *INDENT-ON* */
+
+static const GDBusErrorEntry gaeul_mjpeg_error_entries[] = {
+  {GAEUL_MJPEG_ERROR_TOO_MANY_SRT_CONNECTIONS,
+      "org.hwangsaeul.Gaeul2.MJPEG.Error.TooManySRTConnections"},
+  {GAEUL_MJPEG_ERROR_TOO_MANY_USER_SESSIONS,
+      "org.hwangsaeul.Gaeul2.MJPEG.Error.TooManyUserSessions"},
+  {GAEUL_MJPEG_ERROR_TOO_MANY_SESSIONS_PER_USER,
+      "org.hwangsaeul.Gaeul2.MJPEG.Error.TooManySessionsPerUser"},
+};
+
+GQuark
+gaeul_mjpeg_error_quark (void)
+{
+  static volatile gsize quark = 0;
+
+  g_dbus_error_register_error_domain ("gaeul-mjpeg-error-quark", &quark,
+      gaeul_mjpeg_error_entries, G_N_ELEMENTS (gaeul_mjpeg_error_entries));
+
+  return (GQuark) quark;
+}
@@ -28,4 +28,13 @@ typedef enum {
   GAEUL_AUTHENTICATOR_ERROR_NO_SUCH_TOKEN,
 } GaeulAuthenticatorError;
 
+#define GAEUL_MJPEG_ERROR               (gaeul_mjpeg_error_quark ())
+GQuark gaeul_mjpeg_error_quark          (void);
+
+typedef enum {
+  GAEUL_MJPEG_ERROR_TOO_MANY_SRT_CONNECTIONS,
+  GAEUL_MJPEG_ERROR_TOO_MANY_USER_SESSIONS,
+  GAEUL_MJPEG_ERROR_TOO_MANY_SESSIONS_PER_USER,
+} GaeulMjpegError;
+
 #endif // __GAEUL_TYPES_H__
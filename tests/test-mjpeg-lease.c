@@ -0,0 +1,192 @@
+/**
+ *  Copyright 2020 SK Telecom Co., Ltd.
+ *    Author: Jeongseok Kim <jeongseok.kim@sk.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include "config.h"
+
+#include "gaeul/mjpeg/mjpeg-lease.h"
+
+#define START_TIME      (1000 * GAEUL_MJPEG_LEASE_TICK)
+
+static guint
+_wheel_count_leases (GaeulMjpegLeaseWheel * wheel)
+{
+  guint n_leases = 0;
+  guint i;
+
+  for (i = 0; i < GAEUL_MJPEG_LEASE_WHEEL_SLOTS; i++) {
+    n_leases += g_queue_get_length (&wheel->slots[i]);
+  }
+
+  return n_leases;
+}
+
+static void
+test_gaeul_mjpeg_lease_expire (void)
+{
+  GaeulMjpegLeaseWheel wheel;
+  g_autoptr (GaeulMjpegLease) lease = gaeul_mjpeg_lease_new ("request");
+  g_autoptr (GPtrArray) expired = NULL;
+  gint64 now = START_TIME;
+
+  gaeul_mjpeg_lease_wheel_init (&wheel, now);
+  gaeul_mjpeg_lease_wheel_renew (&wheel, lease,
+      now + 5 * GAEUL_MJPEG_LEASE_TICK);
+  g_assert_true (gaeul_mjpeg_lease_is_scheduled (lease));
+
+  expired = gaeul_mjpeg_lease_wheel_turn (&wheel,
+      now + 4 * GAEUL_MJPEG_LEASE_TICK);
+  g_assert_cmpuint (expired->len, ==, 0);
+  g_clear_pointer (&expired, g_ptr_array_unref);
+
+  /* Renewing pushes the deadline back, and the lease stays in its slot
+   * until it comes up. */
+  gaeul_mjpeg_lease_wheel_renew (&wheel, lease,
+      now + 8 * GAEUL_MJPEG_LEASE_TICK);
+  g_assert_cmpuint (_wheel_count_leases (&wheel), ==, 1);
+
+  expired = gaeul_mjpeg_lease_wheel_turn (&wheel,
+      now + 6 * GAEUL_MJPEG_LEASE_TICK);
+  g_assert_cmpuint (expired->len, ==, 0);
+  g_assert_true (gaeul_mjpeg_lease_is_scheduled (lease));
+  g_clear_pointer (&expired, g_ptr_array_unref);
+
+  expired = gaeul_mjpeg_lease_wheel_turn (&wheel,
+      now + 8 * GAEUL_MJPEG_LEASE_TICK);
+  g_assert_cmpuint (expired->len, ==, 1);
+  g_assert_cmpstr (g_ptr_array_index (expired, 0), ==, "request");
+  g_assert_false (gaeul_mjpeg_lease_is_scheduled (lease));
+  g_assert_cmpuint (_wheel_count_leases (&wheel), ==, 0);
+}
+
+/* A lease renewed while it is being checked is back on the wheel before
+ * the check finds it renewed and schedules it again. */
+static void
+test_gaeul_mjpeg_lease_renew_while_checked (void)
+{
+  GaeulMjpegLeaseWheel wheel;
+  GaeulMjpegLease *lease = gaeul_mjpeg_lease_new ("request");
+  g_autoptr (GPtrArray) expired = NULL;
+  gint64 now = START_TIME;
+  guint i;
+
+  gaeul_mjpeg_lease_wheel_init (&wheel, now);
+  gaeul_mjpeg_lease_wheel_renew (&wheel, lease,
+      now + 2 * GAEUL_MJPEG_LEASE_TICK);
+
+  now += 2 * GAEUL_MJPEG_LEASE_TICK;
+  expired = gaeul_mjpeg_lease_wheel_turn (&wheel, now);
+  g_assert_cmpuint (expired->len, ==, 1);
+  g_assert_false (gaeul_mjpeg_lease_is_scheduled (lease));
+  g_clear_pointer (&expired, g_ptr_array_unref);
+
+  /* an HTTP client or KeepAlive during the check */
+  gaeul_mjpeg_lease_wheel_renew (&wheel, lease,
+      now + 10 * GAEUL_MJPEG_LEASE_TICK);
+  g_assert_true (gaeul_mjpeg_lease_is_scheduled (lease));
+
+  /* the check, finding the lease renewed */
+  gaeul_mjpeg_lease_wheel_schedule (&wheel, lease);
+  g_assert_cmpuint (_wheel_count_leases (&wheel), ==, 1);
+
+  /* Once freed, nothing is left of it on the wheel. */
+  gaeul_mjpeg_lease_free (lease);
+  g_assert_cmpuint (_wheel_count_leases (&wheel), ==, 0);
+
+  for (i = 1; i <= GAEUL_MJPEG_LEASE_WHEEL_SLOTS; i++) {
+    expired = gaeul_mjpeg_lease_wheel_turn (&wheel,
+        now + i * GAEUL_MJPEG_LEASE_TICK);
+    g_assert_cmpuint (expired->len, ==, 0);
+    g_clear_pointer (&expired, g_ptr_array_unref);
+  }
+}
+
+/* A deadline earlier than the slot of the lease moves it there. */
+static void
+test_gaeul_mjpeg_lease_schedule_earlier (void)
+{
+  GaeulMjpegLeaseWheel wheel;
+  g_autoptr (GaeulMjpegLease) lease = gaeul_mjpeg_lease_new ("request");
+  g_autoptr (GPtrArray) expired = NULL;
+  gint64 now = START_TIME;
+
+  gaeul_mjpeg_lease_wheel_init (&wheel, now);
+  gaeul_mjpeg_lease_wheel_renew (&wheel, lease,
+      now + 30 * GAEUL_MJPEG_LEASE_TICK);
+  gaeul_mjpeg_lease_wheel_renew (&wheel, lease,
+      now + 3 * GAEUL_MJPEG_LEASE_TICK);
+  g_assert_cmpuint (_wheel_count_leases (&wheel), ==, 1);
+
+  expired = gaeul_mjpeg_lease_wheel_turn (&wheel,
+      now + 3 * GAEUL_MJPEG_LEASE_TICK);
+  g_assert_cmpuint (expired->len, ==, 1);
+}
+
+/* An eager start is due when its first client is, long before its lease
+ * runs out, unless the client arrived. */
+static void
+test_gaeul_mjpeg_lease_arrival (void)
+{
+  GaeulMjpegLeaseWheel wheel;
+  g_autoptr (GaeulMjpegLease) lease = gaeul_mjpeg_lease_new ("request");
+  g_autoptr (GPtrArray) expired = NULL;
+  gint64 now = START_TIME;
+
+  gaeul_mjpeg_lease_wheel_init (&wheel, now);
+  gaeul_mjpeg_lease_wheel_renew (&wheel, lease,
+      now + 60 * GAEUL_MJPEG_LEASE_TICK);
+  lease->arrival_deadline = now + 10 * GAEUL_MJPEG_LEASE_TICK;
+  gaeul_mjpeg_lease_wheel_schedule (&wheel, lease);
+  g_assert_cmpuint (_wheel_count_leases (&wheel), ==, 1);
+
+  expired = gaeul_mjpeg_lease_wheel_turn (&wheel,
+      now + 10 * GAEUL_MJPEG_LEASE_TICK);
+  g_assert_cmpuint (expired->len, ==, 1);
+  g_clear_pointer (&expired, g_ptr_array_unref);
+
+  /* The client arrives while the lease is being checked. */
+  lease->arrival_deadline = 0;
+  gaeul_mjpeg_lease_wheel_schedule (&wheel, lease);
+
+  expired = gaeul_mjpeg_lease_wheel_turn (&wheel,
+      now + 59 * GAEUL_MJPEG_LEASE_TICK);
+  g_assert_cmpuint (expired->len, ==, 0);
+  g_assert_true (gaeul_mjpeg_lease_is_scheduled (lease));
+  g_clear_pointer (&expired, g_ptr_array_unref);
+
+  expired = gaeul_mjpeg_lease_wheel_turn (&wheel,
+      now + 60 * GAEUL_MJPEG_LEASE_TICK);
+  g_assert_cmpuint (expired->len, ==, 1);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/gaeul/mjpeg/lease-expire", test_gaeul_mjpeg_lease_expire);
+
+  g_test_add_func ("/gaeul/mjpeg/lease-renew-while-checked",
+      test_gaeul_mjpeg_lease_renew_while_checked);
+
+  g_test_add_func ("/gaeul/mjpeg/lease-schedule-earlier",
+      test_gaeul_mjpeg_lease_schedule_earlier);
+
+  g_test_add_func ("/gaeul/mjpeg/lease-arrival",
+      test_gaeul_mjpeg_lease_arrival);
+
+  return g_test_run ();
+}
@@ -0,0 +1,96 @@
+/**
+ *  Copyright 2020 SK Telecom Co., Ltd.
+ *    Author: Jeongseok Kim <jeongseok.kim@sk.com>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#include "config.h"
+
+#include "gaeul/mjpeg/mjpeg-mosaic.h"
+
+static void
+test_gaeul_mjpeg_mosaic_layout (void)
+{
+  g_autoptr (GError) error = NULL;
+  guint columns = 0;
+  guint rows = 0;
+
+  g_assert_true (gaeul_mjpeg_mosaic_parse_layout ("", 1, &columns, &rows,
+          &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (columns, ==, 1);
+  g_assert_cmpuint (rows, ==, 1);
+
+  g_assert_true (gaeul_mjpeg_mosaic_parse_layout ("auto", 5, &columns, &rows,
+          &error));
+  g_assert_cmpuint (columns, ==, 3);
+  g_assert_cmpuint (rows, ==, 2);
+
+  g_assert_true (gaeul_mjpeg_mosaic_parse_layout ("", 9, &columns, &rows,
+          &error));
+  g_assert_cmpuint (columns, ==, 3);
+  g_assert_cmpuint (rows, ==, 3);
+
+  g_assert_true (gaeul_mjpeg_mosaic_parse_layout ("4x1", 3, &columns, &rows,
+          &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (columns, ==, 4);
+  g_assert_cmpuint (rows, ==, 1);
+
+  g_assert_false (gaeul_mjpeg_mosaic_parse_layout ("2x2", 5, &columns, &rows,
+          &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+  g_clear_error (&error);
+
+  g_assert_false (gaeul_mjpeg_mosaic_parse_layout ("", 0, &columns, &rows,
+          &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+  g_clear_error (&error);
+}
+
+static void
+test_gaeul_mjpeg_mosaic_layout_invalid (void)
+{
+  const gchar *layouts[] = { "2", "x2", "2x", "0x2", "2x0", "-1x2", "2x2x2",
+    "2 x2", "grid",
+  };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (layouts); i++) {
+    g_autoptr (GError) error = NULL;
+    guint columns = 0;
+    guint rows = 0;
+
+    g_assert_false (gaeul_mjpeg_mosaic_parse_layout (layouts[i], 1, &columns,
+            &rows, &error));
+    g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  /* Don't treat warnings as fatal, which is GTest default. */
+  g_log_set_always_fatal (G_LOG_FATAL_MASK | G_LOG_LEVEL_CRITICAL);
+
+  g_test_add_func ("/gaeul/mjpeg/mosaic-layout",
+      test_gaeul_mjpeg_mosaic_layout);
+
+  g_test_add_func ("/gaeul/mjpeg/mosaic-layout-invalid",
+      test_gaeul_mjpeg_mosaic_layout_invalid);
+
+  return g_test_run ();
+}
@@ -15,6 +15,8 @@
  *  limitations under the License.
  *
  */
+#include "config.h"
+
 #include "gaeul/mjpeg/mjpeg-request.h"
 
 static void
@@ -23,7 +25,8 @@ test_gaeul_mjpeg_request_create (void)
   g_autoptr (GaeulMjpegRequest) r = NULL;
   GaeulMjpegRequest *tmp = NULL;
 
-  r = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 1920, 1080, 30, 0, 0);
+  r = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 1920, 1080, 30, 0, 0,
+      GAEUL_MJPEG_REQUEST_FLAG_NONE);
 
   g_assert_nonnull (r);
 
@@ -40,13 +43,221 @@ test_gaeul_mjpeg_request_compare (void)
   g_autoptr (GaeulMjpegRequest) r1 = NULL;
   g_autoptr (GaeulMjpegRequest) r2 = NULL;
   g_autoptr (GaeulMjpegRequest) r3 = NULL;
+  g_autoptr (GaeulMjpegRequest) r4 = NULL;
 
-  r1 = gaeul_mjpeg_request_new ("uid1", "rid1", 100, 100, 1920, 1080, 30, 0, 0);
-  r2 = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 1920, 1080, 30, 0, 0);
-  r3 = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 1920, 1080, 30, 0, 0);
+  r1 = gaeul_mjpeg_request_new ("uid1", "rid1", 100, 100, 1920, 1080, 30, 0, 0,
+      GAEUL_MJPEG_REQUEST_FLAG_NONE);
+  r2 = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 1920, 1080, 30, 0, 0,
+      GAEUL_MJPEG_REQUEST_FLAG_NONE);
+  r3 = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 1920, 1080, 30, 0, 0,
+      GAEUL_MJPEG_REQUEST_FLAG_NONE);
+  r4 = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 1920, 1080, 5, 0, 0,
+      GAEUL_MJPEG_REQUEST_FLAG_NONE);
 
   g_assert_false (gaeul_mjpeg_request_equal (r1, r2));
   g_assert_true (gaeul_mjpeg_request_equal (r2, r3));
+
+  /* Requests that only differ in frame rate share a pipeline. */
+  g_assert_true (gaeul_mjpeg_request_equal (r2, r4));
+  g_assert_cmpuint (gaeul_mjpeg_request_hash (r2), ==,
+      gaeul_mjpeg_request_hash (r4));
+}
+
+static void
+test_gaeul_mjpeg_request_hash (void)
+{
+  g_autoptr (GaeulMjpegRequest) r1 = NULL;
+  g_autoptr (GaeulMjpegRequest) r2 = NULL;
+  g_autoptr (GaeulMjpegRequest) r3 = NULL;
+  g_autoptr (GaeulMjpegRequest) r4 = NULL;
+  g_autofree gchar *uid = g_strdup ("uid");
+
+  r1 = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 1920, 1080, 30, 0, 0,
+      GAEUL_MJPEG_REQUEST_FLAG_NONE);
+  r2 = gaeul_mjpeg_request_new (uid, "rid", 100, 100, 1920, 1080, 30, 0, 0,
+      GAEUL_MJPEG_REQUEST_FLAG_NONE);
+  r3 = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 1080, 1920, 30, 0, 0,
+      GAEUL_MJPEG_REQUEST_FLAG_NONE);
+  r4 = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 1920, 1080, 30, 0, 0,
+      GAEUL_MJPEG_REQUEST_FLAG_KEYFRAME_ONLY);
+
+  g_assert_true (r1->uid == r2->uid);
+  g_assert_cmpuint (gaeul_mjpeg_request_hash (r1), ==,
+      gaeul_mjpeg_request_hash (r2));
+  g_assert_cmpuint (gaeul_mjpeg_request_parameter_hash (r1), ==,
+      gaeul_mjpeg_request_parameter_hash (r2));
+
+  g_assert_false (gaeul_mjpeg_request_equal (r1, r3));
+  g_assert_cmpuint (gaeul_mjpeg_request_hash (r1), !=,
+      gaeul_mjpeg_request_hash (r3));
+
+  g_assert_false (gaeul_mjpeg_request_equal (r1, r4));
+}
+
+static gint
+_get_video_direction (guint flip, guint orientation)
+{
+  g_autoptr (GaeulMjpegRequest) r = NULL;
+
+  r = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 1920, 1080, 30, flip,
+      orientation, GAEUL_MJPEG_REQUEST_FLAG_NONE);
+
+  return gaeul_mjpeg_request_get_video_direction (r);
+}
+
+static void
+test_gaeul_mjpeg_request_direction (void)
+{
+  g_autoptr (GaeulMjpegRequest) r1 = NULL;
+  g_autoptr (GaeulMjpegRequest) r2 = NULL;
+  g_autoptr (GaeulMjpegRequest) r3 = NULL;
+  g_autoptr (GaeulMjpegRequest) r4 = NULL;
+  g_autoptr (GaeulMjpegRequest) r5 = NULL;
+
+  /* identity, 90r, 180 and 90l alone */
+  g_assert_cmpint (_get_video_direction (0, 0), ==, 0);
+  g_assert_cmpint (_get_video_direction (0, 1), ==, 1);
+  g_assert_cmpint (_get_video_direction (0, 2), ==, 2);
+  g_assert_cmpint (_get_video_direction (0, 3), ==, 3);
+
+  /* flips followed by rotations */
+  g_assert_cmpint (_get_video_direction (4, 0), ==, 4);
+  g_assert_cmpint (_get_video_direction (4, 1), ==, 7);
+  g_assert_cmpint (_get_video_direction (4, 2), ==, 5);
+  g_assert_cmpint (_get_video_direction (4, 3), ==, 6);
+  g_assert_cmpint (_get_video_direction (5, 1), ==, 6);
+  g_assert_cmpint (_get_video_direction (5, 2), ==, 4);
+  g_assert_cmpint (_get_video_direction (5, 3), ==, 7);
+
+  /* auto has no fixed direction */
+  g_assert_cmpint (_get_video_direction (0, 8), ==, -1);
+
+  r1 = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 1280, 720, 30, 0, 0,
+      GAEUL_MJPEG_REQUEST_FLAG_NONE);
+  r2 = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 1280, 720, 30, 4, 1,
+      GAEUL_MJPEG_REQUEST_FLAG_NONE);
+  r3 = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 1280, 720, 30, 0, 8,
+      GAEUL_MJPEG_REQUEST_FLAG_NONE);
+  r4 = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 640, 360, 30, 0, 0,
+      GAEUL_MJPEG_REQUEST_FLAG_NONE);
+  r5 = gaeul_mjpeg_request_new ("uid", "rid", 100, 100, 640, 360, 30, 0, 1,
+      GAEUL_MJPEG_REQUEST_FLAG_NONE);
+
+  g_assert_false (gaeul_mjpeg_request_equal (r1, r3));
+  g_assert_false (gaeul_mjpeg_request_equal (r2, r3));
+
+  /* 360 lines end with half an MCU, which can't be moved losslessly. */
+  g_assert_false (gaeul_mjpeg_request_has_lossless_direction (r4));
+  g_assert_false (gaeul_mjpeg_request_has_lossless_direction (r5));
+  g_assert_false (gaeul_mjpeg_request_equal (r4, r5));
+
+#ifdef HAVE_TURBOJPEG
+  /* Flips and rotations are done on the JPEGs of a shared encode. */
+  g_assert_true (gaeul_mjpeg_request_equal (r1, r2));
+  g_assert_cmpuint (gaeul_mjpeg_request_hash (r1), ==,
+      gaeul_mjpeg_request_hash (r2));
+#else
+  g_assert_false (gaeul_mjpeg_request_equal (r1, r2));
+#endif
+}
+
+#define N_LIVE_REQUESTS 10000
+
+/* The hash that used to be computed on every lookup. */
+static guint
+_printf_request_hash (GaeulMjpegRequest * r)
+{
+  g_autofree gchar *str = NULL;
+
+  str = g_strdup_printf ("%s%s"
+      "%" G_GUINT32_FORMAT "%" G_GUINT32_FORMAT
+      "%" G_GINT32_FORMAT "%" G_GINT32_FORMAT "%" G_GINT32_FORMAT
+      "%" G_GUINT32_FORMAT "%" G_GUINT32_FORMAT,
+      r->uid, r->rid, r->protocol_latency, r->demux_latency,
+      r->width, r->height, r->fps, r->flip, r->orientation);
+
+  return g_str_hash (str);
+}
+
+static void
+test_gaeul_mjpeg_request_lookup_benchmark (void)
+{
+  g_autoptr (GPtrArray) requests = NULL;
+  g_autoptr (GPtrArray) probes = NULL;
+  g_autoptr (GHashTable) printf_table = NULL;
+  g_autoptr (GHashTable) table = NULL;
+  g_autoptr (GTimer) timer = NULL;
+  gdouble scan_time, printf_time, lookup_time;
+  guint i;
+
+  if (!g_test_perf ()) {
+    g_test_skip ("Benchmark only runs in perf mode (-m perf)");
+    return;
+  }
+
+  requests = g_ptr_array_new_with_free_func ((GDestroyNotify)
+      gaeul_mjpeg_request_unref);
+  probes = g_ptr_array_new_with_free_func ((GDestroyNotify)
+      gaeul_mjpeg_request_unref);
+
+  printf_table = g_hash_table_new ((GHashFunc) _printf_request_hash,
+      (GEqualFunc) gaeul_mjpeg_request_equal);
+  table = g_hash_table_new ((GHashFunc) gaeul_mjpeg_request_hash,
+      (GEqualFunc) gaeul_mjpeg_request_equal);
+
+  for (i = 0; i < N_LIVE_REQUESTS; i++) {
+    g_autofree gchar *uid = g_strdup_printf ("uid-%u", i % 100);
+    g_autofree gchar *rid = g_strdup_printf ("rid-%u", i);
+    GaeulMjpegRequest *r =
+        gaeul_mjpeg_request_new (uid, rid, 125, 65, 640, 480, 15, 0, 0,
+        GAEUL_MJPEG_REQUEST_FLAG_NONE);
+
+    g_ptr_array_add (requests, r);
+    g_hash_table_add (printf_table, r);
+    g_hash_table_add (table, r);
+
+    /* Start builds a new request before looking up a running pipeline. */
+    g_ptr_array_add (probes,
+        gaeul_mjpeg_request_new (uid, rid, 125, 65, 640, 480, 15, 0, 0,
+            GAEUL_MJPEG_REQUEST_FLAG_NONE));
+  }
+
+  timer = g_timer_new ();
+
+  /* linear scan over the running pipelines for every Start */
+  for (i = 0; i < probes->len; i++) {
+    GHashTableIter iter;
+    gpointer key;
+    gboolean found = FALSE;
+
+    g_hash_table_iter_init (&iter, table);
+    while (!found && g_hash_table_iter_next (&iter, &key, NULL)) {
+      found = gaeul_mjpeg_request_equal (key, g_ptr_array_index (probes, i));
+    }
+    g_assert_true (found);
+  }
+  scan_time = g_timer_elapsed (timer, NULL);
+
+  g_timer_start (timer);
+  for (i = 0; i < probes->len; i++) {
+    g_assert_nonnull (g_hash_table_lookup (printf_table,
+            g_ptr_array_index (probes, i)));
+  }
+  printf_time = g_timer_elapsed (timer, NULL);
+
+  g_timer_start (timer);
+  for (i = 0; i < probes->len; i++) {
+    g_assert_nonnull (g_hash_table_lookup (table,
+            g_ptr_array_index (probes, i)));
+  }
+  lookup_time = g_timer_elapsed (timer, NULL);
+
+  g_test_message ("%u lookups among %u live requests: linear scan %.3f ms, "
+      "printf hash %.3f ms, precomputed hash %.3f ms", probes->len,
+      requests->len, scan_time * 1000, printf_time * 1000, lookup_time * 1000);
+
+  g_test_minimized_result (lookup_time * 1000,
+      "precomputed hash lookup: %.3f ms", lookup_time * 1000);
 }
 
 int
@@ -63,5 +274,13 @@ main (int argc, char *argv[])
   g_test_add_func ("/gaeul/mjpeg/request-compare",
       test_gaeul_mjpeg_request_compare);
 
+  g_test_add_func ("/gaeul/mjpeg/request-hash", test_gaeul_mjpeg_request_hash);
+
+  g_test_add_func ("/gaeul/mjpeg/request-direction",
+      test_gaeul_mjpeg_request_direction);
+
+  g_test_add_func ("/gaeul/mjpeg/request-lookup-benchmark",
+      test_gaeul_mjpeg_request_lookup_benchmark);
+
   return g_test_run ();
 }
@@ -55,6 +55,34 @@ test_gaeul_tuple_insert_remove (void)
   g_assert_false (gaeul_tuple_remove (tuple, "key1", "key2"));
 }
 
+static void
+_count_foreach_cb (const gchar * first_key, const gchar * second_key,
+    GObject * object, gpointer user_data)
+{
+  guint *count = user_data;
+
+  g_assert_nonnull (object);
+  g_assert_true (g_str_has_prefix (first_key, "key"));
+  g_assert_true (g_str_has_prefix (second_key, "sub"));
+
+  (*count)++;
+}
+
+static void
+test_gaeul_tuple_foreach (void)
+{
+  g_autoptr (GaeulTuple) tuple = gaeul_tuple_new ();
+  g_autoptr (GaeulTestObject) obj = g_object_new (GAEUL_TYPE_TEST_OBJECT, NULL);
+  guint count = 0;
+
+  g_assert_true (gaeul_tuple_insert (tuple, "key1", "sub1", G_OBJECT (obj)));
+  g_assert_true (gaeul_tuple_insert (tuple, "key1", "sub2", G_OBJECT (obj)));
+  g_assert_true (gaeul_tuple_insert (tuple, "key2", "sub1", G_OBJECT (obj)));
+
+  gaeul_tuple_foreach (tuple, _count_foreach_cb, &count);
+  g_assert_cmpuint (count, ==, 3);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -66,5 +94,7 @@ main (int argc, char *argv[])
   g_test_add_func ("/gaeul/tuple-insert-remove",
       test_gaeul_tuple_insert_remove);
 
+  g_test_add_func ("/gaeul/tuple-foreach", test_gaeul_tuple_foreach);
+
   return g_test_run ();
 }